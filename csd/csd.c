@@ -34,12 +34,18 @@
 #include <log.h>
 #include <pgcommon.h>
 #include <pgctxpool.h>
+#include <session.h>
 #include <authz.h>
 #include <util.h>
 
 #include <csd.h>
 
 #define MAXCONNS 100
+#define WORKERS 8
+#define COMPRESSION 6
+#define COMPRESSION_MIN 1024
+#define LISTENERS 1
+#define BACKLOG 128
 
 int main(int argc, char **argv)
 {
@@ -55,10 +61,22 @@ int main(int argc, char **argv)
     const char *pguser = NULL;
     const char *pgpasswd = NULL;
     int maxconns = MAXCONNS, dbconns = 1, nport;
-    char maxconns_str[3];
+    char maxconns_str[12];
+    int workers = WORKERS;
+    char workers_str[12];
+    int compression = COMPRESSION, compression_min = COMPRESSION_MIN;
+    char compression_str[12], compression_min_str[12];
+    int listeners = LISTENERS, pinlisteners = 0;
+    char listeners_str[12], pinlisteners_str[12];
+    int backlog = BACKLOG, deferaccept = 0;
+    char backlog_str[12], deferaccept_str[12];
+    int shedlimit = -1;
+    int usercachettl = AUTHZ_CACHE_TTL;
+    char shedlimit_str[12];
     const char *port = NULL;
     const char *prefix = NULL;
     const char *ntlmhelper = NULL;
+    const char *sessionstore = NULL;
     const char *smbhost = NULL;
     const char *smbuser = NULL;
     const char *smbpasswd = NULL;
@@ -119,6 +137,10 @@ int main(int argc, char **argv)
         ntlmhelper = "";
     }
 
+    config_lookup_string(&config, "sessionstore", &sessionstore);
+    if (!sessionstore)
+        sessionstore = "local";
+
     config_lookup_string(&config, "smbhost", &smbhost);
     if (!smbhost) {
         log_warn("smbhost is not set");
@@ -137,12 +159,66 @@ int main(int argc, char **argv)
         smbpasswd = "";
     }
 
+    config_lookup_int(&config, "usercachettl", &usercachettl);
+    if (usercachettl < 0) {
+        log_warn("usercachettl must be zero or greater (was %d)", usercachettl);
+        usercachettl = AUTHZ_CACHE_TTL;
+    }
+
     config_lookup_int(&config, "team-foundation.maxconns", &maxconns);
     if (maxconns < 1) {
         log_warn("maxconns must be at least 1 (was %d)", maxconns);
         maxconns = MAXCONNS;
     }
-    snprintf(maxconns_str, 3, "%d", maxconns);
+    snprintf(maxconns_str, 12, "%d", maxconns);
+
+    config_lookup_int(&config, "team-foundation.workers", &workers);
+    if (workers < 1) {
+        log_warn("workers must be at least 1 (was %d)", workers);
+        workers = WORKERS;
+    }
+    snprintf(workers_str, 12, "%d", workers);
+
+    config_lookup_int(&config, "team-foundation.compression", &compression);
+    if (compression < 0 || compression > 9) {
+        log_warn("compression must be between 0 and 9 (was %d)", compression);
+        compression = COMPRESSION;
+    }
+    snprintf(compression_str, 12, "%d", compression);
+
+    config_lookup_int(&config, "team-foundation.compression-min", &compression_min);
+    if (compression_min < 1) {
+        log_warn("compression-min must be at least 1 (was %d)", compression_min);
+        compression_min = COMPRESSION_MIN;
+    }
+    snprintf(compression_min_str, 12, "%d", compression_min);
+
+    config_lookup_int(&config, "team-foundation.listeners", &listeners);
+    if (listeners < 1) {
+        log_warn("listeners must be at least 1 (was %d)", listeners);
+        listeners = LISTENERS;
+    }
+    snprintf(listeners_str, 12, "%d", listeners);
+
+    config_lookup_bool(&config, "team-foundation.pin-listeners", &pinlisteners);
+    snprintf(pinlisteners_str, 12, "%d", pinlisteners);
+
+    config_lookup_int(&config, "team-foundation.backlog", &backlog);
+    if (backlog < 1) {
+        log_warn("backlog must be at least 1 (was %d)", backlog);
+        backlog = BACKLOG;
+    }
+    snprintf(backlog_str, 12, "%d", backlog);
+
+    config_lookup_int(&config, "team-foundation.defer-accept", &deferaccept);
+    if (deferaccept < 0) {
+        log_warn("defer-accept must not be negative (was %d)", deferaccept);
+        deferaccept = 0;
+    }
+    snprintf(deferaccept_str, 12, "%d", deferaccept);
+
+    config_lookup_int(&config, "team-foundation.shed-limit", &shedlimit);
+    snprintf(shedlimit_str, 12, "%d", shedlimit);
 
     config_lookup_int(&config, "team-foundation.dbconns", &dbconns);
     if (dbconns < 1) {
@@ -174,7 +250,7 @@ int main(int argc, char **argv)
     }
 
     httpd_set_timeout(10);
-    soapargs = (char **)calloc(7, sizeof(char *));
+    soapargs = (char **)calloc(23, sizeof(char *));
     soapargs[0] = argv[0];
     soapargs[1] = "-NHTTPport";
     soapargs[2] = strdup(port);
@@ -182,13 +258,38 @@ int main(int argc, char **argv)
     soapargs[4] = strdup(maxconns_str);
     soapargs[5] = "-NHTTPntlmhelper";
     soapargs[6] = strdup(ntlmhelper);
-    soaperr = soap_server_init_args(7, soapargs);
+    soapargs[7] = "-NHTTPworkers";
+    soapargs[8] = strdup(workers_str);
+    soapargs[9] = "-NHTTPgziplevel";
+    soapargs[10] = strdup(compression_str);
+    soapargs[11] = "-NHTTPgzipmin";
+    soapargs[12] = strdup(compression_min_str);
+    soapargs[13] = "-NHTTPlisteners";
+    soapargs[14] = strdup(listeners_str);
+    soapargs[15] = "-NHTTPpincpus";
+    soapargs[16] = strdup(pinlisteners_str);
+    soapargs[17] = "-NHTTPbacklog";
+    soapargs[18] = strdup(backlog_str);
+    soapargs[19] = "-NHTTPdeferaccept";
+    soapargs[20] = strdup(deferaccept_str);
+    soapargs[21] = "-NHTTPshedlimit";
+    soapargs[22] = strdup(shedlimit_str);
+    soaperr = soap_server_init_args(23, soapargs);
+
+    /* requests blocked on the database count towards the load */
+    httpd_set_load_probe(pg_pool_waiters);
+
+    if (!session_store_open(sessionstore)) {
+        log_fatal("failed to open session store %s", sessionstore);
+        goto cleanup_db;
+    }
 
     if (!core_services_init(prefix)) {
         log_fatal("core services failed to start!");
         goto cleanup_db;
     }
 
+    authz_set_cache_ttl(usercachettl);
     authz_init(smbhost, smbuser, smbpasswd);
 
     log_notice("starting SOAP server");
@@ -198,6 +299,14 @@ int main(int argc, char **argv)
     soap_server_destroy();
 
     free(soapargs[2]);
+    free(soapargs[8]);
+    free(soapargs[10]);
+    free(soapargs[12]);
+    free(soapargs[14]);
+    free(soapargs[16]);
+    free(soapargs[18]);
+    free(soapargs[20]);
+    free(soapargs[22]);
     free(soapargs);
 
     authz_free();
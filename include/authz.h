@@ -19,6 +19,11 @@
 
 #pragma once
 
+#define AUTHZ_CACHE_TTL     300     /* seconds a user lookup is cached */
+#define AUTHZ_NEGATIVE_TTL  30      /* seconds an unknown user is cached */
+#define AUTHZ_CACHE_SIZE    4096
+#define AUTHZ_CACHE_BUCKETS 1024
+
 typedef struct {
     char *logon_name;
     char *domain;
@@ -26,8 +31,17 @@ typedef struct {
     char *sid;
 } userinfo_t;
 
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;            /* served while being refreshed */
+    unsigned long failures;         /* lookups that failed for other reasons than an unknown user */
+} authz_stats_t;
+
 int authz_init(const char *, const char *, const char *);
 void authz_free();
+void authz_set_cache_ttl(int);
+void authz_get_stats(authz_stats_t *);
 userinfo_t *authz_lookup_user(const char *);
 void authz_free_buffer(userinfo_t *);
 
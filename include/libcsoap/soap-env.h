@@ -38,6 +38,7 @@ typedef struct _SoapEnv
   xmlNodePtr header;
   xmlNodePtr body;
   xmlNodePtr cur; /** Pointer to the current xml element. (stack) */
+  int fault; /** Set if the envelope was created as a fault */
 } SoapEnv;
 
 #ifdef __cplusplus
@@ -56,7 +57,9 @@ extern "C" {
    @param faultstring A fault message
    @param faultactor The fault actor (This can be NULL)
    @param detail The detail of the error (This can be NULL)
-   @param out the result envelope out parameter like follows
+   @param out the result envelope out parameter like follows.
+     Its fault flag is set, so the server answers with status 500
+     without searching the document for the Fault element.
    @returns H_OK if success
 
    <pre>
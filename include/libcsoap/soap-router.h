@@ -36,8 +36,11 @@ typedef struct _SoapRouter
   SoapServiceNode *service_tail;
   SoapService *default_service;
   httpd_auth auth;
+  httpd_priority priority;
   xmlDocPtr wsdl;
   char *tag;
+  SoapService **table;          /* services by hash, see soap_router_compile() */
+  unsigned long mask;
 } SoapRouter;
 
 
@@ -79,6 +82,15 @@ void soap_router_register_description(SoapRouter *router, xmlDocPtr doc);
 
 void soap_router_register_security(SoapRouter *router, httpd_auth auth);
 
+/**
+   Sets the admission priority of the router's services. Must be
+   called before the router is registered with the server.
+
+   @param router The router object
+   @param priority Shedding order when the server is saturated
+ */
+void soap_router_set_priority(SoapRouter *router, httpd_priority priority);
+
 /**
    Searches for a registered soap service.
 
@@ -92,6 +104,19 @@ SoapService *soap_router_find_service(SoapRouter * router,
                                       const char *urn, const char *method);
 
 
+/**
+   Builds the hash table soap_router_find_service() looks services
+   up in. The table is never changed afterwards, so it can be read
+   by many threads without locking. No services can be registered
+   to a compiled router.
+
+   @param router The router object
+
+   @return 1 on success, 0 on failure
+ */
+int soap_router_compile(SoapRouter * router);
+
+
 /**
    Frees the router object.
 
@@ -35,6 +35,7 @@ typedef struct _SoapService
   char *urn;
   char *method;
   SoapServiceFunc func;
+  unsigned long hash;           /* of urn and method */
 } SoapService;
 
 
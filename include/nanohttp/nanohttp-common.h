@@ -30,6 +30,9 @@
 #define HEADER_CONTENT_ID		"Content-Id"
 #define HEADER_CONTENT_TRANSFER_ENCODING "Content-Transfer-Encoding"
 #define TRANSFER_ENCODING_CHUNKED	"chunked"
+#define CONTENT_ENCODING_GZIP		"gzip"
+#define CONTENT_ENCODING_DEFLATE	"deflate"
+#define EXPECT_CONTINUE			"100-continue"
 
 /**
  *
@@ -128,6 +131,28 @@
 #define HEADER_USER_AGENT		"User-Agent"
 #define HEADER_X_TFS_SESSION    "X-TFS-Session"
 #define HEADER_X_TFS_VERSION    "X-TFS-Version"
+#define HEADER_SOAP_ACTION      "SoapAction"
+
+/*
+  Headers the server looks at on every request. The request
+  parser classifies these once and keeps their values in a slot
+  array, so that lookups do not scan the header list.
+ */
+typedef enum hheader_id
+{
+  HHEADER_UNKNOWN = -1,
+  HHEADER_CONTENT_TYPE,
+  HHEADER_CONTENT_LENGTH,
+  HHEADER_TRANSFER_ENCODING,
+  HHEADER_CONNECTION,
+  HHEADER_AUTHORIZATION,
+  HHEADER_SOAP_ACTION,
+  HHEADER_X_TFS_SESSION,
+  HHEADER_ACCEPT_ENCODING,
+  HHEADER_CONTENT_ENCODING,
+  HHEADER_EXPECT,
+  HHEADER_MAX
+} hheader_id_t;
 
 /**
  *
@@ -138,12 +163,37 @@
 #define NHTTPD_ARG_TERMSIG	"-NHTTPtsig"
 #define NHTTPD_ARG_MAXCONN	"-NHTTPmaxconn"
 #define NHTTPD_ARG_TIMEOUT	"-NHTTPtimeout"
+#define NHTTPD_ARG_IDLETIMEOUT	"-NHTTPidletimeout"
+#define NHTTPD_ARG_HEADERTIMEOUT	"-NHTTPheadertimeout"
+#define NHTTPD_ARG_BODYTIMEOUT	"-NHTTPbodytimeout"
+#define NHTTPD_ARG_HANDLERTIMEOUT	"-NHTTPhandlertimeout"
 #define NHTTPD_ARG_NTLMHELP "-NHTTPntlmhelper"
+#define NHTTPD_ARG_NTLMHELPERS	"-NHTTPntlmhelpers"
+#define NHTTPD_ARG_NTLMTIMEOUT	"-NHTTPntlmtimeout"
+#define NHTTPD_ARG_SESSIONS	"-NHTTPsessions"
+#define NHTTPD_ARG_SESSIONTTL	"-NHTTPsessionttl"
+#define NHTTPD_ARG_WORKERS	"-NHTTPworkers"
+#define NHTTPD_ARG_LISTENERS	"-NHTTPlisteners"
+#define NHTTPD_ARG_BACKLOG	"-NHTTPbacklog"
+#define NHTTPD_ARG_DEFERACCEPT	"-NHTTPdeferaccept"
+#define NHTTPD_ARG_PINCPUS	"-NHTTPpincpus"
+#define NHTTPD_ARG_SHEDLIMIT	"-NHTTPshedlimit"
+#define NHTTPD_ARG_RETRYAFTER	"-NHTTPretryafter"
+#define NHTTPD_ARG_GZIPLEVEL	"-NHTTPgziplevel"
+#define NHTTPD_ARG_GZIPMIN	"-NHTTPgzipmin"
+#define NHTTPD_ARG_MIMESPILL	"-NHTTPmimespill"
+#define NHTTPD_ARG_MIMEPARTS	"-NHTTPmimeparts"
+#define NHTTPD_ARG_MIMEDIR	"-NHTTPmimedir"
 
 #define NHTTP_ARG_CERT		"-NHTTPcert"
 #define NHTTP_ARG_CERTPASS	"-NHTTPcertpass"
 #define NHTTP_ARG_CA		"-NHTTPCA"
 #define NHTTP_ARG_HTTPS		"-NHTTPS"
+#define NHTTP_ARG_CIPHERS	"-NHTTPciphers"
+#define NHTTP_ARG_CIPHERSUITES	"-NHTTPciphersuites"
+#define NHTTP_ARG_SSLCACHE	"-NHTTPsslcache"
+#define NHTTP_ARG_SSLTICKETS	"-NHTTPsslticketlifetime"
+#define NHTTP_ARG_KTLS		"-NHTTPktls"
 
 #ifndef SAVE_STR
 #define SAVE_STR(str) ((str==0)?("(null)"):(str))
@@ -151,7 +201,7 @@
 
 #define BOUNDARY_LENGTH 18
 
-#define MAX_HEADER_SIZE 4256
+#define MAX_HEADER_SIZE 16384      /* room for large NTLM tokens */
 #define MAX_SOCKET_BUFFER_SIZE 4256
 #define MAX_FILE_BUFFER_SIZE 4256
 
@@ -210,6 +260,10 @@
 #define STREAM_ERROR_SOCKET_ERROR	1202
 #define STREAM_ERROR_NO_CHUNK_SIZE	1203
 #define STREAM_ERROR_WRONG_CHUNK_SIZE	1204
+#define STREAM_ERROR_DEFLATE		1205
+#define STREAM_ERROR_INFLATE		1206
+#define STREAM_ERROR_ENCODING		1207
+#define STREAM_ERROR_FRAMING		1208
 
 
 /* MIME errors */
@@ -296,6 +350,62 @@ char *herror_func(herror_t err);
 char *herror_message(herror_t err);
 void herror_release(herror_t err);
 
+/*
+  harena_t is a region allocator for objects which live exactly
+  as long as one request. Allocations are carved out of large
+  blocks and released all at once by harena_reset().
+ */
+#define HARENA_BLOCK_SIZE	4096
+
+typedef struct harena_block harena_block_t;
+struct harena_block
+{
+  harena_block_t *next;
+  size_t size;
+  size_t used;
+};
+
+typedef struct harena
+{
+  harena_block_t *blocks;
+} harena_t;
+
+
+/**
+  Initializes an empty arena. No memory is allocated until
+  the first harena_alloc().
+*/
+void harena_init(harena_t * arena);
+
+
+/**
+  Allocates 'size' bytes from the arena. The memory is suitably
+  aligned for any type and must not be passed to free().
+
+  @returns a pointer to the memory or NULL if malloc() failed.
+*/
+void *harena_alloc(harena_t * arena, size_t size);
+
+
+/**
+  Copies a null terminated string into the arena.
+*/
+char *harena_strdup(harena_t * arena, const char *str);
+
+
+/**
+  Releases everything allocated from the arena. The largest
+  block is kept for reuse, so an arena which is reset after
+  every request stops calling malloc() once it is warm.
+*/
+void harena_reset(harena_t * arena);
+
+
+/**
+  Releases all blocks of the arena.
+*/
+void harena_free(harena_t * arena);
+
 /*
   hpairnode_t represents a pair (key, value) pair.
   This is also a linked list.
@@ -323,6 +433,17 @@ struct hpair
 hpair_t *hpairnode_new(const char *key, const char *value, hpair_t * next);
 
 
+/**
+  Creates a new pair like hpairnode_new(), but the pair and
+  the cloned strings are allocated from 'arena'. Such pairs
+  must not be freed with hpairnode_free().
+
+  @see hpairnode_new
+*/
+hpair_t *hpairnode_new_arena(harena_t * arena, const char *key,
+                             const char *value, hpair_t * next);
+
+
 /**
   Creates a new pair from a given string. This function 
   will split 'str' with the found first delimiter 'delim'.
@@ -386,6 +507,15 @@ char *hpairnode_get(hpair_t * pair, const char *key);
 char *hpairnode_get_ignore_case(hpair_t * pair, const char *key);
 
 
+/**
+  Maps a header name to its hheader_id_t. The case of 'key'
+  is ignored.
+
+  @returns the id or HHEADER_UNKNOWN if the header has no slot.
+*/
+hheader_id_t hheader_classify(const char *key);
+
+
 /**
   This function will create a new pair and fills the 
   (key,value) fields of a given pair. Note that the 'next'
@@ -509,6 +639,15 @@ typedef struct _content_type
 content_type_t *content_type_new(const char *content_type_str);
 
 
+/**
+  Parses the content-type field like content_type_new(), but
+  allocates the object and its parameters from 'arena'. The
+  result must not be passed to content_type_free().
+*/
+content_type_t *content_type_new_arena(harena_t * arena,
+                                       const char *content_type_str);
+
+
 /**
   Frees the given content_type_t object
 */
@@ -529,6 +668,7 @@ typedef struct _part
   char filename[250];
   struct _part *next;
   int deleteOnExit;             /* default is 0 */
+  int fd;                       /* keeps an unnamed part alive, -1 */
 } part_t;
 
 
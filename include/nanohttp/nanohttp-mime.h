@@ -40,7 +40,36 @@ extern "C" {
   "multipart/related"  MIME Message Builder
  ------------------------------------------------------------------*/
 
+/* a message is held in memory up to this size, then its parts are
+   spooled to disk */
+#define MIME_SPILL_SIZE		(1024 * 1024)
+#define MIME_SPOOL_DIR		"/tmp"
 
+/* each part holds a file descriptor */
+#define MIME_MAX_PARTS		64
+
+/**
+  Sets the size beyond which the parts of a received message are
+  written to files.
+
+  @param size size in bytes
+*/
+void mime_set_spill_size(size_t size);
+
+/**
+  Sets the number of parts a message may have. Larger messages
+  are refused.
+
+  @param parts maximum number of parts
+*/
+void mime_set_max_parts(int parts);
+
+/**
+  Sets the directory spooled parts are created in.
+
+  @param dir directory path
+*/
+void mime_set_spool_dir(const char *dir);
 
 herror_t mime_get_attachments(content_type_t * ctype,
                               http_input_stream_t * in,
@@ -0,0 +1,102 @@
+/******************************************************************
+*  $Id$
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2003  Ferhat Ayaz
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+*
+* Email: ferhatayaz@yahoo.com
+******************************************************************/
+#ifndef __nanohttp_queue_h
+#define __nanohttp_queue_h
+
+#include <stddef.h>
+
+#include <nanohttp/nanohttp-common.h>
+
+#define HQUEUE_CACHELINE	64
+
+/**
+  Bounded multi-producer/multi-consumer queue of pointers. Every cell
+  carries a sequence number which tells producers and consumers whether
+  it is theirs to fill or drain, so neither side takes a lock.
+*/
+typedef struct hqueue_cell
+{
+  size_t seq;
+  void *data;
+}
+hqueue_cell_t;
+
+typedef struct hqueue
+{
+  hqueue_cell_t *cells;
+  size_t mask;
+  char pad0[HQUEUE_CACHELINE];
+  size_t head;                  /* next cell to fill */
+  char pad1[HQUEUE_CACHELINE];
+  size_t tail;                  /* next cell to drain */
+  char pad2[HQUEUE_CACHELINE];
+}
+hqueue_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+  Initializes a queue which holds at least 'size' elements. The
+  capacity is rounded up to the next power of two.
+
+  @param queue the queue to initialize
+  @param size minimum number of elements
+
+  @returns H_OK on success or GENERAL_INVALID_PARAM if the cells
+    cannot be allocated.
+*/
+herror_t hqueue_init(hqueue_t * queue, size_t size);
+
+/**
+  Releases the cells of the queue. Pending elements are dropped.
+*/
+void hqueue_destroy(hqueue_t * queue);
+
+/**
+  Appends an element to the queue.
+
+  @returns 1 on success, 0 if the queue is full.
+*/
+int hqueue_push(hqueue_t * queue, void *data);
+
+/**
+  Takes the oldest element from the queue.
+
+  @returns the element or NULL if the queue is empty.
+*/
+void *hqueue_pop(hqueue_t * queue);
+
+/**
+  Returns the number of queued elements. The value is a snapshot and
+  may be stale as soon as it is returned.
+*/
+size_t hqueue_depth(hqueue_t * queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
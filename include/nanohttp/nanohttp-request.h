@@ -36,10 +36,11 @@ typedef struct hrequest
 {
   hreq_method_t method;
   http_version_t version;
-  char path[REQUEST_MAX_PATH_SIZE];
+  char *path;
 
   hpair_t *query;
   hpair_t *header;
+  char *known[HHEADER_MAX];     /* values of the classified headers */
 
   http_input_stream_t *in;
   content_type_t *content_type;
@@ -53,7 +54,48 @@ typedef struct hrequest
 extern "C" {
 #endif
 
-herror_t hrequest_new_from_socket(hsocket_t *sock, hrequest_t ** out);
+/**
+  Reads a request header from the socket and creates the request
+  object. The object, its path, header and query pairs and the
+  content type are allocated from 'arena' and stay valid until the
+  arena is reset.
+
+  The body is left on the socket, so a request can be refused
+  before it is read. See hrequest_read_attachments().
+
+  @param sock the socket to read from
+  @param arena the request-scoped arena to allocate from
+  @param out receives the request object
+
+  @returns H_OK on success or one of the errors of
+    hsocket_read_header().
+*/
+herror_t hrequest_new_from_socket(hsocket_t *sock, harena_t * arena,
+                                  hrequest_t ** out);
+
+/**
+  Reads the parts of a multipart/related body into the attachments
+  of the request. Afterwards the input stream of the request reads
+  the root part. Other requests are left as they are.
+
+  @returns H_OK on success or one of the errors of
+    mime_get_attachments().
+*/
+herror_t hrequest_read_attachments(hrequest_t * req);
+
+/**
+  Returns the value of a header which has a slot in the request,
+  without scanning the header list. If the header was sent more
+  than once, the first value is returned.
+
+  @returns the value or NULL if the header was not sent.
+*/
+char *hrequest_get_header(hrequest_t * req, hheader_id_t id);
+
+/**
+  Releases what the request holds outside of its arena: the input
+  stream, MIME attachments and the session handle.
+*/
 void hrequest_free(hrequest_t * req);
 
 #ifdef __cplusplus
@@ -32,16 +32,37 @@
 
 
 
+struct tag_hservice;
+
 typedef struct httpd_conn
 {
   hsocket_t *sock;
+  struct tag_hservice *service; /* service answering the request */
   char content_type[25];
   http_output_stream_t *out;
   hpair_t *header;
+  http_output_stream_t stream;  /* storage behind 'out' */
+  http_version_t version;       /* of the request being answered */
+  http_content_encoding_t accept; /* coding to compress the response with */
 }
 httpd_conn_t;
 
 
+/*
+  Worker pool counters, see httpd_get_pool_stats()
+ */
+typedef struct httpd_pool_stats
+{
+  int workers;                  /* number of worker threads */
+  long queue_depth;             /* requests waiting for a worker */
+  long queue_depth_max;         /* highest queue depth seen */
+  unsigned long dispatched;     /* requests handed to workers */
+  unsigned long long wait_total; /* total queue wait (usec) */
+  unsigned long wait_max;       /* longest queue wait (usec) */
+  unsigned long shed;           /* requests refused with 503 */
+}
+httpd_pool_stats_t;
+
 /*
   Service callback
  */
@@ -51,6 +72,23 @@ typedef enum {
     NTLM_SPNEGO
 } httpd_auth;
 
+/*
+  Admission priority of a service. When the server is saturated LOW
+  services are refused first, then NORMAL ones. HIGH services are
+  always admitted.
+ */
+typedef enum {
+    HTTPD_PRIORITY_LOW,
+    HTTPD_PRIORITY_NORMAL,
+    HTTPD_PRIORITY_HIGH
+} httpd_priority;
+
+/*
+  Reports work waiting on a backend, e.g. threads blocked on a
+  database pool. Added to the request queue depth for admission.
+ */
+typedef int (*httpd_load_probe) (void);
+
 /*
  * Service representation object
  */
@@ -59,6 +97,10 @@ typedef struct tag_hservice
   char ctx[255];
   httpd_service func;
   httpd_auth auth;
+  httpd_priority priority;
+  httpd_service shed;           /* answers refused requests, may be NULL */
+  void *data;                   /* owner's data, e.g. a SOAP router */
+  unsigned long hash;           /* of ctx, see httpd_find_service() */
   struct tag_hservice *next;
 }
 hservice_t;
@@ -81,17 +123,26 @@ extern "C"
   int httpd_register(const char *ctx, httpd_service service);
   int httpd_register_secure(const char *ctx, httpd_service service,
                             httpd_auth auth);
+  int httpd_register_secure_data(const char *ctx, httpd_service service,
+                                 httpd_auth auth, void *data);
 
   int httpd_register_default(const char *ctx, httpd_service service);
   int httpd_register_default_secure(const char *ctx, httpd_service service,
                                     httpd_auth auth);
 
+  int httpd_set_admission(const char *ctx, httpd_priority priority,
+                          httpd_service shed);
+  void httpd_set_load_probe(httpd_load_probe probe);
+  herror_t httpd_send_unavailable(httpd_conn_t * conn);
+
   int httpd_get_port(void);
   int httpd_get_timeout(void);
   void httpd_set_timeout(int t);
 
   const char *httpd_get_protocol(void);
   int httpd_get_conncount(void);
+  int httpd_get_workers(void);
+  void httpd_get_pool_stats(httpd_pool_stats_t * stats);
 
   hservice_t *httpd_services(void);
 
@@ -43,6 +43,18 @@
 
 #define	HSOCKET_FREE	-1
 
+/* initial size of the read-ahead buffer */
+#define HSOCKET_READAHEAD_SIZE	8192
+
+/* size of the buffer which coalesces writes on a corked socket */
+#define HSOCKET_WRITE_BUFFER_SIZE	16384
+
+/* file copy buffer of hsocket_sendfile() when the kernel can't send */
+#define HSOCKET_FILE_BUFFER_SIZE	16384
+
+/* pending connection queue of hsocket_listen() */
+#define HSOCKET_LISTEN_BACKLOG	128
+
 /*
   Socket definition
 */
@@ -55,6 +67,20 @@ typedef struct hsocket_t
 #endif
   struct sockaddr_in addr;
   void *ssl;
+  int ktls;                     /* the kernel encrypts what is sent */
+  int timeout;                  /* seconds a read waits for data, 0 if
+                                   the owner enforces deadlines */
+
+  /* read-ahead buffer, drained by hsocket_read() before the socket */
+  byte_t *rbuf;
+  int rbuf_size;
+  int rbuf_len;
+  int rbuf_pos;
+
+  /* write buffer, filled by hsocket_nsend() while the socket is corked */
+  byte_t *wbuf;
+  int wbuf_len;
+  int corked;
 }
 hsocket_t;                      /* end of socket definition */
 
@@ -141,6 +167,23 @@ extern "C"
   herror_t hsocket_bind(hsocket_t * sock, int port);
 
 
+/**
+  Binds a socket to a port which other sockets of this process
+  can bind to as well (SO_REUSEPORT). The kernel spreads incoming
+  connections across all sockets listening on the port.
+
+  @param sock socket to use.
+  @param port  port number to bind to
+
+  @returns H_OK if success. One of the followings if fails:<P>
+    <BR>HSOCKET_ERROR_CREATE
+    <BR>HSOCKET_ERROR_BIND
+
+  @see hsocket_bind
+ */
+  herror_t hsocket_bind_shared(hsocket_t * sock, int port);
+
+
 /**
   Set the socket to the listen mode. You must bind 
   the socket to a port with hsocket_bind() before 
@@ -155,6 +198,32 @@ extern "C"
   herror_t hsocket_listen(hsocket_t * sock);
 
 
+/**
+  Same as hsocket_listen() with a given length for the queue
+  of pending connections.
+
+  @param sock the socket to use
+  @param backlog maximum number of pending connections
+
+  @see hsocket_listen
+*/
+  herror_t hsocket_listen_backlog(hsocket_t * sock, int backlog);
+
+
+/**
+  Lets the kernel hold back new connections on a listening socket
+  until the client sent data or the given number of seconds has
+  passed (TCP_DEFER_ACCEPT). Does nothing where the option is not
+  available.
+
+  @param sock the socket which listens to a port
+  @param seconds how long to wait for the first data
+
+  @returns H_OK if success. HSOCKET_ERROR_IOCTL otherwise.
+*/
+  herror_t hsocket_defer_accept(hsocket_t * sock, int seconds);
+
+
 /**
   Accepts an incoming socket request. Note that this function
   will not return until a socket connection is ready.
@@ -169,6 +238,31 @@ extern "C"
   herror_t hsocket_accept(hsocket_t * sock, hsocket_t * dest);
 
 
+/**
+  Accepts a pending connection on a non-blocking listening socket.
+  Unlike hsocket_accept() this function does not start SSL on the
+  new connection, the caller is expected to run hssl_server_ssl()
+  outside of its event loop.
+
+  @param sock the non-blocking socket which listens to a port
+  @param dest the destination socket which will be created
+
+  @returns 1 if a connection was accepted, 0 if no connection was
+    pending or -1 on error.
+*/
+  int hsocket_accept_pending(hsocket_t * sock, hsocket_t * dest);
+
+
+/**
+  Puts the socket into non-blocking mode.
+
+  @param sock the socket to use
+
+  @returns H_OK if success. HSOCKET_ERROR_IOCTL otherwise.
+*/
+  herror_t hsocket_set_nonblocking(hsocket_t * sock);
+
+
 /**
   Sends data throught the socket.
 
@@ -196,7 +290,135 @@ extern "C"
   herror_t hsocket_send(hsocket_t * sock, const char *str);
 
 
-  int hsocket_select_read(int sock, char *buf, size_t len);
+/**
+  Waits for data on the socket, then reads it.
+
+  @param sock the socket descriptor
+  @param buf the buffer to read into
+  @param len the size of the buffer
+  @param timeout seconds to wait for data, 0 to block until the
+    socket is readable or shut down
+
+  @returns the number of bytes read, or -1 with errno set to
+    ETIMEDOUT if no data arrived in time
+*/
+  int hsocket_wait_read(int sock, int timeout);
+  int hsocket_select_read(int sock, char *buf, size_t len, int timeout);
+
+
+/**
+  Reads everything queued on the socket into the read-ahead buffer
+  without blocking. The buffer grows as needed, but never beyond
+  'limit' bytes. Buffered bytes are returned by later calls to
+  hsocket_read().
+
+  @param sock the socket to read data from
+  @param limit maximum size of the read-ahead buffer
+  @param closed set to 1 if the peer closed the connection
+
+  @returns the number of bytes added to the buffer or -1 on error.
+*/
+  int hsocket_read_ahead(hsocket_t * sock, int limit, int *closed);
+
+
+/**
+  Waits for data and appends it to the read-ahead buffer. The buffer
+  grows as needed, but never beyond 'limit' bytes.
+
+  @param sock the socket to read data from
+  @param limit maximum size of the read-ahead buffer
+
+  @returns H_OK if data was read. HSOCKET_ERROR_RECEIVE if the peer
+    closed the connection or the buffer is full, or one of the
+    errors of hsocket_read().
+*/
+  herror_t hsocket_fill(hsocket_t * sock, int limit);
+
+
+/**
+  Scans the read-ahead buffer for the blank line which ends an HTTP
+  header. Line breaks in front of the header are skipped.
+
+  @returns the length of the header including the blank line or 0
+    if the buffer does not hold a complete header yet.
+*/
+  int hsocket_header_length(hsocket_t * sock);
+
+
+/**
+  Reads a complete HTTP header. The header is not copied, 'header'
+  points into the read-ahead buffer and is null terminated in place.
+  It stays valid until the next read from the socket. Bytes following
+  the header are left in the buffer for the input stream.
+
+  @param sock the socket to read from
+  @param max maximum header size
+  @param header receives the header
+
+  @returns H_OK if success. GENERAL_HEADER_PARSE_ERROR if the header
+    is larger than 'max' or one of the errors of hsocket_fill().
+*/
+  herror_t hsocket_read_header(hsocket_t * sock, int max, char **header);
+
+
+/**
+  Returns the number of bytes waiting in the read-ahead buffer.
+*/
+  int hsocket_buffered(hsocket_t * sock);
+
+
+/**
+  Releases the read-ahead buffer if it holds no unread data and the
+  write buffer if it is empty, so that idle connections do not keep
+  them around.
+*/
+  void hsocket_buffer_release(hsocket_t * sock);
+
+/**
+  Starts coalescing writes. Until hsocket_uncork() is called,
+  hsocket_nsend() and hsocket_send() only append to the write
+  buffer. A full buffer is sent together with the data which did
+  not fit in one call, flagged with MSG_MORE so the kernel keeps
+  building full segments.
+
+  @param sock the socket to cork
+*/
+  void hsocket_cork(hsocket_t * sock);
+
+
+/**
+  Sends everything buffered since hsocket_cork() in one call (one
+  SSL record per buffer under SSL) and stops coalescing.
+
+  @param sock the socket to uncork
+
+  @returns H_OK if success. One of the followings if fails:<P>
+    <BR>HSOCKET_ERROR_NOT_INITIALIZED
+    <BR>HSOCKET_ERROR_SEND
+*/
+  herror_t hsocket_uncork(hsocket_t * sock);
+
+
+/**
+  Sends 'size' bytes of the file 'fd' starting at 'offset'. The
+  write buffer goes out first. The file is handed to the kernel
+  with sendfile() unless the socket is encrypted by OpenSSL or the
+  file can't be sent that way, then it is copied through a buffer.
+
+  @param sock the socket to send the file to
+  @param fd the file, its position is not changed
+  @param offset where to start in the file
+  @param size how many bytes to send
+
+  @returns H_OK if success. One of the followings if fails:<P>
+    <BR>HSOCKET_ERROR_NOT_INITIALIZED
+    <BR>HSOCKET_ERROR_SEND
+    <BR>FILE_ERROR_READ
+*/
+  herror_t hsocket_sendfile(hsocket_t * sock, int fd, off_t offset,
+                            size_t size);
+
+
 /**
   Reads data from the socket.
 
@@ -28,11 +28,33 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
+/*
+  Handshake latency histogram bounds in milliseconds, the last
+  bucket counts everything slower
+ */
+#define HSSL_LATENCY_BUCKETS 10
+#define HSSL_LATENCY_BOUNDS { 1, 2, 5, 10, 25, 50, 100, 250, 1000 }
+
+/*
+  Server handshake counters, see hssl_get_stats()
+ */
+typedef struct hssl_stats
+{
+  unsigned long full;           /* full handshakes */
+  unsigned long resumed;        /* abbreviated handshakes */
+  unsigned long failed;         /* handshakes that did not complete */
+  unsigned long ktls;           /* connections encrypted by the kernel */
+  unsigned long long time_full; /* total time in full handshakes (usec) */
+  unsigned long long time_resumed; /* total time in resumed ones (usec) */
+  unsigned long latency[HSSL_LATENCY_BUCKETS];
+}
+hssl_stats_t;
+
 #ifdef HAVE_SSL
 
-#ifdef HAVE_OPENSSL_SSL_H
 #include <openssl/ssl.h>
-#endif
 
 #ifdef __cplusplus
 extern "C"
@@ -50,9 +72,12 @@ extern "C"
   void hssl_set_certificate(char *c);
   void hssl_set_certpass(char *c);
   void hssl_set_ca(char *c);
+  void hssl_set_ciphers(char *c);
+  void hssl_set_ciphersuites(char *c);
   void hssl_enable(void);
 
   int hssl_enabled(void);
+  void hssl_get_stats(hssl_stats_t * stats);
 
 /**
  *
@@ -64,6 +89,12 @@ extern "C"
 
   void hssl_cleanup(hsocket_t * sock);
 
+/*
+ * Returns the number of decrypted bytes buffered inside the SSL
+ * object, which a poll on the socket cannot see.
+ */
+  int hssl_pending(hsocket_t * sock);
+
 /*
  * Callback for password checker
  */
@@ -109,6 +140,12 @@ hssl_enabled(void)
   return 0;
 }
 
+static inline void
+hssl_get_stats(hssl_stats_t * stats)
+{
+  memset(stats, 0, sizeof(hssl_stats_t));
+}
+
 static inline herror_t
 hssl_client_ssl(hsocket_t * sock)
 {
@@ -127,6 +164,12 @@ hssl_cleanup(hsocket_t * sock)
   return;
 }
 
+static inline int
+hssl_pending(hsocket_t * sock)
+{
+  return 0;
+}
+
 #endif /* HAVE_SSL */
 
 #ifdef __cplusplus
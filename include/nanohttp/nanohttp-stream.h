@@ -25,6 +25,7 @@
 #define NANO_HTTP_STREAM_H
 
 #include <stdio.h>
+#include <zlib.h>
 
 #include <nanohttp/nanohttp-socket.h>
 #include <nanohttp/nanohttp-common.h>
@@ -76,6 +77,17 @@ typedef enum http_transfer_type
 } http_transfer_type_t;
 
 
+/**
+  Content codings a stream can compress or decompress.
+*/
+typedef enum http_content_encoding
+{
+  HTTP_CONTENT_ENCODING_IDENTITY,
+  HTTP_CONTENT_ENCODING_GZIP,
+  HTTP_CONTENT_ENCODING_DEFLATE
+} http_content_encoding_t;
+
+
 /**
   HTTP INPUT STREAM. Receives data from a socket/file
   and cares about the transfer style.
@@ -94,6 +106,11 @@ typedef struct http_input_stream
   FILE *fd;
   char filename[255];
   int deleteOnExit;             /* default is 0 */
+
+  /* decompression of a Content-Encoding body */
+  z_stream *zstream;
+  byte_t *zbuf;
+  int zdone;
 } http_input_stream_t;
 
 
@@ -107,6 +124,16 @@ typedef struct http_output_stream
   http_transfer_type_t type;
   int content_length;
   int sent;
+
+  z_stream *zstream;            /* compressor, NULL if sent as is */
+
+  /* header held back until the body is known to be worth compressing */
+  char *held_header;
+  byte_t *held;
+  int held_len;
+  int held_min;
+  http_content_encoding_t held_encoding;
+  int held_level;
 } http_output_stream_t;
 
 
@@ -137,6 +164,38 @@ extern "C" {
 http_input_stream_t *http_input_stream_new(hsocket_t *sock, hpair_t *header);
 
 
+/**
+  Creates a new input stream like http_input_stream_new(), but
+  takes the values of the Content-Length and Transfer-Encoding
+  headers directly. Either may be NULL.
+
+  @see http_input_stream_new
+*/
+http_input_stream_t *http_input_stream_new_framed(hsocket_t *sock,
+                                                  const char *content_length,
+                                                  const char *transfer_encoding);
+
+
+/**
+  Finds out how the body of a request is framed from its raw
+  header. Content-Length must be a plain number and may only be
+  repeated with the same value. Transfer-Encoding must be exactly
+  "chunked" and may not come with a Content-Length. The reactor
+  and the worker both frame requests with this function, so they
+  always agree on where a request ends.
+
+  @param header the request header as received
+  @param len the length of the header
+  @param content_length receives the length of the body, 0 if
+    the header has no framing headers
+
+  @returns HTTP_TRANSFER_CONTENT_LENGTH or HTTP_TRANSFER_CHUNKED.
+    -1 if the framing headers are invalid or conflict.
+*/
+int http_input_stream_framing(const char *header, size_t len,
+                              long *content_length);
+
+
 /**
   Creates a new input stream from file. 
   This function was added for MIME messages 
@@ -153,6 +212,20 @@ http_input_stream_t *http_input_stream_new(hsocket_t *sock, hpair_t *header);
 http_input_stream_t *http_input_stream_new_from_file(const char *filename);
 
 
+/**
+  Makes the stream decompress what it reads. Both gzip and
+  zlib (deflate) framed bodies are accepted.
+
+  @param stream the stream whose body has a Content-Encoding
+  @param encoding the content coding of the body
+
+  @returns H_OK if success. STREAM_ERROR_ENCODING if the coding
+    is not supported or STREAM_ERROR_INFLATE if zlib failed.
+*/
+herror_t http_input_stream_inflate(http_input_stream_t * stream,
+                                   http_content_encoding_t encoding);
+
+
 /**
   Free input stream. Note that the socket will not be closed
   by this functions.
@@ -185,6 +258,7 @@ int http_input_stream_is_ready(http_input_stream_t * stream);
   <BR>STREAM_ERROR_NO_CHUNK_SIZE 
   <BR>STREAM_ERROR_WRONG_CHUNK_SIZE
   <BR>STREAM_ERROR_INVALID_TYPE
+  <BR>STREAM_ERROR_INFLATE
   <BR>HSOCKET_ERROR_RECEIVE  
 
   @param stream the stream to read data from
@@ -220,6 +294,19 @@ http_output_stream_t *http_output_stream_new(hsocket_t *sock,
                                              hpair_t * header);
 
 
+/**
+  Initializes an already allocated output stream, so that one
+  stream object can be reused for several responses. Transfer
+  style is found from the header like in http_output_stream_new().
+
+  @param stream the stream to initialize
+  @param sock the socket to to send data to
+  @param header the header which must be sent before
+*/
+void http_output_stream_init(http_output_stream_t * stream,
+                             hsocket_t *sock, hpair_t * header);
+
+
 /**
   Free output stream. Note that this functions will not 
   close any socket connections.
@@ -256,6 +343,25 @@ herror_t http_output_stream_write(http_output_stream_t * stream,
 herror_t http_output_stream_write_string(http_output_stream_t * stream,
                                          const char *str);
 
+/**
+  Writes 'size' bytes of the file 'fd' starting at 'offset' into
+  the stream. The file goes to the socket with hsocket_sendfile(),
+  as one chunk for chunked transfers. Compressed streams read it
+  through a buffer instead.
+
+  @param stream the stream to use to send data
+  @param fd the file, its position is not changed
+  @param offset where to start in the file
+  @param size how many bytes to send
+
+  @returns H_OK if success. One of the followings otherwise
+    <BR>HSOCKET_ERROR_NOT_INITIALIZED
+    <BR>HSOCKET_ERROR_SEND
+    <BR>FILE_ERROR_READ
+*/
+herror_t http_output_stream_write_file(http_output_stream_t * stream,
+                                       int fd, off_t offset, size_t size);
+
 
 /**
   Sends finish flags if nesseccary (like in chunked transport).
@@ -269,6 +375,52 @@ herror_t http_output_stream_write_string(http_output_stream_t * stream,
 */
 herror_t http_output_stream_flush(http_output_stream_t * stream);
 
+
+/**
+  Compresses everything written to the stream from now on. The
+  header announcing the Content-Encoding must have been sent and
+  the stream must not use HTTP_TRANSFER_CONTENT_LENGTH.
+
+  @param stream the stream to compress
+  @param encoding HTTP_CONTENT_ENCODING_GZIP or _DEFLATE
+  @param level the zlib compression level (1-9)
+
+  @returns H_OK if success or STREAM_ERROR_DEFLATE.
+*/
+herror_t http_output_stream_deflate(http_output_stream_t * stream,
+                                    http_content_encoding_t encoding,
+                                    int level);
+
+
+/**
+  Holds back the header of a response whose length is not known
+  in advance. The body is collected until 'min' bytes were
+  written; the header then goes out with a Content-Encoding field
+  and the body compressed. If the stream is flushed earlier, the
+  header and the body are sent as they are.
+
+  @param stream the stream to send the body with
+  @param header the header block, without the closing empty line
+  @param encoding the content coding to use for large bodies
+  @param level the zlib compression level (1-9)
+  @param min the smallest body to compress
+
+  @returns H_OK if success or STREAM_ERROR_DEFLATE if malloc() failed.
+*/
+herror_t http_output_stream_hold(http_output_stream_t * stream,
+                                 const char *header,
+                                 http_content_encoding_t encoding,
+                                 int level, int min);
+
+
+/**
+  Releases the compressor and anything held back without sending
+  it, e.g. when a response was abandoned half way.
+
+  @param stream the stream to release
+*/
+void http_output_stream_release(http_output_stream_t * stream);
+
 #ifdef __cplusplus
 }
 #endif
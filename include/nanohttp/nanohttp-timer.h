@@ -0,0 +1,124 @@
+/******************************************************************
+*  $Id$
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2003  Ferhat Ayaz
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+*
+* Email: ferhatayaz@yahoo.com
+******************************************************************/
+#ifndef __nanohttp_timer_h
+#define __nanohttp_timer_h
+
+#include <stddef.h>
+
+#include <nanohttp/nanohttp-common.h>
+
+/* resolution of the wheel in milliseconds */
+#define HTIMER_TICK_MS		100
+
+#define HTIMER_L0_BITS		8
+#define HTIMER_L1_BITS		6
+#define HTIMER_L0_SIZE		(1 << HTIMER_L0_BITS)
+#define HTIMER_L1_SIZE		(1 << HTIMER_L1_BITS)
+
+/**
+  A deadline on a timer wheel. Timers are embedded in the object
+  they belong to and linked into the wheel, so scheduling and
+  cancelling never allocate.
+*/
+typedef struct htimer htimer_t;
+struct htimer
+{
+  htimer_t *next;
+  htimer_t *prev;
+  unsigned long expires;        /* tick the timer fires at */
+  void *data;                   /* handed to the expiry callback */
+};
+
+/**
+  Two level hierarchical timer wheel. The first level holds the
+  next HTIMER_L0_SIZE ticks, the second one groups later deadlines
+  by HTIMER_L0_SIZE ticks and is cascaded down as time advances.
+  Deadlines beyond the second level wait in its last slot. The
+  wheel is not thread safe, it belongs to the thread which
+  advances it.
+*/
+typedef struct htimer_wheel
+{
+  unsigned long now;            /* last processed tick */
+  unsigned long long base;      /* htimer_now() at tick 0 */
+  size_t count;                 /* scheduled timers */
+  htimer_t l0[HTIMER_L0_SIZE];  /* list heads */
+  htimer_t l1[HTIMER_L1_SIZE];
+}
+htimer_wheel_t;
+
+typedef void (*htimer_func) (htimer_t * timer);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+  Returns the monotonic clock in milliseconds.
+*/
+unsigned long long htimer_now(void);
+
+/**
+  Initializes an empty wheel starting at the current time.
+*/
+void htimer_wheel_init(htimer_wheel_t * wheel);
+
+/**
+  Initializes a timer which is not scheduled.
+
+  @param timer the timer to initialize
+  @param data the value of timer->data for the expiry callback
+*/
+void htimer_init(htimer_t * timer, void *data);
+
+/**
+  Schedules the timer to fire 'ms' milliseconds from now. A timer
+  which is already scheduled is moved.
+*/
+void htimer_schedule(htimer_wheel_t * wheel, htimer_t * timer,
+                     unsigned long ms);
+
+/**
+  Removes the timer from the wheel. Does nothing if the timer is
+  not scheduled.
+*/
+void htimer_cancel(htimer_wheel_t * wheel, htimer_t * timer);
+
+/**
+  Returns 1 if the timer is scheduled, 0 otherwise.
+*/
+int htimer_pending(htimer_t * timer);
+
+/**
+  Advances the wheel to the current time and calls 'func' for every
+  timer which expired. The timer is removed from the wheel before
+  the callback runs, so the callback may schedule it again.
+*/
+void htimer_advance(htimer_wheel_t * wheel, htimer_func func);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -27,17 +28,48 @@
 #define NTLM_RESPONSE   2
 #define NTLM_SUCCESS    3
 
-typedef struct ntlmctx {
-    char *scope;
-    char *helper;
+#define NTLM_POOL_SIZE      4       /* helper processes */
+#define NTLM_PIN_TIMEOUT    30      /* seconds a handshake may hold a helper */
+#define NTLM_WAIT_TIMEOUT   10      /* seconds to wait for a free helper */
+#define NTLM_HELPER_TIMEOUT 5000    /* milliseconds for a helper to answer */
+#define NTLM_LINE_SIZE      4096    /* initial helper reply buffer */
+#define NTLM_MAX_LINE_SIZE  65536   /* longest helper reply accepted */
+
+typedef struct ntlmhelper {
     pid_t pid;
     int infd;
     int outfd;
-    int errfd;
+    struct ntlmctx *owner;          /* handshake the helper is pinned to */
+    time_t pinned;
+    int active;                     /* talking to the helper */
+} ntlmhelper_t;
+
+/* time helpers took to answer one kind of request */
+typedef struct {
+    unsigned long count;
+    unsigned long long time;        /* total (usec) */
+    unsigned long long maxtime;     /* slowest (usec) */
+} ntlmlegstats_t;
+
+/* helper counters, see ntlm_auth_get_stats() */
+typedef struct {
+    ntlmlegstats_t negotiate;       /* YR, answered with TT */
+    ntlmlegstats_t response;        /* KK, answered with AF or NA */
+    unsigned long timeouts;         /* helpers which did not answer in time */
+    unsigned long restarts;         /* helpers replaced */
+} ntlmstats_t;
+
+typedef struct ntlmctx {
+    char *scope;
+    ntlmhelper_t *helper;
     int state;
     struct ntlmctx *next;
 } ntlmctx_t;
 
+int ntlm_auth_pool_init(const char *, int);
+void ntlm_auth_pool_destroy();
+void ntlm_auth_set_timeout(int);
+void ntlm_auth_get_stats(ntlmstats_t *);
 ntlmctx_t *ntlm_auth_init(const char *, const char *);
 void ntlm_auth_free(ntlmctx_t *);
 int ntlm_auth_challenge(ntlmctx_t *, const char *, char **);
@@ -31,6 +31,7 @@ typedef struct {
 int pg_pool_init(int);
 void pg_pool_free();
 int pg_pool_size();
+int pg_pool_waiters();
 
 int pg_context_alloc(const char *, const char *, const char *);
 int pg_context_count();
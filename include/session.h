@@ -23,14 +23,54 @@
 
 #include <ntlmauth.h>
 
-typedef struct {
+#define SESSION_CAPACITY    10240
+#define SESSION_TTL         3600    /* seconds a session may sit idle */
+#define SESSION_SHARDS      64
+#define SESSION_ID_MAXLEN   64
+#define SESSION_USER_MAXLEN 256
+#define SESSION_SHM_NAME    "/bonsai-sessions"
+
+typedef struct session {
     char *id;
     int refcount;
     time_t lastseen;
     char *userid;
     ntlmctx_t *authctx;
+    time_t synced;                  /* last exchange with the shared store */
+    unsigned int hash;
+    struct session *next;           /* hash chain */
+    struct session *newer;          /* LRU list */
+    struct session *older;
 } session_t;
 
+/* session store counters, see session_get_stats() */
+typedef struct {
+    unsigned long live;             /* sessions in the store */
+    unsigned long expired;          /* removed after the idle TTL */
+    unsigned long evicted;          /* removed to make room */
+    unsigned long rejected;         /* not created, the store was full */
+} session_stats_t;
+
+/*
+ * A store shared with other processes, which lets a session
+ * authenticated by one of them be used with the others. Only the
+ * user binding is shared, NTLM handshakes stay in the process.
+ */
+typedef struct {
+    const char *name;
+    int (*open)(const char *, int, int);    /* argument, capacity, TTL */
+    void (*close)();
+    int (*lookup)(const char *, char **);   /* session ID, user ID output */
+    int (*bind)(const char *, const char *);
+} session_backend_t;
+
+extern const session_backend_t session_backend_shm;
+extern const session_backend_t session_backend_pg;
+
+int session_store_init(int, int);
+int session_store_open(const char *);
+void session_store_free();
+void session_get_stats(session_stats_t *);
 session_t *session_init(const char *);
 void session_close(session_t *);
 void session_bind_user(session_t *, const char *);
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include <netapi.h>
@@ -33,10 +34,276 @@
 #include <authz.h>
 #include <log.h>
 
+#ifndef NERR_UserNotFound
+#define NERR_UserNotFound 2221
+#endif
+
+typedef struct authzentry {
+    char *userid;
+    userinfo_t *info;               /* NULL if the user does not exist */
+    time_t fetched;
+    int pending;                    /* a lookup is in progress */
+    unsigned int hash;
+    struct authzentry *next;
+} authzentry_t;
+
+typedef struct authzrefresh {
+    char *userid;
+    struct authzrefresh *next;
+} authzrefresh_t;
+
+/* NetApi calls share one context in the library, so they are serialised */
 static pthread_mutex_t _ctxmtx = PTHREAD_MUTEX_INITIALIZER;
 static struct libnetapi_ctx *_netapictx = NULL;
 static char *_host = NULL;
 
+static pthread_mutex_t _cachemtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cachecond = PTHREAD_COND_INITIALIZER;
+static authzentry_t *_cache[AUTHZ_CACHE_BUCKETS];
+static int _cachecount = 0;
+static int _cachettl = AUTHZ_CACHE_TTL;
+static authz_stats_t _stats;
+
+static pthread_cond_t _refreshcond = PTHREAD_COND_INITIALIZER;
+static authzrefresh_t *_refreshq = NULL;
+static pthread_t _refresher;
+static int _refreshing = 0;
+
+static unsigned int _authz_hash(const char *userid)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *userid; userid++) {
+        hash ^= (unsigned char)*userid;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static userinfo_t *_authz_copy(const userinfo_t *info)
+{
+    userinfo_t *result;
+
+    if (!info)
+        return NULL;
+
+    result = (userinfo_t *)malloc(sizeof(userinfo_t));
+    bzero(result, sizeof(userinfo_t));
+
+    result->logon_name = info->logon_name ? strdup(info->logon_name) : NULL;
+    result->domain = info->domain ? strdup(info->domain) : NULL;
+    result->display_name = info->display_name ? strdup(info->display_name) : NULL;
+    result->sid = info->sid ? strdup(info->sid) : NULL;
+
+    return result;
+}
+
+/**
+ * Seconds the given entry is fresh. Known users are served for up
+ * to another TTL while they are refreshed, unknown users are not.
+ */
+static int _authz_ttl(authzentry_t *entry)
+{
+    if (entry->info)
+        return _cachettl;
+
+    return _cachettl < AUTHZ_NEGATIVE_TTL ? _cachettl : AUTHZ_NEGATIVE_TTL;
+}
+
+static int _authz_max_age(authzentry_t *entry)
+{
+    return entry->info ? _cachettl * 2 : _authz_ttl(entry);
+}
+
+/**
+ * Looks up a user in the account database.
+ *
+ * @param userid    user name to lookup
+ * @param notfound  output flag set if the user does not exist
+ *
+ * @return a user info structure or NULL on error
+ */
+static userinfo_t *_authz_fetch(const char *userid, int *notfound)
+{
+    struct USER_INFO_23 *buf = NULL;
+    userinfo_t *result = NULL;
+    NET_API_STATUS status;
+
+    *notfound = 0;
+    pthread_mutex_lock(&_ctxmtx);
+
+    if (!_netapictx) {
+        pthread_mutex_unlock(&_ctxmtx);
+        return NULL;
+    }
+
+    status = NetUserGetInfo(_host, userid, 23, (uint8_t **)&buf);
+    if (status != NET_API_STATUS_SUCCESS) {
+        log_warn("NetApi lookup for user %s failed (%d)", userid, status);
+        pthread_mutex_unlock(&_ctxmtx);
+
+        *notfound = (status == NERR_UserNotFound);
+        return NULL;
+    }
+
+    result = (userinfo_t *)malloc(sizeof(userinfo_t));
+    bzero(result, sizeof(userinfo_t));
+
+    result->logon_name = strdup(userid);
+    result->display_name = strdup(buf->usri23_full_name);
+
+    ConvertSidToStringSid(buf->usri23_user_sid, &result->sid);
+
+    NetApiBufferFree(buf);
+    pthread_mutex_unlock(&_ctxmtx);
+
+    log_debug("found user %s with SID %s", userid, result->sid);
+    return result;
+}
+
+static authzentry_t *_authz_find(const char *userid, unsigned int hash)
+{
+    authzentry_t *entry = _cache[hash % AUTHZ_CACHE_BUCKETS];
+
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->userid, userid))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * Drops entries too old to be served. The cache lock must be held.
+ */
+static void _authz_sweep(time_t now)
+{
+    authzentry_t **prev, *entry;
+    int i;
+
+    for (i = 0; i < AUTHZ_CACHE_BUCKETS; i++) {
+        prev = &_cache[i];
+
+        while ((entry = *prev)) {
+            if (entry->pending || now - entry->fetched < _authz_max_age(entry)) {
+                prev = &entry->next;
+                continue;
+            }
+
+            *prev = entry->next;
+            authz_free_buffer(entry->info);
+            free(entry->userid);
+            free(entry);
+            _cachecount--;
+        }
+    }
+}
+
+/**
+ * Adds an empty entry for the given user. The cache lock must be held.
+ *
+ * @return the new entry, or NULL if the cache is full
+ */
+static authzentry_t *_authz_insert(const char *userid, unsigned int hash)
+{
+    authzentry_t *entry;
+
+    if (_cachecount >= AUTHZ_CACHE_SIZE)
+        _authz_sweep(time(NULL));
+
+    if (_cachecount >= AUTHZ_CACHE_SIZE) {
+        log_debug("user cache is full, not caching %s", userid);
+        return NULL;
+    }
+
+    entry = (authzentry_t *)malloc(sizeof(authzentry_t));
+    bzero(entry, sizeof(authzentry_t));
+
+    entry->userid = strdup(userid);
+    entry->hash = hash;
+    entry->next = _cache[hash % AUTHZ_CACHE_BUCKETS];
+    _cache[hash % AUTHZ_CACHE_BUCKETS] = entry;
+    _cachecount++;
+
+    return entry;
+}
+
+/**
+ * Stores the result of a lookup and wakes up threads waiting for it.
+ * A failed lookup keeps what was cached before. The cache lock must
+ * be held.
+ */
+static void _authz_update(authzentry_t *entry, userinfo_t *info, int notfound)
+{
+    entry->pending = 0;
+    pthread_cond_broadcast(&_cachecond);
+
+    if (!info && !notfound) {
+        _stats.failures++;
+        return;
+    }
+
+    authz_free_buffer(entry->info);
+    entry->info = info;
+    entry->fetched = time(NULL);
+}
+
+/**
+ * Refreshes stale entries in the background.
+ */
+static void *_authz_refresh_main(void *arg)
+{
+    authzrefresh_t *item;
+    authzentry_t *entry;
+    userinfo_t *info;
+    int notfound;
+
+    pthread_mutex_lock(&_cachemtx);
+
+    while (1) {
+        while (_refreshing && !_refreshq)
+            pthread_cond_wait(&_refreshcond, &_cachemtx);
+
+        if (!_refreshing)
+            break;
+
+        item = _refreshq;
+        _refreshq = item->next;
+        pthread_mutex_unlock(&_cachemtx);
+
+        log_debug("refreshing cached user %s", item->userid);
+        info = _authz_fetch(item->userid, &notfound);
+
+        pthread_mutex_lock(&_cachemtx);
+
+        /* pending entries are never swept */
+        entry = _authz_find(item->userid, _authz_hash(item->userid));
+        _authz_update(entry, info, notfound);
+
+        free(item->userid);
+        free(item);
+    }
+
+    pthread_mutex_unlock(&_cachemtx);
+    return NULL;
+}
+
+/**
+ * Queues a stale entry for refresh. The cache lock must be held.
+ */
+static void _authz_queue_refresh(authzentry_t *entry)
+{
+    authzrefresh_t *item = (authzrefresh_t *)malloc(sizeof(authzrefresh_t));
+
+    item->userid = strdup(entry->userid);
+    item->next = _refreshq;
+    _refreshq = item;
+
+    entry->pending = 1;
+    pthread_cond_signal(&_refreshcond);
+}
+
 /**
  * Initialises the NetApi context. This function is not re-entrant.
  *
@@ -69,6 +336,16 @@ int authz_init(const char *host, const char *username, const char *passwd)
     pthread_mutex_unlock(&_ctxmtx);
     log_info("initialised NetApi context");
 
+    if (_cachettl > 0) {
+        _refreshing = 1;
+
+        if (pthread_create(&_refresher, NULL, _authz_refresh_main, NULL) != 0) {
+            log_warn("failed to start the user cache refresher, caching is disabled");
+            _refreshing = 0;
+            _cachettl = 0;
+        }
+    }
+
     return 1;
 }
 
@@ -77,6 +354,42 @@ int authz_init(const char *host, const char *username, const char *passwd)
  */
 void authz_free()
 {
+    authzentry_t *entry;
+    authzrefresh_t *item;
+    int i;
+
+    pthread_mutex_lock(&_cachemtx);
+
+    if (_refreshing) {
+        _refreshing = 0;
+        pthread_cond_signal(&_refreshcond);
+        pthread_mutex_unlock(&_cachemtx);
+
+        pthread_join(_refresher, NULL);
+        pthread_mutex_lock(&_cachemtx);
+    }
+
+    while ((item = _refreshq)) {
+        _refreshq = item->next;
+        free(item->userid);
+        free(item);
+    }
+
+    for (i = 0; i < AUTHZ_CACHE_BUCKETS; i++) {
+        while ((entry = _cache[i])) {
+            _cache[i] = entry->next;
+            authz_free_buffer(entry->info);
+            free(entry->userid);
+            free(entry);
+        }
+    }
+
+    log_info("user cache: %lu hits, %lu misses, %lu stale, %lu failures",
+             _stats.hits, _stats.misses, _stats.stale, _stats.failures);
+
+    _cachecount = 0;
+    pthread_mutex_unlock(&_cachemtx);
+
     pthread_mutex_lock(&_ctxmtx);
 
     if (_netapictx) {
@@ -90,46 +403,100 @@ void authz_free()
     pthread_mutex_unlock(&_ctxmtx);
 }
 
+/**
+ * Sets the number of seconds user lookups are cached. Zero disables
+ * the cache. This must be called before authz_init().
+ *
+ * @param ttl   cache time-to-live in seconds
+ */
+void authz_set_cache_ttl(int ttl)
+{
+    _cachettl = ttl > 0 ? ttl : 0;
+}
+
+/**
+ * Retrieves user cache statistics.
+ *
+ * @param stats output buffer for the statistics
+ */
+void authz_get_stats(authz_stats_t *stats)
+{
+    pthread_mutex_lock(&_cachemtx);
+    *stats = _stats;
+    pthread_mutex_unlock(&_cachemtx);
+}
+
 /**
  * Lookup a user based on a user ID. Calling functions should
  * free the result with authz_free_buffer().
  *
+ * Results are cached. A stale result is returned while it is
+ * refreshed in the background, and threads looking up the same
+ * uncached user wait for a single lookup.
+ *
  * @param userid    user name to lookup
  *
  * @return a user info structure or NULL on error
  */
 userinfo_t *authz_lookup_user(const char *userid)
 {
-    struct USER_INFO_23 *buf = NULL;
-    userinfo_t *result = NULL;
-    NET_API_STATUS status;
+    userinfo_t *result, *info;
+    authzentry_t *entry;
+    unsigned int hash;
+    time_t now;
+    int notfound;
 
-    pthread_mutex_lock(&_ctxmtx);
-
-    if (!userid || !_netapictx) {
-        pthread_mutex_unlock(&_ctxmtx);
+    if (!userid)
         return NULL;
-    }
 
-    status = NetUserGetInfo(_host, userid, 23, (uint8_t **)&buf);
-    if (status != NET_API_STATUS_SUCCESS) {
-        log_warn("NetApi lookup for user %s failed (%d)", userid, status);
-        pthread_mutex_unlock(&_ctxmtx);
-        return NULL;
+    if (_cachettl == 0)
+        return _authz_fetch(userid, &notfound);
+
+    hash = _authz_hash(userid);
+    pthread_mutex_lock(&_cachemtx);
+
+    while (1) {
+        entry = _authz_find(userid, hash);
+        now = time(NULL);
+
+        if (entry && now - entry->fetched < _authz_max_age(entry)) {
+            if (now - entry->fetched >= _authz_ttl(entry) && !entry->pending) {
+                _authz_queue_refresh(entry);
+                _stats.stale++;
+            }
+
+            _stats.hits++;
+            result = _authz_copy(entry->info);
+            pthread_mutex_unlock(&_cachemtx);
+
+            return result;
+        }
+
+        if (!entry || !entry->pending)
+            break;
+
+        pthread_cond_wait(&_cachecond, &_cachemtx);
     }
 
-    result = (userinfo_t *)malloc(sizeof(userinfo_t));
-    bzero(result, sizeof(userinfo_t));
+    _stats.misses++;
 
-    result->logon_name = strdup(userid);
-    result->display_name = strdup(buf->usri23_full_name);
+    if (entry || (entry = _authz_insert(userid, hash)))
+        entry->pending = 1;
 
-    ConvertSidToStringSid(buf->usri23_user_sid, &result->sid);
+    pthread_mutex_unlock(&_cachemtx);
 
-    NetApiBufferFree(buf);
-    pthread_mutex_unlock(&_ctxmtx);
+    info = _authz_fetch(userid, &notfound);
+    result = _authz_copy(info);
+
+    if (!entry) {
+        authz_free_buffer(info);
+        return result;
+    }
+
+    pthread_mutex_lock(&_cachemtx);
+    _authz_update(entry, info, notfound);
+    pthread_mutex_unlock(&_cachemtx);
 
-    log_debug("found user %s with SID %s", userid, result->sid);
     return result;
 }
 
@@ -157,4 +524,3 @@ void authz_free_buffer(userinfo_t *buf)
 
     free(buf);
 }
-
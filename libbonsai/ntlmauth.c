@@ -23,90 +23,566 @@
  * @author  Bob Carroll (bob.carroll@alum.rit.edu)
  */
 
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
 
 #include <ntlmauth.h>
 #include <log.h>
 
 enum pipes { READ, WRITE };
 
+extern char **environ;
+
+static ntlmhelper_t *_helpers = NULL;
+static int _helpercount = 0;
+static char *_helperpath = NULL;
+static pthread_mutex_t _helpermtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _helpercond = PTHREAD_COND_INITIALIZER;
+static unsigned long _spawned = 0;
+static int _timeout = NTLM_HELPER_TIMEOUT;
+static ntlmstats_t _stats;
+
 /**
- * Initialises an NTLM authentication context. Calling functions
- * should call ntlm_auth_free() to free the result.
+ * Creates a pipe which helpers spawned by other threads do not
+ * inherit. Elsewhere the pipe is marked after it is created, and a
+ * helper spawned in between holds it open.
  *
- * @param scope     authentication scope
- * @param helper    path to the NTLM helper tool
+ * @param fds   output for the read and write ends
  *
- * @return a context or NULL on error
+ * @return 0 on success, -1 on failure
  */
-ntlmctx_t *ntlm_auth_init(const char *scope, const char *helper)
+static int _ntlm_pipe(int fds[2])
 {
+#ifdef LINUX
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds))
+        return -1;
+
+    fcntl(fds[READ], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[WRITE], F_SETFD, FD_CLOEXEC);
+
+    return 0;
+#endif
+}
+
+/**
+ * Starts a helper process talking over pipes on its standard input
+ * and output. Standard error is inherited so helper diagnostics end
+ * up next to ours.
+ *
+ * @param helper    the pool slot to fill
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int _ntlm_helper_spawn(ntlmhelper_t *helper)
+{
+    posix_spawn_file_actions_t actions;
+    char *argv[] = { _helperpath, "--helper-protocol=squid-2.5-ntlmssp", NULL };
     int infd[2];
     int outfd[2];
-    int errfd[2];
+    int err;
+
+    helper->pid = 0;
+    helper->infd = helper->outfd = -1;
+
+    /* only the duplicates on stdin and stdout survive in the child */
+    if (_ntlm_pipe(infd)) {
+        log_error("pipe() failed with error %d", errno);
+        return 0;
+    }
+
+    if (_ntlm_pipe(outfd)) {
+        log_error("pipe() failed with error %d", errno);
+        close(infd[READ]);
+        close(infd[WRITE]);
+        return 0;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, infd[READ], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outfd[WRITE], STDOUT_FILENO);
+
+    log_debug("spawning child process %s", _helperpath);
+    err = posix_spawn(&helper->pid, _helperpath, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(infd[READ]);
+    close(outfd[WRITE]);
+
+    if (err) {
+        log_error("posix_spawn() failed with error %d", err);
+        close(infd[WRITE]);
+        close(outfd[READ]);
+        helper->pid = 0;
+        return 0;
+    }
+
+    helper->infd = infd[WRITE];
+    helper->outfd = outfd[READ];
+
+    /* replies are waited for with a deadline */
+    fcntl(helper->infd, F_SETFL, O_NONBLOCK);
+    fcntl(helper->outfd, F_SETFL, O_NONBLOCK);
+    __atomic_add_fetch(&_spawned, 1, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/**
+ * Stops a helper process and reaps it. The helper may be hung, so it
+ * is not asked nicely.
+ *
+ * @param helper    the pool slot to clear
+ */
+static void _ntlm_helper_kill(ntlmhelper_t *helper)
+{
+    if (helper->infd != -1)
+        close(helper->infd);
+
+    if (helper->outfd != -1)
+        close(helper->outfd);
+
+    helper->infd = helper->outfd = -1;
+
+    if (helper->pid > 0) {
+        kill(helper->pid, SIGKILL);
+        waitpid(helper->pid, NULL, 0);
+    }
+
+    helper->pid = 0;
+}
+
+/**
+ * Replaces a helper process that died or got into a bad state. The
+ * caller must own the helper.
+ *
+ * @param helper    the pool slot to restart
+ */
+static void _ntlm_helper_restart(ntlmhelper_t *helper)
+{
+    log_warn("restarting NTLM helper process %d", helper->pid);
+    __atomic_add_fetch(&_stats.restarts, 1, __ATOMIC_RELAXED);
+
+    _ntlm_helper_kill(helper);
+    _ntlm_helper_spawn(helper);
+}
+
+/**
+ * Records a helper which did not answer in time.
+ *
+ * @param helper    the hung helper
+ */
+static void _ntlm_helper_timeout(ntlmhelper_t *helper)
+{
+    log_error("NTLM helper %d did not answer within %d ms", helper->pid, _timeout);
+    __atomic_add_fetch(&_stats.timeouts, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds the duration of a request to a helper to the statistics.
+ *
+ * @param leg       handshake leg the request belongs to
+ * @param start     time the request was sent
+ */
+static void _ntlm_stats_leg(ntlmlegstats_t *leg, struct timespec *start)
+{
+    struct timespec end;
+    unsigned long long usec, max;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    usec = (end.tv_sec - start->tv_sec) * 1000000ULL +
+        (end.tv_nsec - start->tv_nsec) / 1000;
+
+    __atomic_add_fetch(&leg->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&leg->time, usec, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&leg->maxtime, __ATOMIC_RELAXED);
+    while (usec > max && !__atomic_compare_exchange_n(&leg->maxtime, &max, usec, 0,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Waits until the given pipe is ready or the deadline passes.
+ *
+ * @param fd        helper pipe
+ * @param events    poll events to wait for
+ * @param deadline  absolute CLOCK_MONOTONIC deadline
+ *
+ * @return 1 if ready, 0 on timeout, or -1 on error
+ */
+static int _ntlm_helper_wait(int fd, short events, struct timespec *deadline)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    struct timespec now;
+    int msec, n;
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        msec = (deadline->tv_sec - now.tv_sec) * 1000 +
+            (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+        if (msec <= 0)
+            return 0;
+    } while ((n = poll(&pfd, 1, msec)) < 0 && errno == EINTR);
+
+    return n < 0 ? -1 : n;
+}
+
+/**
+ * Sends a request line to a helper and reads its one-line reply. The
+ * pipes are non-blocking, a helper which does not answer within the
+ * helper timeout fails the call. Calling functions are responsible
+ * for freeing the reply.
+ *
+ * @param helper    the helper to talk to
+ * @param request   request line including the newline
+ * @param reply     output buffer for the reply line
+ *
+ * @return the reply length, or -1 on error
+ */
+static int _ntlm_helper_call(ntlmhelper_t *helper, const char *request, char **reply)
+{
+    struct timespec deadline;
+    int len = strlen(request);
+    int size = NTLM_LINE_SIZE;
+    int pos = 0;
+    char *buf, *tmp;
+    int n;
+
+    *reply = NULL;
+
+    if (helper->pid <= 0)
+        return -1;
+
+    /* a request which was sent must have its reply read */
+    if (!(buf = (char *)malloc(size))) {
+        log_error("failed to allocate the NTLM helper reply buffer");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += _timeout / 1000;
+    deadline.tv_nsec += (_timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (pos < len) {
+        if ((n = write(helper->infd, request + pos, len - pos)) > 0)
+            pos += n;
+        else if (errno == EAGAIN && (n = _ntlm_helper_wait(helper->infd, POLLOUT, &deadline)) > 0)
+            continue;
+        else if (errno != EINTR) {
+            if (!n)
+                _ntlm_helper_timeout(helper);
+            else
+                log_error("write to NTLM helper failed with error %d", errno);
+            free(buf);
+            return -1;
+        }
+    }
+
+    for (pos = 0; !pos || buf[pos - 1] != '\n'; pos += n) {
+        if (pos == size - 1 && size == NTLM_MAX_LINE_SIZE) {
+            log_error("NTLM helper reply exceeds %d bytes", NTLM_MAX_LINE_SIZE);
+            break;
+        } else if (pos == size - 1) {
+            if (!(tmp = (char *)realloc(buf, size * 2))) {
+                log_error("failed to grow the NTLM helper reply buffer");
+                break;
+            }
+
+            buf = tmp;
+            size *= 2;
+        }
+
+        if ((n = read(helper->outfd, buf + pos, size - 1 - pos)) > 0)
+            continue;
+        else if (n == 0) {
+            log_error("NTLM helper closed its output");
+            break;
+        } else if (errno == EAGAIN && (n = _ntlm_helper_wait(helper->outfd, POLLIN, &deadline)) > 0)
+            n = 0;
+        else if (errno == EINTR)
+            n = 0;
+        else {
+            if (!n)
+                _ntlm_helper_timeout(helper);
+            else
+                log_error("read from NTLM helper failed with error %d", errno);
+            break;
+        }
+    }
+
+    if (!pos || buf[pos - 1] != '\n') {
+        free(buf);
+        return -1;
+    }
+
+    buf[pos] = '\0';
+    *reply = buf;
+
+    return pos;
+}
+
+/**
+ * Pins a helper to the given handshake. Free helpers are used first,
+ * then helpers held by handshakes the client abandoned. Otherwise
+ * the call blocks until a helper is released.
+ *
+ * @param ctx   authentication context
+ *
+ * @return 1 on success, 0 if no helper became available
+ */
+static int _ntlm_helper_acquire(ntlmctx_t *ctx)
+{
+    struct timespec deadline;
+    ntlmhelper_t *victim;
+    time_t now;
+    int i;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += NTLM_WAIT_TIMEOUT;
+
+    pthread_mutex_lock(&_helpermtx);
+
+    while (!ctx->helper) {
+        now = time(NULL);
+        victim = NULL;
+
+        for (i = 0; i < _helpercount; i++) {
+            if (!_helpers[i].owner) {
+                victim = &_helpers[i];
+                break;
+            } else if (!_helpers[i].active && now - _helpers[i].pinned > NTLM_PIN_TIMEOUT &&
+                       (!victim || _helpers[i].pinned < victim->pinned))
+                victim = &_helpers[i];
+        }
+
+        if (victim) {
+            if (victim->owner) {
+                log_info("taking over NTLM helper from an abandoned handshake");
+                victim->owner->helper = NULL;
+            }
+
+            victim->owner = ctx;
+            victim->pinned = now;
+            ctx->helper = victim;
+            break;
+        }
+
+        log_info("No available NTLM helper, waiting...");
+
+        /* woken by _ntlm_helper_release() */
+        if (pthread_cond_timedwait(&_helpercond, &_helpermtx, &deadline) == ETIMEDOUT) {
+            log_error("timed out waiting for an NTLM helper");
+            break;
+        }
+    }
+
+    if (ctx->helper)
+        ctx->helper->active = 1;
+
+    pthread_mutex_unlock(&_helpermtx);
+
+    return (ctx->helper != NULL);
+}
+
+/**
+ * Marks the helper pinned to the given handshake as in use, so that
+ * it cannot be taken over while we talk to it.
+ *
+ * @param ctx   authentication context
+ *
+ * @return 1 if the handshake still has its helper, 0 otherwise
+ */
+static int _ntlm_helper_resume(ntlmctx_t *ctx)
+{
+    int result;
+
+    pthread_mutex_lock(&_helpermtx);
+
+    if ((result = (ctx->helper != NULL)))
+        ctx->helper->active = 1;
+
+    pthread_mutex_unlock(&_helpermtx);
+
+    return result;
+}
+
+/**
+ * Unpins the helper held by the given handshake.
+ *
+ * @param ctx   authentication context
+ */
+static void _ntlm_helper_release(ntlmctx_t *ctx)
+{
+    pthread_mutex_lock(&_helpermtx);
+
+    if (ctx->helper) {
+        ctx->helper->owner = NULL;
+        ctx->helper->active = 0;
+        ctx->helper = NULL;
+        pthread_cond_signal(&_helpercond);
+    }
+
+    pthread_mutex_unlock(&_helpermtx);
+}
+
+/**
+ * Initialises the pool of NTLM helper processes. Handshakes are spread
+ * over the pool, each one keeping its helper until it completes.
+ *
+ * @param helper    path to the NTLM helper tool
+ * @param count     number of helper processes
+ *
+ * @return 1 on success, 0 on failure
+ */
+int ntlm_auth_pool_init(const char *helper, int count)
+{
+    int i;
 
     if (!helper) {
         log_error("missing helper application path!");
-        return NULL;
+        return 0;
+    } else if (count < 1) {
+        log_error("helper count must be at least 1 (was %d)", count);
+        return 0;
     }
 
     if (access(helper, X_OK)) {
         log_error("permission check failed for helper %s", helper);
-        return NULL;
+        return 0;
     }
 
-    ntlmctx_t *result = (ntlmctx_t *)malloc(sizeof(ntlmctx_t));
-    bzero(result, sizeof(ntlmctx_t));
+    pthread_mutex_lock(&_helpermtx);
 
-    result->scope = strdup(scope);
-    result->helper = strdup(helper);
+    if (_helpers) {
+        pthread_mutex_unlock(&_helpermtx);
+        log_warn("NTLM helper pool is already initialised");
+        return 1;
+    }
 
-    pipe(infd);
-    pipe(outfd);
-    pipe(errfd);
+    _helperpath = strdup(helper);
+    _helpers = (ntlmhelper_t *)calloc(count, sizeof(ntlmhelper_t));
+    _helpercount = count;
 
-    log_debug("spawning child process %s", helper);
+    for (i = 0; i < count; i++)
+        _ntlm_helper_spawn(&_helpers[i]);
 
-    if ((result->pid = fork()) == -1) {
-        log_error("fork() failed with error %d", result->pid);
+    pthread_mutex_unlock(&_helpermtx);
 
-        close(infd[READ]);
-        close(infd[WRITE]);
-        close(outfd[READ]);
-        close(outfd[WRITE]);
-        close(errfd[READ]);
-        close(errfd[WRITE]);
+    log_debug("initialised NTLM helper pool with size %d", count);
+    return 1;
+}
 
-        ntlm_auth_free(result);
-        return NULL;
-    }
+/**
+ * Stops all helper processes and deallocates the pool.
+ */
+void ntlm_auth_pool_destroy()
+{
+    int i;
 
-    if (!result->pid) {
-        dup2(infd[READ], STDIN_FILENO);
-        dup2(outfd[WRITE], STDOUT_FILENO);
-        dup2(errfd[WRITE], STDERR_FILENO);
+    pthread_mutex_lock(&_helpermtx);
 
-        close(infd[READ]);
-        close(infd[WRITE]);
-        close(outfd[READ]);
-        close(outfd[WRITE]);
-        close(errfd[READ]);
-        close(errfd[WRITE]);
+    if (_helpers) {
+        for (i = 0; i < _helpercount; i++) {
+            if (_helpers[i].owner)
+                _helpers[i].owner->helper = NULL;
+
+            _ntlm_helper_kill(&_helpers[i]);
+        }
+
+        log_info("stopped %d NTLM helpers, %lu were started in total",
+                 _helpercount, __atomic_load_n(&_spawned, __ATOMIC_RELAXED));
 
-        char *argv[] = { result->helper, "--helper-protocol=squid-2.5-ntlmssp", NULL };
-        execv(argv[0], argv);
-        exit(0);
+        if (_stats.negotiate.count && _stats.response.count) {
+            log_info("NTLM helper replies: negotiate %lu (avg %llu us, max %llu us), "
+                     "response %lu (avg %llu us, max %llu us), %lu timeouts, %lu restarts",
+                     _stats.negotiate.count, _stats.negotiate.time / _stats.negotiate.count,
+                     _stats.negotiate.maxtime, _stats.response.count,
+                     _stats.response.time / _stats.response.count, _stats.response.maxtime,
+                     _stats.timeouts, _stats.restarts);
+        }
+
+        free(_helpers);
+        free(_helperpath);
     }
 
-    close(infd[READ]);
-    close(outfd[WRITE]);
-    close(errfd[WRITE]);
+    _helpers = NULL;
+    _helperpath = NULL;
+    _helpercount = 0;
+
+    pthread_mutex_unlock(&_helpermtx);
+}
+
+/**
+ * Sets how long a helper may take to answer a request. A helper which
+ * does not answer in time is replaced.
+ *
+ * @param msec  timeout in milliseconds
+ */
+void ntlm_auth_set_timeout(int msec)
+{
+    if (msec > 0)
+        _timeout = msec;
+}
+
+/**
+ * Gets the helper statistics.
+ *
+ * @param stats     output buffer for the statistics
+ */
+void ntlm_auth_get_stats(ntlmstats_t *stats)
+{
+    stats->negotiate.count = __atomic_load_n(&_stats.negotiate.count, __ATOMIC_RELAXED);
+    stats->negotiate.time = __atomic_load_n(&_stats.negotiate.time, __ATOMIC_RELAXED);
+    stats->negotiate.maxtime = __atomic_load_n(&_stats.negotiate.maxtime, __ATOMIC_RELAXED);
+    stats->response.count = __atomic_load_n(&_stats.response.count, __ATOMIC_RELAXED);
+    stats->response.time = __atomic_load_n(&_stats.response.time, __ATOMIC_RELAXED);
+    stats->response.maxtime = __atomic_load_n(&_stats.response.maxtime, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&_stats.timeouts, __ATOMIC_RELAXED);
+    stats->restarts = __atomic_load_n(&_stats.restarts, __ATOMIC_RELAXED);
+}
+
+/**
+ * Initialises an NTLM authentication context. Calling functions
+ * should call ntlm_auth_free() to free the result.
+ *
+ * @param scope     authentication scope
+ * @param helper    path to the NTLM helper tool, used to start the
+ *                  helper pool if it is not running yet
+ *
+ * @return a context or NULL on error
+ */
+ntlmctx_t *ntlm_auth_init(const char *scope, const char *helper)
+{
+    pthread_mutex_lock(&_helpermtx);
+    int running = (_helpers != NULL);
+    pthread_mutex_unlock(&_helpermtx);
+
+    if (!running && !ntlm_auth_pool_init(helper, NTLM_POOL_SIZE))
+        return NULL;
 
-    result->infd = infd[WRITE];
-    result->outfd = outfd[READ];
-    result->errfd = errfd[READ];
+    ntlmctx_t *result = (ntlmctx_t *)malloc(sizeof(ntlmctx_t));
+    bzero(result, sizeof(ntlmctx_t));
+
+    result->scope = strdup(scope);
 
     return result;
 }
@@ -121,16 +597,11 @@ void ntlm_auth_free(ntlmctx_t *ctx)
     if (!ctx)
         return;
 
+    _ntlm_helper_release(ctx);
+
     if (ctx->scope)
         free(ctx->scope);
 
-    if (ctx->helper)
-        free(ctx->helper);
-
-    close(ctx->infd);
-    close(ctx->outfd);
-    close(ctx->errfd);
-
     free(ctx);
 }
 
@@ -162,68 +633,89 @@ int ntlm_auth_challenge(ntlmctx_t *ctx, const char *challenge, char **response)
         ctx->state = NTLM_RESET;
     }
 
-    if (ctx->state != NTLM_RESET) {
-        char data[1024];
-        char msg[1024];
-        char code[3];
-        int datalen = 0;
+    if (ctx->state == NTLM_RESET)
+        _ntlm_helper_release(ctx);
+    else if (ctx->state == NTLM_NEGOTIATE && !_ntlm_helper_resume(ctx) &&
+             !_ntlm_helper_acquire(ctx))
+        ctx->state = NTLM_RESET;
+    else if (ctx->state == NTLM_RESPONSE && !_ntlm_helper_resume(ctx)) {
+        log_warn("NTLM handshake lost its helper, restarting negotiation");
+        ctx->state = NTLM_RESET;
+    }
 
-        bzero(data, 1024);
-        bzero(msg, 1024);
-        bzero(code, 3);
+    if (ctx->state != NTLM_RESET) {
+        const char *data = challenge + 5;
+        struct timespec start;
+        char *request = NULL;
+        char *reply = NULL;
+        char *msg;
+        int datalen = -1;
 
-        strncpy(data, challenge + 5, 1024);
         log_trace("NTLM challenge data: %s", data);
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
         if (ctx->state == NTLM_NEGOTIATE) {
             /* TODO check to make sure this is in fact a type 1 NTLM message */
-            write(ctx->infd, "YR\n", 3);
-            datalen = read(ctx->outfd, data, 1023);
+            datalen = _ntlm_helper_call(ctx->helper, "YR\n", &reply);
+            _ntlm_stats_leg(&_stats.negotiate, &start);
         } else if (ctx->state == NTLM_RESPONSE) {
-            char kkdata[1024];
-            snprintf(kkdata, 1024, "KK %s\n", data);
+            if ((request = (char *)malloc(strlen(data) + 5))) {
+                sprintf(request, "KK %s\n", data);
 
-            write(ctx->infd, kkdata, strlen(kkdata));
-            datalen = read(ctx->outfd, data, 1023);
-        } else {
-            data[0] = '\0';
-            datalen = 0;
+                datalen = _ntlm_helper_call(ctx->helper, request, &reply);
+                _ntlm_stats_leg(&_stats.response, &start);
+                free(request);
+            }
         }
 
-        log_trace("raw data received from helper: %s", data);
+        log_trace("raw data received from helper: %s", reply);
 
-        if (datalen < 5 || data[2] != ' ' || data[datalen - 1] != '\n') {
+        if (datalen < 5 || reply[2] != ' ') {
             log_error("response from helper is malformed!");
+            if (ctx->helper)
+                _ntlm_helper_restart(ctx->helper);
+            _ntlm_helper_release(ctx);
             ctx->state = NTLM_RESET;
+            free(reply);
             return 0;
         }
 
-        strncpy(code, data, 2);
-        strncpy(msg, data + 3, datalen - 4);
-
-        if (ctx->state == NTLM_NEGOTIATE && !strcmp(code, "TT")) {
-            char respdata[1024];
-            snprintf(respdata, 1024, "NTLM %s", msg);
+        /* split the code from the message and drop the newline */
+        reply[2] = reply[datalen - 1] = '\0';
+        msg = reply + 3;
 
+        if (ctx->state == NTLM_NEGOTIATE && !strcmp(reply, "TT")) {
             log_debug("sending challenge to client");
             ctx->state = NTLM_RESPONSE;
-            *response = strdup(respdata);
-        } else if (ctx->state == NTLM_RESPONSE && !strcmp(code, "AF")) {
+            *response = (char *)malloc(strlen(msg) + 6);
+            sprintf(*response, "NTLM %s", msg);
+
+            /* the helper stays pinned until the client answers */
+            pthread_mutex_lock(&_helpermtx);
+            ctx->helper->active = 0;
+            ctx->helper->pinned = time(NULL);
+            pthread_mutex_unlock(&_helpermtx);
+        } else if (ctx->state == NTLM_RESPONSE && !strcmp(reply, "AF")) {
             log_info("authentication succeeded for %s", msg);
             ctx->state = NTLM_SUCCESS;
             *response = strdup(msg);
-        } else if (ctx->state == NTLM_RESPONSE && !strcmp(code, "NA")) {
+        } else if (ctx->state == NTLM_RESPONSE && !strcmp(reply, "NA")) {
             log_info("authentication failed: %s", msg);
             ctx->state = NTLM_RESET;
-        } else if (!strcmp(code, "BH")) {
-            /* TODO the helper probably should be restarted */
+        } else if (!strcmp(reply, "BH")) {
             log_error("received error from helper: %s", msg);
+            _ntlm_helper_restart(ctx->helper);
             ctx->state = NTLM_RESET;
         } else {
             log_error("authentication context reached an unexpected state");
-            log_debug("context_state=%d helper_code=%s", ctx->state, code);
+            log_debug("context_state=%d helper_code=%s", ctx->state, reply);
             ctx->state = NTLM_RESET;
         }
+
+        if (ctx->state != NTLM_RESPONSE)
+            _ntlm_helper_release(ctx);
+
+        free(reply);
     }
 
     if (ctx->state == NTLM_RESET) {
@@ -233,4 +725,3 @@ int ntlm_auth_challenge(ntlmctx_t *ctx, const char *challenge, char **response)
 
     return (ctx->state == NTLM_SUCCESS);
 }
-
@@ -33,6 +33,8 @@
 static pgctx **_ctxpool = NULL;
 static int _ctxcount = 0;
 static pthread_mutex_t _ctxmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _ctxcond = PTHREAD_COND_INITIALIZER;
+static int _ctxwaiters = 0;
 static char *_nulltag = NULL;
 
 /**
@@ -109,6 +111,17 @@ int pg_pool_size()
     return result;
 }
 
+/**
+ * Gets the number of threads waiting for a free context. This is a
+ * measure of how overloaded the database pool is.
+ *
+ * @return the waiter count
+ */
+int pg_pool_waiters()
+{
+    return __atomic_load_n(&_ctxwaiters, __ATOMIC_RELAXED);
+}
+
 /**
  * Allocates a new database context.
  *
@@ -174,7 +187,7 @@ int pg_context_count()
 
 /**
  * Acquires a thread-exclusive database connection. This function will
- * block until a connection becomes available.
+ * block until a connection is released.
  *
  * Passing NULL for the tag argument will always return bootstrapping
  * contexts (as in, contexts created without a tag) even if the contexts
@@ -217,32 +230,34 @@ pgctx *pg_context_acquire(const char *tag)
         return NULL;
     }
 
-    i = 0;
+    pthread_mutex_lock(&_ctxmtx);
     while (1) {
-        pthread_mutex_lock(&_ctxmtx);
-        m = ((!tag && !_ctxpool[i]->tag) || 
-             (!tag && _nulltag && _ctxpool[i]->tag && strcmp(_ctxpool[i]->tag, _nulltag) == 0) || 
-             (tag && _ctxpool[i]->tag && strcmp(_ctxpool[i]->tag, tag) == 0));
-
-        if (_ctxpool[i] && _ctxpool[i]->owner == 0 && m) {
-            log_debug("got PG context %d", i);
-
-            _ctxpool[i]->owner = (unsigned long)pthread_self();
-            _ctxpool[i]->refcount++;
-            result = _ctxpool[i];
+        for (i = 0; i < _ctxcount && _ctxpool[i]; i++) {
+            m = ((!tag && !_ctxpool[i]->tag) || 
+                 (!tag && _nulltag && _ctxpool[i]->tag && strcmp(_ctxpool[i]->tag, _nulltag) == 0) || 
+                 (tag && _ctxpool[i]->tag && strcmp(_ctxpool[i]->tag, tag) == 0));
+
+            if (_ctxpool[i]->owner == 0 && m) {
+                log_debug("got PG context %d", i);
+
+                _ctxpool[i]->owner = (unsigned long)pthread_self();
+                _ctxpool[i]->refcount++;
+                result = _ctxpool[i];
+                break;
+            }
         }
-        pthread_mutex_unlock(&_ctxmtx);
 
         if (result)
             break;
 
-        i++;
-        if (i == _ctxcount || !_ctxpool[i]) {
-            log_info("No available PG context, sleeping...");
-            sleep(5);
-            i = 0;
-        }
+        log_info("No available PG context, waiting...");
+
+        /* woken by pg_context_release() */
+        __atomic_add_fetch(&_ctxwaiters, 1, __ATOMIC_RELAXED);
+        pthread_cond_wait(&_ctxcond, &_ctxmtx);
+        __atomic_sub_fetch(&_ctxwaiters, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&_ctxmtx);
 
     return result;
 }
@@ -268,6 +283,10 @@ void pg_context_release(pgctx *context)
             if (context->refcount == 0) {
                 context->owner = 0;
                 log_debug("released PG context %d", i);
+
+                /* waiters may want a different tag, wake them all */
+                if (_ctxwaiters)
+                    pthread_cond_broadcast(&_ctxcond);
             } else
                 log_debug("PG context %d is still in use", i);
 
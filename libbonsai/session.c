@@ -30,11 +30,292 @@
 #include <session.h>
 #include <log.h>
 
-#define MAX_SESSIONS    10240
+typedef struct {
+    pthread_mutex_t mtx;
+    session_t **buckets;
+    unsigned int mask;
+    int count;
+    session_t *newest;              /* LRU list */
+    session_t *oldest;
+} shard_t;
+
+static shard_t _shards[SESSION_SHARDS];
+static pthread_once_t _storeonce = PTHREAD_ONCE_INIT;
+static int _capacity = SESSION_CAPACITY;
+static int _ttl = SESSION_TTL;
+static session_stats_t _stats;
+static const session_backend_t *_backend = NULL;
+
+static const session_backend_t *_backends[] = {
+    &session_backend_shm,
+    &session_backend_pg,
+    NULL
+};
 
-static session_t **_sessions = NULL;
-static pthread_mutex_t _sessionmtx = PTHREAD_MUTEX_INITIALIZER;
-static int _tail = -1;
+/**
+ * Allocates the hash tables of all shards. Each table has at least
+ * as many buckets as its shard can hold sessions.
+ */
+static void _session_store_alloc()
+{
+    unsigned int size = 1;
+    int i;
+
+    while (size * SESSION_SHARDS < (unsigned int)_capacity)
+        size <<= 1;
+
+    for (i = 0; i < SESSION_SHARDS; i++) {
+        pthread_mutex_init(&_shards[i].mtx, NULL);
+        _shards[i].buckets = (session_t **)calloc(size, sizeof(session_t *));
+        _shards[i].mask = size - 1;
+    }
+
+    log_debug("initialised session storage with %d shards of %u buckets",
+              SESSION_SHARDS, size);
+}
+
+/**
+ * FNV-1a hash of a session ID. The low bits pick the shard, the
+ * others the bucket.
+ *
+ * @param id    a session ID
+ *
+ * @return the hash value
+ */
+static unsigned int _session_hash(const char *id)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *id; id++) {
+        hash ^= (unsigned char)*id;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static shard_t *_session_shard(unsigned int hash)
+{
+    return &_shards[hash & (SESSION_SHARDS - 1)];
+}
+
+static session_t **_session_bucket(shard_t *shard, unsigned int hash)
+{
+    return &shard->buckets[(hash / SESSION_SHARDS) & shard->mask];
+}
+
+/**
+ * Makes the given session the most recently used one of its shard.
+ * The shard must be locked.
+ */
+static void _session_touch(shard_t *shard, session_t *session)
+{
+    session->lastseen = time(NULL);
+
+    if (shard->newest == session)
+        return;
+
+    /* unlink, unless the session is new */
+    if (session->newer) {
+        session->newer->older = session->older;
+
+        if (session->older)
+            session->older->newer = session->newer;
+        else
+            shard->oldest = session->newer;
+    }
+
+    session->newer = NULL;
+    session->older = shard->newest;
+
+    if (shard->newest)
+        shard->newest->newer = session;
+    else
+        shard->oldest = session;
+
+    shard->newest = session;
+}
+
+/**
+ * Removes a session from its shard and frees it along with its
+ * authentication contexts. The shard must be locked.
+ */
+static void _session_free(shard_t *shard, session_t *session)
+{
+    session_t **link = _session_bucket(shard, session->hash);
+    ntlmctx_t *ctx, *next;
+
+    while (*link != session)
+        link = &(*link)->next;
+    *link = session->next;
+
+    if (session->newer)
+        session->newer->older = session->older;
+    else
+        shard->newest = session->older;
+
+    if (session->older)
+        session->older->newer = session->newer;
+    else
+        shard->oldest = session->newer;
+
+    shard->count--;
+    __atomic_sub_fetch(&_stats.live, 1, __ATOMIC_RELAXED);
+
+    /* pinned NTLM helpers are released here */
+    for (ctx = session->authctx; ctx; ctx = next) {
+        next = ctx->next;
+        ntlm_auth_free(ctx);
+    }
+
+    free(session->id);
+    if (session->userid)
+        free(session->userid);
+
+    free(session);
+}
+
+/**
+ * Frees sessions of the given shard which were idle for longer than
+ * the TTL, and the least recently used ones while the shard is
+ * full. Sessions with open handles are kept. The shard must be
+ * locked.
+ *
+ * @return true if there is room for another session
+ */
+static int _session_evict(shard_t *shard)
+{
+    int limit = (_capacity + SESSION_SHARDS - 1) / SESSION_SHARDS;
+    time_t expiry = time(NULL) - _ttl;
+    session_t *cur = shard->oldest;
+    session_t *newer;
+
+    while (cur && (cur->lastseen < expiry || shard->count >= limit)) {
+        newer = cur->newer;
+
+        if (cur->refcount > 0) {
+            cur = newer;
+            continue;
+        }
+
+        if (cur->lastseen < expiry) {
+            log_debug("session %s expired", cur->id);
+            __atomic_add_fetch(&_stats.expired, 1, __ATOMIC_RELAXED);
+        } else {
+            log_debug("evicting session %s", cur->id);
+            __atomic_add_fetch(&_stats.evicted, 1, __ATOMIC_RELAXED);
+        }
+
+        _session_free(shard, cur);
+        cur = newer;
+    }
+
+    return (shard->count < limit);
+}
+
+/**
+ * Initialises the session store. Calling this is optional, the
+ * store is set up with the default limits on first use. It cannot
+ * be resized once it is in use.
+ *
+ * @param capacity  the most sessions kept at a time
+ * @param ttl       seconds after which an idle session is removed
+ *
+ * @return 1 on success, 0 on failure
+ */
+int session_store_init(int capacity, int ttl)
+{
+    if (capacity < 1) {
+        log_error("session capacity must be at least 1 (was %d)", capacity);
+        return 0;
+    } else if (ttl < 1) {
+        log_error("session TTL must be at least 1 (was %d)", ttl);
+        return 0;
+    }
+
+    _capacity = capacity;
+    _ttl = ttl;
+    pthread_once(&_storeonce, _session_store_alloc);
+
+    return 1;
+}
+
+/**
+ * Shares authenticated sessions with other processes through the given
+ * backend. The specification is the backend name, optionally followed
+ * by a colon and an argument for the backend, e.g. "shm:/tf-sessions".
+ * "local" keeps sessions in the process.
+ *
+ * @param spec  backend specification
+ *
+ * @return 1 on success, 0 on failure
+ */
+int session_store_open(const char *spec)
+{
+    const char *arg = strchr(spec, ':');
+    int len = arg ? arg - spec : strlen(spec);
+    int i;
+
+    if (!strncmp(spec, "local", len) && len == 5)
+        return 1;
+
+    for (i = 0; _backends[i]; i++) {
+        if (strlen(_backends[i]->name) != len || strncmp(_backends[i]->name, spec, len))
+            continue;
+
+        if (!_backends[i]->open(arg ? arg + 1 : NULL, _capacity, _ttl))
+            return 0;
+
+        log_info("sharing sessions through the %s store", _backends[i]->name);
+        _backend = _backends[i];
+
+        return 1;
+    }
+
+    log_error("unknown session store %s", spec);
+    return 0;
+}
+
+/**
+ * Frees all sessions and the session store.
+ */
+void session_store_free()
+{
+    int i;
+
+    if (_backend) {
+        _backend->close();
+        _backend = NULL;
+    }
+
+    for (i = 0; i < SESSION_SHARDS; i++) {
+        pthread_mutex_lock(&_shards[i].mtx);
+
+        while (_shards[i].oldest)
+            _session_free(&_shards[i], _shards[i].oldest);
+
+        free(_shards[i].buckets);
+        _shards[i].buckets = NULL;
+
+        pthread_mutex_unlock(&_shards[i].mtx);
+    }
+
+    log_info("session store: %lu expired, %lu evicted, %lu rejected",
+             _stats.expired, _stats.evicted, _stats.rejected);
+}
+
+/**
+ * Gets the session store statistics.
+ *
+ * @param stats     output buffer for the statistics
+ */
+void session_get_stats(session_stats_t *stats)
+{
+    stats->live = __atomic_load_n(&_stats.live, __ATOMIC_RELAXED);
+    stats->expired = __atomic_load_n(&_stats.expired, __ATOMIC_RELAXED);
+    stats->evicted = __atomic_load_n(&_stats.evicted, __ATOMIC_RELAXED);
+    stats->rejected = __atomic_load_n(&_stats.rejected, __ATOMIC_RELAXED);
+}
 
 /**
  * Creates or resumes a client session.
@@ -46,43 +327,55 @@ static int _tail = -1;
 session_t *session_init(const char *id)
 {
     session_t *result = NULL;
-    int i;
+    unsigned int hash;
+    shard_t *shard;
 
     if (!id)
         return NULL;
 
-    pthread_mutex_lock(&_sessionmtx);
+    pthread_once(&_storeonce, _session_store_alloc);
+
+    hash = _session_hash(id);
+    shard = _session_shard(hash);
 
-    if (!_sessions) {
-        _sessions = (session_t **)calloc(MAX_SESSIONS, sizeof(session_t *));
-        log_debug("initialised session storage with size %d", MAX_SESSIONS);
+    pthread_mutex_lock(&shard->mtx);
+
+    if (!shard->buckets) {
+        pthread_mutex_unlock(&shard->mtx);
+        log_error("session store was freed");
+        return NULL;
     }
 
-    for (i = 0; i <= _tail && i < MAX_SESSIONS; i++) {
-        if (strcmp(_sessions[i]->id, id) == 0) {
-            result = _sessions[i];
+    for (result = *_session_bucket(shard, hash); result; result = result->next) {
+        if (result->hash == hash && strcmp(result->id, id) == 0)
             break;
-        }
     }
 
-    if (!result && i == MAX_SESSIONS)
+    if (result) {
+        log_debug("re-using session with ID %s", id);
+        result->refcount++;
+        _session_touch(shard, result);
+    } else if (!_session_evict(shard)) {
         log_error("no session slots available!");
-    else if (!result) {
-        log_info("allocating session %d with ID %s", i, id);
-        result = _sessions[i] = (session_t *)malloc(sizeof(session_t));
+        __atomic_add_fetch(&_stats.rejected, 1, __ATOMIC_RELAXED);
+    } else {
+        log_info("allocating session with ID %s", id);
+        result = (session_t *)malloc(sizeof(session_t));
         bzero(result, sizeof(session_t));
-        _tail = i;
 
         result->id = strdup(id);
+        result->hash = hash;
         result->refcount++;
-        result->lastseen = time(NULL);
-    } else {
-        log_debug("re-using session %d with ID %s", i, id);
-        result->refcount++;
-        result->lastseen = time(NULL);
+
+        result->next = *_session_bucket(shard, hash);
+        *_session_bucket(shard, hash) = result;
+        _session_touch(shard, result);
+
+        shard->count++;
+        __atomic_add_fetch(&_stats.live, 1, __ATOMIC_RELAXED);
     }
 
-    pthread_mutex_unlock(&_sessionmtx);
+    pthread_mutex_unlock(&shard->mtx);
 
     return result;
 }
@@ -97,10 +390,13 @@ void session_close(session_t *session)
     if (!session)
         return;
 
-    pthread_mutex_lock(&_sessionmtx);
+    shard_t *shard = _session_shard(session->hash);
+
+    pthread_mutex_lock(&shard->mtx);
     session->refcount--;
+    _session_touch(shard, session);
     log_debug("released session handle for %s (%d remaining)", session->id, session->refcount);
-    pthread_mutex_unlock(&_sessionmtx);
+    pthread_mutex_unlock(&shard->mtx);
 }
 
 /**
@@ -111,13 +407,25 @@ void session_close(session_t *session)
  */
 void session_bind_user(session_t *session, const char *userid)
 {
-    if (!session || session->userid || !userid)
+    int bound = 0;
+
+    if (!session || !userid)
         return;
 
-    pthread_mutex_lock(&_sessionmtx);
-    log_info("binding session %s to user %s", session->id, userid);
-    session->userid = strdup(userid);
-    pthread_mutex_unlock(&_sessionmtx);
+    shard_t *shard = _session_shard(session->hash);
+
+    /* another request on the session may be binding it too */
+    pthread_mutex_lock(&shard->mtx);
+    if (!session->userid) {
+        log_info("binding session %s to user %s", session->id, userid);
+        session->userid = strdup(userid);
+        session->synced = time(NULL);
+        bound = 1;
+    }
+    pthread_mutex_unlock(&shard->mtx);
+
+    if (bound && _backend)
+        _backend->bind(session->id, userid);
 }
 
 /**
@@ -144,7 +452,9 @@ int session_auth_init(session_t *session, const char *scope, ntlmctx_t **authctx
     if (!session)
         return -1;
 
-    pthread_mutex_lock(&_sessionmtx);
+    shard_t *shard = _session_shard(session->hash);
+
+    pthread_mutex_lock(&shard->mtx);
     buf = session->authctx;
 
     while (buf) {
@@ -156,20 +466,20 @@ int session_auth_init(session_t *session, const char *scope, ntlmctx_t **authctx
 
     if (!authctx) {
         result = (buf != NULL);
-        pthread_mutex_unlock(&_sessionmtx);
+        pthread_mutex_unlock(&shard->mtx);
         return result;
     } else if (authctx && *authctx && buf) {
         log_error("got an auth context but one already exists");
-        pthread_mutex_unlock(&_sessionmtx);
+        pthread_mutex_unlock(&shard->mtx);
         return -1;
     } else if (authctx && !*authctx && buf) {
         log_debug("returning previous authentication context");
         *authctx = buf;
-        pthread_mutex_unlock(&_sessionmtx);
+        pthread_mutex_unlock(&shard->mtx);
         return 1;
     } else if (authctx && !*authctx) {
         log_debug("no previous authentication context exists");
-        pthread_mutex_unlock(&_sessionmtx);
+        pthread_mutex_unlock(&shard->mtx);
         return 0;
     }
 
@@ -190,12 +500,15 @@ int session_auth_init(session_t *session, const char *scope, ntlmctx_t **authctx
     } else
         session->authctx = *authctx;
 
-    pthread_mutex_unlock(&_sessionmtx);
+    pthread_mutex_unlock(&shard->mtx);
     return 1;
 }
 
 /**
- * Determines if the session is authenticated.
+ * Determines if the session is authenticated. A session unknown to
+ * this process may have been authenticated by another one sharing the
+ * session store. Bindings are refreshed in the shared store while
+ * the session is in use, so that they do not expire there.
  *
  * @param session   a session structure
  *
@@ -203,12 +516,39 @@ int session_auth_init(session_t *session, const char *scope, ntlmctx_t **authctx
  */
 int session_auth_check(session_t *session)
 {
-    int result;
+    shard_t *shard = _session_shard(session->hash);
+    time_t now = time(NULL);
+    char *userid = NULL;
+    int result, sync;
 
-    pthread_mutex_lock(&_sessionmtx);
+    pthread_mutex_lock(&shard->mtx);
     result = (session->userid != NULL);
-    pthread_mutex_unlock(&_sessionmtx);
+    sync = (_backend && (!result || now - session->synced > _ttl / 2));
+    if (sync && result)
+        session->synced = now;
+    pthread_mutex_unlock(&shard->mtx);
 
-    return result;
-}
+    if (!sync)
+        return result;
 
+    /* the user ID does not change once it is set */
+    if (result) {
+        _backend->bind(session->id, session->userid);
+        return result;
+    }
+
+    if (!_backend->lookup(session->id, &userid))
+        return 0;
+
+    log_info("session %s was authenticated as %s by another process", session->id, userid);
+
+    pthread_mutex_lock(&shard->mtx);
+    if (!session->userid)
+        session->userid = userid;
+    else
+        free(userid);
+    session->synced = now;
+    pthread_mutex_unlock(&shard->mtx);
+
+    return 1;
+}
@@ -0,0 +1,331 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   session store shared by processes on the same host
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <session.h>
+#include <log.h>
+
+#define SHM_PROBE_SLOTS     16      /* slots searched for a session ID */
+#define SHM_OPEN_WAIT       5000    /* milliseconds to wait for the creator */
+
+typedef struct {
+    char id[SESSION_ID_MAXLEN];
+    char userid[SESSION_USER_MAXLEN];
+    time_t lastseen;
+} shmslot_t;
+
+typedef struct {
+    int ready;                      /* set once the creator initialised it */
+    pthread_mutex_t mtx;
+    int capacity;
+    int ttl;
+    shmslot_t slots[];
+} shmstore_t;
+
+static shmstore_t *_store = NULL;
+static size_t _storesize = 0;
+
+static unsigned int _shm_hash(const char *id)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *id; id++) {
+        hash ^= (unsigned char)*id;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Locks the store. A process that died holding the lock can only
+ * have left a single slot half-written, which at worst loses the
+ * binding of one session.
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int _shm_lock()
+{
+    int rc = pthread_mutex_lock(&_store->mtx);
+
+#ifdef LINUX
+    if (rc == EOWNERDEAD) {
+        log_warn("a process died while holding the session store lock");
+        pthread_mutex_consistent(&_store->mtx);
+        rc = 0;
+    }
+#endif
+
+    if (rc) {
+        log_error("failed to lock the session store (%s)", strerror(rc));
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Initialises a newly created segment.
+ *
+ * @param fd        shared memory descriptor
+ * @param capacity  number of session slots
+ * @param ttl       seconds a binding is kept after last use
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int _shm_create(int fd, int capacity, int ttl)
+{
+    pthread_mutexattr_t attr;
+
+    _storesize = sizeof(shmstore_t) + capacity * sizeof(shmslot_t);
+
+    if (ftruncate(fd, _storesize) == -1) {
+        log_error("failed to size the session store (%s)", strerror(errno));
+        return 0;
+    }
+
+    _store = (shmstore_t *)mmap(NULL, _storesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (_store == MAP_FAILED) {
+        log_error("failed to map the session store (%s)", strerror(errno));
+        _store = NULL;
+        return 0;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef LINUX
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(&_store->mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    /* ftruncate() zeroed the slots */
+    _store->capacity = capacity;
+    _store->ttl = ttl;
+    __atomic_store_n(&_store->ready, 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * Maps a segment created by another process, waiting for the
+ * creator to finish initialising it.
+ *
+ * @param fd    shared memory descriptor
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int _shm_attach(int fd)
+{
+    struct stat st;
+    int waited;
+
+    for (waited = 0; waited < SHM_OPEN_WAIT; waited += 10) {
+        if (fstat(fd, &st) == -1) {
+            log_error("failed to stat the session store (%s)", strerror(errno));
+            return 0;
+        }
+
+        if (st.st_size > 0 && !_store) {
+            _storesize = st.st_size;
+            _store = (shmstore_t *)mmap(NULL, _storesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+            if (_store == MAP_FAILED) {
+                log_error("failed to map the session store (%s)", strerror(errno));
+                _store = NULL;
+                return 0;
+            }
+        }
+
+        if (_store && __atomic_load_n(&_store->ready, __ATOMIC_ACQUIRE))
+            return 1;
+
+        usleep(10000);
+    }
+
+    log_error("session store was never initialised, remove it and restart");
+
+    if (_store)
+        munmap(_store, _storesize);
+    _store = NULL;
+
+    return 0;
+}
+
+/**
+ * Opens the shared session store, creating it if this is the first
+ * process to use it. The capacity and TTL of the creator apply to
+ * all processes.
+ *
+ * @param name      shared memory object name, or NULL for the default
+ * @param capacity  number of session slots
+ * @param ttl       seconds a binding is kept after last use
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int _shm_open(const char *name, int capacity, int ttl)
+{
+    int fd, result;
+
+    if (!name || !*name)
+        name = SESSION_SHM_NAME;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) != -1) {
+        log_info("creating shared session store %s with %d slots", name, capacity);
+        result = _shm_create(fd, capacity, ttl);
+
+        if (!result)
+            shm_unlink(name);
+    } else if (errno == EEXIST && (fd = shm_open(name, O_RDWR, 0600)) != -1) {
+        log_info("attaching to shared session store %s", name);
+        result = _shm_attach(fd);
+    } else {
+        log_error("failed to open shared session store %s (%s)", name, strerror(errno));
+        return 0;
+    }
+
+    close(fd);
+
+    if (result && _store->capacity != capacity)
+        log_warn("shared session store has %d slots instead of %d", _store->capacity, capacity);
+
+    return result;
+}
+
+/**
+ * Unmaps the shared session store. The store is left in place for
+ * the other processes using it.
+ */
+static void _shm_close()
+{
+    if (!_store)
+        return;
+
+    munmap(_store, _storesize);
+    _store = NULL;
+}
+
+/**
+ * Looks up the user bound to the given session ID.
+ *
+ * @param id        session ID
+ * @param userid    output buffer for a copy of the user ID
+ *
+ * @return 1 if the session is bound, 0 otherwise
+ */
+static int _shm_lookup(const char *id, char **userid)
+{
+    unsigned int start = _shm_hash(id);
+    time_t now = time(NULL);
+    shmslot_t *slot;
+    int i, result = 0;
+
+    if (strlen(id) >= SESSION_ID_MAXLEN || !_shm_lock())
+        return 0;
+
+    for (i = 0; i < SHM_PROBE_SLOTS; i++) {
+        slot = &_store->slots[(start + i) % _store->capacity];
+
+        if (strcmp(slot->id, id))
+            continue;
+
+        if (now - slot->lastseen <= _store->ttl) {
+            *userid = strdup(slot->userid);
+            slot->lastseen = now;
+            result = 1;
+        }
+
+        break;
+    }
+
+    pthread_mutex_unlock(&_store->mtx);
+
+    return result;
+}
+
+/**
+ * Binds the given session ID to a user. The binding replaces an
+ * expired one, or else the least recently used one, among the slots
+ * searched for the session ID.
+ *
+ * @param id        session ID
+ * @param userid    user ID
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int _shm_bind(const char *id, const char *userid)
+{
+    unsigned int start = _shm_hash(id);
+    time_t now = time(NULL);
+    shmslot_t *slot, *victim = NULL;
+    int i;
+
+    if (strlen(id) >= SESSION_ID_MAXLEN || strlen(userid) >= SESSION_USER_MAXLEN) {
+        log_debug("not sharing session %s, its ID or user is too long", id);
+        return 0;
+    }
+
+    if (!_shm_lock())
+        return 0;
+
+    for (i = 0; i < SHM_PROBE_SLOTS; i++) {
+        slot = &_store->slots[(start + i) % _store->capacity];
+
+        if (!strcmp(slot->id, id)) {
+            victim = slot;
+            break;
+        }
+
+        if (!victim || slot->lastseen < victim->lastseen)
+            victim = slot;
+    }
+
+    if (victim->id[0] && strcmp(victim->id, id) && now - victim->lastseen <= _store->ttl)
+        log_debug("evicting shared session %s", victim->id);
+
+    strcpy(victim->id, id);
+    strcpy(victim->userid, userid);
+    victim->lastseen = now;
+
+    pthread_mutex_unlock(&_store->mtx);
+
+    return 1;
+}
+
+const session_backend_t session_backend_shm = {
+    "shm",
+    _shm_open,
+    _shm_close,
+    _shm_lookup,
+    _shm_bind
+};
@@ -216,6 +216,9 @@ soap_client_invoke(SoapCtx * call, SoapCtx ** response, const char *url,
     {
       soap_ctx_add_file(*response, part->filename, part->content_type, href);
       part->deleteOnExit = 0;
+      /* in-memory parts live as long as their descriptor */
+      (*response)->attachments->last->fd = part->fd;
+      part->fd = -1;
       part = part->next;
     }
     part = (*response)->attachments->parts;
@@ -173,6 +173,7 @@ soap_env_new_from_doc(xmlDocPtr doc, SoapEnv ** out)
   env->header = soap_env_get_header(env);
   env->body = soap_env_get_body(env);
   env->cur = soap_env_get_method(env);
+  env->fault = 0;
 
   *out = env;
 
@@ -219,9 +220,12 @@ soap_env_new_with_fault(fault_code_t faultcode,
   if ((err = soap_env_new_from_doc(doc, out)) != H_OK)
   {
     xmlFreeDoc(doc);
+    return err;
   }
 
-  return err;
+  (*out)->fault = 1;
+
+  return H_OK;
 }
 
 
@@ -29,6 +29,51 @@
 
 #include <log.h>
 
+/* FNV-1a over the URN, a separator and the method */
+static unsigned long
+_soap_router_hash(const char *urn, const char *method)
+{
+  unsigned long hash = 2166136261UL;
+
+  for (; *urn; urn++)
+    hash = (hash ^ (unsigned char) *urn) * 16777619UL;
+
+  hash *= 16777619UL;
+
+  for (; *method; method++)
+    hash = (hash ^ (unsigned char) *method) * 16777619UL;
+
+  return hash;
+}
+
+/* appends the service to the list of the router */
+static int
+_soap_router_add_service(SoapRouter * router, SoapService * service)
+{
+  if (router->table)
+  {
+    log_error("cannot register %s:%s to a compiled router", service->urn,
+              service->method);
+    soap_service_free(service);
+    return 0;
+  }
+
+  service->hash = _soap_router_hash(service->urn, service->method);
+
+  if (router->service_tail == NULL)
+  {
+    router->service_head =
+      router->service_tail = soap_service_node_new(service, NULL);
+  }
+  else
+  {
+    router->service_tail->next = soap_service_node_new(service, NULL);
+    router->service_tail = router->service_tail->next;
+  }
+
+  return 1;
+}
+
 SoapRouter *
 soap_router_new(void)
 {
@@ -40,6 +85,7 @@ soap_router_new(void)
     return NULL;
   }
   memset(router, 0, sizeof(SoapRouter));
+  router->priority = HTTPD_PRIORITY_NORMAL;
 
   return router;
 }
@@ -52,17 +98,7 @@ soap_router_register_service(SoapRouter * router,
   SoapService *service;
 
   service = soap_service_new(urn, method, func);
-
-  if (router->service_tail == NULL)
-  {
-    router->service_head =
-      router->service_tail = soap_service_node_new(service, NULL);
-  }
-  else
-  {
-    router->service_tail->next = soap_service_node_new(service, NULL);
-    router->service_tail = router->service_tail->next;
-  }
+  _soap_router_add_service(router, service);
 
   return;
 }
@@ -75,6 +111,14 @@ soap_router_set_tag(SoapRouter * router, const char *tag)
     return;
 }
 
+void
+soap_router_set_priority(SoapRouter * router, httpd_priority priority)
+{
+  router->priority = priority;
+
+  return;
+}
+
 void
 soap_router_register_security(SoapRouter * router, httpd_auth auth)
 {
@@ -101,17 +145,8 @@ soap_router_register_default_service(SoapRouter *router, SoapServiceFunc func, c
 
   service = soap_service_new(urn, method, func);
 
-  if (router->service_tail == NULL)
-  {
-    router->service_head = router->service_tail = soap_service_node_new(service, NULL);
-  }
-  else
-  {
-    router->service_tail->next = soap_service_node_new(service, NULL);
-    router->service_tail = router->service_tail->next;
-  }
-
-  router->default_service = service;
+  if (_soap_router_add_service(router, service))
+    router->default_service = service;
 
   return;
 }
@@ -121,10 +156,27 @@ soap_router_find_service(SoapRouter * router,
                          const char *urn, const char *method)
 {
   SoapServiceNode *node;
+  SoapService *service;
+  unsigned long hash, i;
 
   if (router == NULL || urn == NULL || method == NULL)
     return NULL;
 
+  if (router->table)
+  {
+    hash = _soap_router_hash(urn, method);
+
+    for (i = hash & router->mask; (service = router->table[i]);
+         i = (i + 1) & router->mask)
+    {
+      if (service->hash == hash && !strcmp(service->method, method)
+          && !strcmp(service->urn, urn))
+        return service;
+    }
+
+    return router->default_service;
+  }
+
   node = router->service_head;
 
   while (node)
@@ -145,6 +197,53 @@ soap_router_find_service(SoapRouter * router,
 }
 
 
+int
+soap_router_compile(SoapRouter * router)
+{
+  SoapServiceNode *node;
+  SoapService **table, *service;
+  unsigned long size, i;
+  int count;
+
+  if (router->table)
+    return 1;
+
+  for (count = 0, node = router->service_head; node; node = node->next)
+    count++;
+
+  /* keep the table at most half full */
+  for (size = 8; size < 2UL * count; size <<= 1)
+    ;
+
+  if (!(table = (SoapService **) calloc(size, sizeof(SoapService *))))
+  {
+    log_error("calloc failed (%s)", strerror(errno));
+    return 0;
+  }
+
+  for (node = router->service_head; node; node = node->next)
+  {
+    service = node->service;
+
+    for (i = service->hash & (size - 1); table[i]; i = (i + 1) & (size - 1))
+    {
+      if (table[i]->hash == service->hash
+          && !strcmp(table[i]->method, service->method)
+          && !strcmp(table[i]->urn, service->urn))
+        break;
+    }
+
+    /* the first registration wins, as with the list */
+    if (!table[i])
+      table[i] = service;
+  }
+
+  router->mask = size - 1;
+  router->table = table;
+
+  return 1;
+}
+
 void
 soap_router_free(SoapRouter * router)
 {
@@ -166,6 +265,8 @@ soap_router_free(SoapRouter * router)
   if (router->wsdl)
     xmlFreeDoc(router->wsdl);
 
+  free(router->table);
+
   if (router->tag)
     free(router->tag);
 
@@ -41,35 +41,65 @@ static SoapRouterNode *tail = NULL;
 
 // static SoapRouter *router_find(const char *context);
 
+static int
+_soap_server_write_cb(void *context, const char *buffer, int len)
+{
+  http_output_stream_t *out = (http_output_stream_t *) context;
+  herror_t status;
+
+  if ((status = http_output_stream_write(out, (const byte_t *) buffer, len))
+      != H_OK)
+  {
+    log_error("http_output_stream_write failed (%s)", herror_message(status));
+    herror_release(status);
+    return -1;
+  }
+
+  return len;
+}
+
+static int
+_soap_server_close_cb(void *context)
+{
+  return 0;
+}
+
+/*
+ * Serializes the envelope through an xmlOutputBuffer straight into
+ * the HTTP output stream, so the text is never held as a whole.
+ */
 static void
 _soap_server_send_env(http_output_stream_t * out, SoapEnv * env)
 {
-  xmlBufferPtr buffer;
+  xmlOutputBufferPtr buffer;
+
   if (env == NULL || env->root == NULL)
     return;
 
-  buffer = xmlBufferCreate();
-  xmlNodeDump(buffer, env->root->doc, env->root, 1, 1);
-  http_output_stream_write_string(out,
-                                  (const char *) xmlBufferContent(buffer));
-  xmlBufferFree(buffer);
+  if (!(buffer = xmlOutputBufferCreateIO(_soap_server_write_cb,
+                                         _soap_server_close_cb, out, NULL)))
+  {
+    log_error("xmlOutputBufferCreateIO failed");
+    return;
+  }
+
+  xmlNodeDumpOutput(buffer, env->root->doc, env->root, 1, 1, NULL);
+  xmlOutputBufferClose(buffer);
 
   return;
 }
 
 static void
-_soap_server_send_fault(httpd_conn_t * conn, const char *errmsg)
+_soap_server_send_error(httpd_conn_t * conn, int code, const char *text,
+                        const char *errmsg)
 {
   SoapEnv *envres;
-  hpair_t *header;
   herror_t err;
   char buffer[45];
 
-  header = hpairnode_new(HEADER_CONTENT_TYPE, "text/xml", NULL);
-
-  httpd_set_headers(conn, header);
+  httpd_set_header(conn, HEADER_CONTENT_TYPE, "text/xml");
 
-  if ((err = httpd_send_header(conn, 500, "FAILED")) != H_OK)
+  if ((err = httpd_send_header(conn, code, text)) != H_OK)
   {
     /* WARNING: unhandled exception ! */
     log_error("%s():%s [%d]", herror_func(err), herror_message(err),
@@ -102,15 +132,32 @@ _soap_server_send_fault(httpd_conn_t * conn, const char *errmsg)
   else
   {
     _soap_server_send_env(conn->out, envres);
+    soap_env_free(envres);
   }
 
-  hpairnode_free(header);
+  return;
+}
+
+static void
+_soap_server_send_fault(httpd_conn_t * conn, const char *errmsg)
+{
+  _soap_server_send_error(conn, 500, "FAILED", errmsg);
+
+  return;
+}
+
+/* answers the requests refused by the admission control */
+static void
+_soap_server_shed(httpd_conn_t * conn, hrequest_t * req)
+{
+  _soap_server_send_error(conn, 503, "Service Unavailable",
+                          "Server is too busy, try again later");
 
   return;
 }
 
 static void
-_soap_server_send_ctx(httpd_conn_t * conn, SoapCtx * ctx)
+_soap_server_send_ctx(httpd_conn_t * conn, SoapCtx * ctx, int chunked)
 {
   static int counter = 1;
   xmlBufferPtr buffer;
@@ -123,16 +170,12 @@ _soap_server_send_ctx(httpd_conn_t * conn, SoapCtx * ctx)
   xmlThrDefIndentTreeOutput(1);
 /*  xmlKeepBlanksDefault(0);*/
 
-  buffer = xmlBufferCreate();
-  xmlNodeDump(buffer, ctx->env->root->doc, ctx->env->root, 1, 1);
-
   if (ctx->attachments)
   {
     sprintf(strbuffer, "000128590350940924234%d", counter++);
     httpd_mime_send_header(conn, strbuffer, "", "text/xml", 200, "OK");
     httpd_mime_next(conn, strbuffer, "text/xml", "binary");
-    http_output_stream_write_string(conn->out,
-                                    (const char *) xmlBufferContent(buffer));
+    _soap_server_send_env(conn->out, ctx->env);
     part = ctx->attachments->parts;
     while (part)
     {
@@ -145,17 +188,25 @@ _soap_server_send_ctx(httpd_conn_t * conn, SoapCtx * ctx)
   else
   {
     char buflen[100];
-    xmlXPathContextPtr xpathCtx;
-    xmlXPathObjectPtr xpathObj;
 
-    xpathCtx = xmlXPathNewContext(ctx->env->root->doc);
-    xpathObj = xmlXPathEvalExpression("//Fault", xpathCtx);
+    buffer = NULL;
+    if (chunked)
+    {
+      httpd_set_header(conn, HEADER_TRANSFER_ENCODING,
+                       TRANSFER_ENCODING_CHUNKED);
+    }
+    else
+    {
+      /* HTTP/1.0 clients need the length up front */
+      buffer = xmlBufferCreate();
+      xmlNodeDump(buffer, ctx->env->root->doc, ctx->env->root, 1, 1);
 
-    snprintf(buflen, 100, "%d", xmlBufferLength(buffer));
-    httpd_set_header(conn, HEADER_CONTENT_LENGTH, buflen);
+      snprintf(buflen, 100, "%d", xmlBufferLength(buffer));
+      httpd_set_header(conn, HEADER_CONTENT_LENGTH, buflen);
+    }
     httpd_set_header(conn, HEADER_CONTENT_TYPE, "application/soap+xml; charset=utf-8");
 
-    if ((xpathObj->nodesetval) ? xpathObj->nodesetval->nodeNr : 0)
+    if (ctx->env->fault)
     {
       httpd_send_header(conn, 500, "FAILED");
     }
@@ -164,13 +215,18 @@ _soap_server_send_ctx(httpd_conn_t * conn, SoapCtx * ctx)
       httpd_send_header(conn, 200, "OK");
     }
 
-    http_output_stream_write_string(conn->out,
-                                    (const char *) xmlBufferContent(buffer));
-    xmlXPathFreeObject(xpathObj);
-    xmlXPathFreeContext(xpathCtx);
-
+    if (buffer)
+    {
+      http_output_stream_write_string(conn->out,
+                                      (const char *) xmlBufferContent(buffer));
+      xmlBufferFree(buffer);
+    }
+    else
+    {
+      _soap_server_send_env(conn->out, ctx->env);
+      http_output_stream_flush(conn->out);
+    }
   }
-  xmlBufferFree(buffer);
 
   return;
 }
@@ -251,7 +307,8 @@ soap_server_entry(httpd_conn_t * conn, hrequest_t * req)
   herror_t err;
 
   
-  if (!(router = soap_server_find_router(req->path)))
+  /* the router was attached to the service on registration */
+  if (!(router = (SoapRouter *) conn->service->data))
   {
     _soap_server_send_fault(conn, "Cannot find router");
     return;
@@ -293,7 +350,7 @@ soap_server_entry(httpd_conn_t * conn, hrequest_t * req)
   {
 
     ctx = soap_ctx_new(env);
-    ctx->action = hpairnode_get_ignore_case(req->header, "SoapAction");
+    ctx->action = hrequest_get_header(req, HHEADER_SOAP_ACTION);
     if (ctx->action)
       ctx->action = strdup(ctx->action);
 
@@ -379,7 +436,7 @@ soap_server_entry(httpd_conn_t * conn, hrequest_t * req)
 /*         httpd_send_header(conn, 200, "OK");
            _soap_server_send_env(conn->out, ctxres->env);
 */
-          _soap_server_send_ctx(conn, ctxres);
+          _soap_server_send_ctx(conn, ctxres, req->version == HTTP_1_1);
           /* free envctx */
           soap_ctx_free(ctxres);
         }
@@ -399,11 +456,14 @@ int
 soap_server_register_router(SoapRouter * router, const char *context)
 {
 
-  if (!httpd_register_secure(context, soap_server_entry, router->auth))
+  if (!httpd_register_secure_data(context, soap_server_entry, router->auth,
+                                  router))
   {
     return 0;
   }
 
+  httpd_set_admission(context, router->priority, _soap_server_shed);
+
   if (tail == NULL)
   {
     head = tail = router_node_new(router, context, NULL);
@@ -426,6 +486,15 @@ soap_server_get_routers(void)
 herror_t
 soap_server_run(void)
 {
+  SoapRouterNode *node;
+
+  for (node = head; node; node = node->next)
+  {
+    if (!soap_router_compile(node->router))
+      return herror_new("soap_server_run", GENERAL_INVALID_PARAM,
+                        "Cannot compile router for '%s'", node->context);
+  }
+
   return httpd_run();
 }
 
@@ -23,11 +23,14 @@
 ******************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include <nanohttp/nanohttp-common.h>
 
@@ -116,6 +119,134 @@ herror_release(herror_t err)
 }
 
 
+/* the strictest alignment malloc() guarantees */
+#define HARENA_ALIGN		_Alignof(max_align_t)
+#define HARENA_ROUND(size)	(((size) + HARENA_ALIGN - 1) & ~(HARENA_ALIGN - 1))
+#define HARENA_HEADER_SIZE	HARENA_ROUND(sizeof(harena_block_t))
+
+void
+harena_init(harena_t * arena)
+{
+  arena->blocks = NULL;
+
+  return;
+}
+
+
+void *
+harena_alloc(harena_t * arena, size_t size)
+{
+  harena_block_t *block;
+  size_t bsize;
+  void *ptr;
+
+  /* keep every allocation pointer aligned */
+  size = HARENA_ROUND(size);
+
+  block = arena->blocks;
+  if (!block || block->size - block->used < size)
+  {
+    bsize = HARENA_BLOCK_SIZE;
+    if (size > bsize - HARENA_HEADER_SIZE)
+      bsize = size + HARENA_HEADER_SIZE;
+
+    if (!(block = (harena_block_t *) malloc(bsize)))
+    {
+      log_error("malloc failed (%s)", strerror(errno));
+      return NULL;
+    }
+
+    block->size = bsize;
+    block->used = HARENA_HEADER_SIZE;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  ptr = (char *) block + block->used;
+  block->used += size;
+
+  return ptr;
+}
+
+
+char *
+harena_strdup(harena_t * arena, const char *str)
+{
+  char *result;
+  size_t len;
+
+  len = strlen(str) + 1;
+  if ((result = (char *) harena_alloc(arena, len)))
+    memcpy(result, str, len);
+
+  return result;
+}
+
+
+void
+harena_reset(harena_t * arena)
+{
+  harena_block_t *block, *next, *keep;
+
+  keep = NULL;
+  for (block = arena->blocks; block; block = next)
+  {
+    next = block->next;
+
+    if (!keep || block->size > keep->size)
+    {
+      if (keep)
+        free(keep);
+      keep = block;
+    }
+    else
+      free(block);
+  }
+
+  if (keep)
+  {
+    keep->used = HARENA_HEADER_SIZE;
+    keep->next = NULL;
+  }
+  arena->blocks = keep;
+
+  return;
+}
+
+
+void
+harena_free(harena_t * arena)
+{
+  harena_block_t *block, *next;
+
+  for (block = arena->blocks; block; block = next)
+  {
+    next = block->next;
+    free(block);
+  }
+  arena->blocks = NULL;
+
+  return;
+}
+
+
+hpair_t *
+hpairnode_new_arena(harena_t * arena, const char *key, const char *value,
+                    hpair_t * next)
+{
+  hpair_t *pair;
+
+  if (!(pair = (hpair_t *) harena_alloc(arena, sizeof(hpair_t))))
+    return NULL;
+
+  pair->key = key ? harena_strdup(arena, key) : NULL;
+  pair->value = value ? harena_strdup(arena, value) : NULL;
+  pair->next = next;
+
+  return pair;
+}
+
+
 hpair_t *
 hpairnode_new(const char *key, const char *value, hpair_t * next)
 {
@@ -295,6 +426,53 @@ hpairnode_get_ignore_case(hpair_t * pair, const char *key)
   return NULL;
 }
 
+hheader_id_t
+hheader_classify(const char *key)
+{
+  /* the length leaves at most two names to compare */
+  switch (strlen(key))
+  {
+  case 6:
+    if (strcmpigcase(key, HEADER_EXPECT))
+      return HHEADER_EXPECT;
+    break;
+  case 10:
+    if (strcmpigcase(key, HEADER_CONNECTION))
+      return HHEADER_CONNECTION;
+    if (strcmpigcase(key, HEADER_SOAP_ACTION))
+      return HHEADER_SOAP_ACTION;
+    break;
+  case 12:
+    if (strcmpigcase(key, HEADER_CONTENT_TYPE))
+      return HHEADER_CONTENT_TYPE;
+    break;
+  case 13:
+    if (strcmpigcase(key, HEADER_AUTHORIZATION))
+      return HHEADER_AUTHORIZATION;
+    if (strcmpigcase(key, HEADER_X_TFS_SESSION))
+      return HHEADER_X_TFS_SESSION;
+    break;
+  case 14:
+    if (strcmpigcase(key, HEADER_CONTENT_LENGTH))
+      return HHEADER_CONTENT_LENGTH;
+    break;
+  case 15:
+    if (strcmpigcase(key, HEADER_ACCEPT_ENCODING))
+      return HHEADER_ACCEPT_ENCODING;
+    break;
+  case 16:
+    if (strcmpigcase(key, HEADER_CONTENT_ENCODING))
+      return HHEADER_CONTENT_ENCODING;
+    break;
+  case 17:
+    if (strcmpigcase(key, HEADER_TRANSFER_ENCODING))
+      return HHEADER_TRANSFER_ENCODING;
+    break;
+  }
+
+  return HHEADER_UNKNOWN;
+}
+
 char *
 hpairnode_get(hpair_t * pair, const char *key)
 {
@@ -457,8 +635,8 @@ hurl_parse(hurl_t * url, const char *urlstr)
 
 /* Content-type stuff */
 
-content_type_t *
-content_type_new(const char *content_type_str)
+static content_type_t *
+_content_type_parse(harena_t * arena, const char *content_type_str)
 {
   hpair_t *pair = NULL, *last = NULL;
   content_type_t *ct;
@@ -469,7 +647,13 @@ content_type_new(const char *content_type_str)
 
 
   /* Create object */
-  ct = (content_type_t *) malloc(sizeof(content_type_t));
+  if (arena)
+    ct = (content_type_t *) harena_alloc(arena, sizeof(content_type_t));
+  else
+    ct = (content_type_t *) malloc(sizeof(content_type_t));
+
+  if (!ct)
+    return NULL;
   ct->params = NULL;
 
   len = strlen(content_type_str);
@@ -518,7 +702,10 @@ content_type_new(const char *content_type_str)
       {
         value[c] = '\0';
 
-        pair = hpairnode_new(key, value, NULL);
+        if (arena)
+          pair = hpairnode_new_arena(arena, key, value, NULL);
+        else
+          pair = hpairnode_new(key, value, NULL);
         if (ct->params == NULL)
           ct->params = pair;
         else
@@ -543,6 +730,20 @@ content_type_new(const char *content_type_str)
 }
 
 
+content_type_t *
+content_type_new(const char *content_type_str)
+{
+  return _content_type_parse(NULL, content_type_str);
+}
+
+
+content_type_t *
+content_type_new_arena(harena_t * arena, const char *content_type_str)
+{
+  return _content_type_parse(arena, content_type_str);
+}
+
+
 void
 content_type_free(content_type_t * ct)
 {
@@ -563,6 +764,7 @@ part_new(const char *id, const char *filename,
   part->header = NULL;
   part->next = next;
   part->deleteOnExit = 0;
+  part->fd = -1;
   strcpy(part->id, id);
   strcpy(part->filename, filename);
   if (content_type)
@@ -601,6 +803,9 @@ part_free(part_t * part)
     remove(part->filename);
   }
 
+  if (part->fd != -1)
+    close(part->fd);
+
   hpairnode_free_deep(part->header);
 
   free(part);
@@ -26,12 +26,24 @@
 * Email: ferhatayaz@yahoo.com
 ******************************************************************/
 
+
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-/*----------------------------------------------------------------
-Buffered Reader. A helper object to read bytes from a source
-----------------------------------------------------------------*/
+#ifdef LINUX
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
 
 #include <nanohttp/nanohttp-mime.h>
 #include <log.h>
@@ -40,841 +52,387 @@ Buffered Reader. A helper object to read bytes from a source
 /* ------------------------------------------------------------------
   MIME Parser
  ------------------------------------------------------------------*/
-typedef void (*MIME_part_begin) (void *);
-typedef void (*MIME_part_end) (void *);
-typedef void (*MIME_parse_begin) (void *);
-typedef void (*MIME_parse_end) (void *);
-typedef void (*MIME_ERROR_bytes) (void *, const unsigned char *, int);
 
-typedef enum _MIME_parser_status
-{
-  MIME_PARSER_INCOMPLETE_MESSAGE,
-  MIME_PARSER_READ_ERROR,
-  MIME_PARSER_OK
-} MIME_parser_status;
-
-typedef enum _MIME_read_status
-{
-  MIME_READ_OK,
-  MIME_READ_EOF,
-  MIME_READ_ERROR
-} MIME_read_status;
+/* read buffer, large enough to hold a part header and a delimiter */
+#define MIME_BUFFER_SIZE	65536
 
-#define MIME_READER_MAX_BUFFER_SIZE  1054
-#define MIME_PARSER_BUFFER_SIZE 1054
+/* longest part header accepted */
+#define MIME_MAX_HEADER_SIZE	4064
 
+/* longest boundary RFC 2046 allows */
+#define MIME_MAX_BOUNDARY	70
 
-typedef MIME_read_status(*MIME_read_function) (void *, unsigned char *,
-                                               int *);
+static size_t _mime_spill_size = MIME_SPILL_SIZE;
+static int _mime_max_parts = MIME_MAX_PARTS;
+static char _mime_spool_dir[200] = MIME_SPOOL_DIR;
 
 
-/**
-  Reader structure. This will be use 
-  by the parser
-*/
-typedef struct _MIME_reader
+typedef struct _mime_parser
 {
-  int size;
-  int marker;
-  int current;
-  MIME_read_function read_function;
-  char buffer[MIME_READER_MAX_BUFFER_SIZE];
-  void *userdata;
-} MIME_reader;
-
-
-MIME_read_status MIME_filereader_function(void *userdata,
-                                          unsigned char *dest, int *size);
-
-typedef struct _MIME_callbacks
-{
-  MIME_part_begin part_begin_cb;
-  MIME_part_end part_end_cb;
-  MIME_parse_begin parse_begin_cb;
-  MIME_parse_end parse_end_cb;
-  MIME_ERROR_bytes received_bytes_cb;
-} MIME_callbacks;
-
-
-MIME_parser_status MIME_parse(MIME_read_function reader_function,
-                              void *reader_userdata,
-                              const char *user_boundary,
-                              const MIME_callbacks * callbacks,
-                              void *callbacks_userdata);
+  http_input_stream_t *in;
+  byte_t *buf;
+  int len;                      /* bytes in the buffer */
+  int pos;                      /* first byte not consumed */
+  char delim[MIME_MAX_BOUNDARY + 5];    /* CRLF "--" boundary */
+  int dlen;
+  const char *root_id;
+  attachments_t *message;
+  part_t *part;                 /* part being received */
+  size_t size;                  /* bytes stored for it */
+  size_t held;                  /* bytes of all parts held in memory */
+  int parts;
+} mime_parser_t;
 
 
-/**
-  Initialize a reader
-*/
 void
-MIME_reader_init(MIME_reader * reader,
-                 MIME_read_function reader_function, void *userdata)
+mime_set_spill_size(size_t size)
 {
-  reader->size = 0;
-  reader->marker = -1;
-  reader->current = 0;
-  reader->userdata = userdata;
-  reader->read_function = reader_function;
-
-}
-
-/**
-  Read data from a reader source. 
-*/
-MIME_read_status
-MIME_reader_read(MIME_reader * reader, unsigned char *buffer, int size)
-{
-  MIME_read_status status;
-  int readed_size;
-  unsigned char tempBuffer[MIME_READER_MAX_BUFFER_SIZE];
-  int rest_size;
-
-  /* Check if buffer is full */
-  if (reader->size == reader->current)
-  {
-    /* Yes, so read some data */
-
-    /* First handle marker */
-    if (reader->marker > -1)
-    {
-      if (reader->marker != 0)
-      {
-        memcpy(tempBuffer, reader->buffer + reader->marker,
-               reader->size - reader->marker);
-        memcpy(reader->buffer, tempBuffer, reader->size - reader->marker);
-        reader->current = reader->size - reader->marker;
-      }
-      else if (reader->current == MIME_READER_MAX_BUFFER_SIZE - 1)
-      {
-        fprintf(stderr, "Marker error");
-        return MIME_READ_ERROR;
-      }
-      reader->marker = 0;
-    }
-    else
-      reader->current = 0;
-
-    readed_size = MIME_READER_MAX_BUFFER_SIZE - reader->current - 1;
-    status = reader->read_function(reader->userdata,
-                                   reader->buffer + reader->current,
-                                   &readed_size);
-
-    if (status == MIME_READ_OK)
-    {
-      reader->size = readed_size + reader->current;
-    }
-    else
-      return status;
-  }
-
-  if (size <= reader->size - reader->current)
-  {
-    memcpy(buffer, reader->buffer + reader->current, size);
-    reader->current += size;
-    return MIME_READ_OK;
-  }
-  else
-  {
-    /* Fill rest data */
-    rest_size = reader->size - reader->current;
-    memcpy(buffer, reader->buffer + reader->current, rest_size);
-
-    reader->current = reader->size;
-    return MIME_reader_read(reader, buffer + rest_size, size - rest_size);
-  }
+  _mime_spill_size = size;
 }
 
 
 void
-MIME_reader_set_marker(MIME_reader * reader)
+mime_set_max_parts(int parts)
 {
-  reader->marker = reader->current;
+  _mime_max_parts = parts;
 }
 
-void
-MIME_reader_unset_marker(MIME_reader * reader)
-{
-  reader->marker = -1;
-}
 
 void
-MIME_reader_jump_marker(MIME_reader * reader)
+mime_set_spool_dir(const char *dir)
 {
-  reader->current = reader->marker;
+  snprintf(_mime_spool_dir, sizeof(_mime_spool_dir), "%s", dir);
 }
 
 
-
-typedef struct _MIME_buffer
-{
-  unsigned char data[MIME_PARSER_BUFFER_SIZE];
-  int size;
-} MIME_buffer;
-
-
-void
-MIME_buffer_init(MIME_buffer * buffer)
+/*
+  Moves what was not consumed to the front of the buffer and reads
+  more. Returns the number of bytes read, 0 at the end of the
+  stream and -1 on errors.
+*/
+static int
+_mime_fill(mime_parser_t * p)
 {
-  buffer->size = 0;
-}
+  int count;
 
-void
-MIME_buffer_add(MIME_buffer * buffer, unsigned char ch)
-{
-  buffer->data[buffer->size++] = ch;
-}
+  if (p->pos > 0)
+  {
+    memmove(p->buf, p->buf + p->pos, p->len - p->pos);
+    p->len -= p->pos;
+    p->pos = 0;
+  }
 
-void
-MIME_buffer_add_bytes(MIME_buffer * buffer, unsigned char *bytes, int size)
-{
-  memcpy(buffer->data, bytes, size);
-  buffer->size += size;
-}
+  if (p->len == MIME_BUFFER_SIZE || !http_input_stream_is_ready(p->in))
+    return 0;
 
-int
-MIME_buffer_is_full(MIME_buffer * buffer)
-{
-  return buffer->size + 150 >= MIME_PARSER_BUFFER_SIZE;
-}
+  if ((count = http_input_stream_read(p->in, p->buf + p->len,
+                                      MIME_BUFFER_SIZE - p->len)) < 0)
+  {
+    log_error("[%d] %s():%s ", herror_code(p->in->err),
+              herror_func(p->in->err), herror_message(p->in->err));
+    return -1;
+  }
 
-int
-MIME_buffer_is_empty(MIME_buffer * buffer)
-{
-  return buffer->size == 0;
-}
+  p->len += count;
 
-void
-MIME_buffer_clear(MIME_buffer * buffer)
-{
-  buffer->size = 0;
+  return count;
 }
 
 
-MIME_parser_status
-MIME_parse(MIME_read_function reader_function,
-           void *reader_userdata,
-           const char *user_boundary,
-           const MIME_callbacks * callbacks, void *callbacks_userdata)
+/*
+  Finds 'pattern' in the unconsumed bytes, reading until it shows
+  up within the first 'limit' bytes. Returns its offset from the
+  consumed position or -1.
+*/
+static int
+_mime_find(mime_parser_t * p, const char *pattern, int plen, int limit)
 {
-  char boundary[150];
-  unsigned char ch[153];
-  int boundary_length, n, ignore = 0;
-  MIME_reader reader;
-  MIME_buffer buffer;
-  MIME_read_status status;
-
-  /* Init reader */
-  MIME_reader_init(&reader, reader_function, reader_userdata);
-
-  /* Init buffer */
-  MIME_buffer_init(&buffer);
-
-  /* Set boundary related stuff */
-  sprintf(boundary, "\n--%s", user_boundary);
-  boundary_length = strlen(boundary);
-
-  /* Call parse begin callback */
-  callbacks->parse_begin_cb(callbacks_userdata);
+  byte_t *hit;
 
   while (1)
   {
-  set_marker:
-
-    /* Set marker */
-    MIME_reader_set_marker(&reader);
-
-  read_byte:
-
-    /* Read 1 byte */
-    status = MIME_reader_read(&reader, ch, 1);
-    if (status == MIME_READ_EOF)
-      return MIME_PARSER_INCOMPLETE_MESSAGE;
-    else if (status == MIME_READ_ERROR)
-      return MIME_PARSER_READ_ERROR;
-
-    if (ch[0] == '\r' && !ignore)
-    {
-      n = 0;
-      while (n < boundary_length)
-      {
-        /* Read 1 byte */
-        status = MIME_reader_read(&reader, ch, 1);
-        if (status == MIME_READ_EOF)
-          return MIME_PARSER_INCOMPLETE_MESSAGE;
-        else if (status == MIME_READ_ERROR)
-          return MIME_PARSER_READ_ERROR;
-
-        /* Check if byte is in boundary */
-        if (ch[0] == boundary[n])
-        {
-          n = n + 1;
-          continue;
-        }
-        else
-        {
-          MIME_reader_jump_marker(&reader);
-          ignore = 1;
-          goto read_byte;
-        }
-
-      }                         /* while n < boundary_length */
-
-      /* Read 1 byte */
-      status = MIME_reader_read(&reader, ch, 1);
-
-
-      if (status == MIME_READ_EOF)
-        return MIME_PARSER_INCOMPLETE_MESSAGE;
-      else if (status == MIME_READ_ERROR)
-        return MIME_PARSER_READ_ERROR;
-
-      /* Show if byte is '\r' */
-      if (ch[0] == '\r')
-      {
-        /* Read 1 byte */
-        status = MIME_reader_read(&reader, ch, 1);
+    if ((hit = memmem(p->buf + p->pos, p->len - p->pos, pattern, plen)))
+      return hit - (p->buf + p->pos);
 
+    if (p->len - p->pos >= limit || _mime_fill(p) <= 0)
+      return -1;
+  }
+}
 
-        if (status == MIME_READ_EOF)
-          return MIME_PARSER_INCOMPLETE_MESSAGE;
-        else if (status == MIME_READ_ERROR)
-          return MIME_PARSER_READ_ERROR;
 
-        /* Check if byte is '\n' */
-        if (ch[0] == '\n')
-        {
-          if (!MIME_buffer_is_empty(&buffer))
-          {
-            /* Invoke callback */
-            callbacks->received_bytes_cb(callbacks_userdata, buffer.data,
-                                         buffer.size);
+/*
+  Stores received parts in a memfd until the message grows past the
+  spill size, then in a file of the spool directory. The part's file
+  name refers to either, so it can be opened like any attachment.
+*/
+static int
+_mime_part_spill(mime_parser_t * p)
+{
+  char path[sizeof(p->part->filename)];
+  off_t offset = 0;
+  int fd;
 
-            /* Empty the buffer */
-            MIME_buffer_clear(&buffer);
+  snprintf(path, sizeof(path), "%s/mime_XXXXXX", _mime_spool_dir);
 
-            /* Invoke End Part */
-            callbacks->part_end_cb(callbacks_userdata);
-          }
+  if ((fd = mkstemp(path)) == -1)
+  {
+    log_error("Can not create spool file '%s' (%s)", path, strerror(errno));
+    return -1;
+  }
 
-          /* Invoke start new Part */
-          callbacks->part_begin_cb(callbacks_userdata);
-          goto set_marker;
+#ifdef LINUX
+  while (offset < (off_t) p->size)
+  {
+    if (sendfile(fd, p->part->fd, &offset, p->size - offset) <= 0)
+    {
+      log_error("Can not spill part to '%s' (%s)", path, strerror(errno));
+      close(fd);
+      remove(path);
+      return -1;
+    }
+  }
+#endif
 
-        }                       /* if (ch[0] == '\n') */
-        else
-        {
-          /* Jump to marker and read bytes */
-          MIME_reader_jump_marker(&reader);
-          MIME_reader_read(&reader, ch, boundary_length + 2);
+  if (p->part->fd != -1)
+  {
+    close(p->part->fd);
+    p->held -= p->size;
+  }
 
-          MIME_buffer_add_bytes(&buffer, ch, boundary_length + 2);
+  p->part->fd = fd;
+  p->part->deleteOnExit = 1;
+  strcpy(p->part->filename, path);
 
-          if (MIME_buffer_is_full(&buffer))
-          {
-            /* Invoke callback */
-            callbacks->received_bytes_cb(callbacks_userdata, buffer.data,
-                                         buffer.size);
+  return 0;
+}
 
 
-            /* Empty the buffer */
-            MIME_buffer_clear(&buffer);
-          }
-        }                       /* else of if (ch[0] == '\n') */
+static int
+_mime_part_open(mime_parser_t * p)
+{
+  p->size = 0;
 
-      }                         /* if (ch[0] == '\r') */
-      else
-      {
-        if (ch[0] == '-')
-        {
-          /* Read 1 byte */
-          status = MIME_reader_read(&reader, ch, 1);
-
-          if (status == MIME_READ_EOF)
-            return MIME_PARSER_INCOMPLETE_MESSAGE;
-          else if (status == MIME_READ_ERROR)
-            return MIME_PARSER_READ_ERROR;
-
-          if (ch[0] == '-')
-          {
-            if (!MIME_buffer_is_empty(&buffer))
-            {
-              /* Invoke callback */
-              callbacks->received_bytes_cb(callbacks_userdata, buffer.data,
-                                           buffer.size);
-
-              /* Empty the buffer */
-              MIME_buffer_clear(&buffer);
-
-              /* Invoke End Part */
-              callbacks->part_end_cb(callbacks_userdata);
-            }
-
-            /* Invoke start new Part */
-            callbacks->parse_end_cb(callbacks_userdata);
-
-            /* Finish parsing */
-            /* TODO (#1#): We assume that after -- comes \r\n This is not
-               always correct */
-
-            return MIME_PARSER_OK;
-
-          }                     /* if (ch[0] == '-') */
-          else
-          {
-            MIME_reader_jump_marker(&reader);
-            ignore = 1;
-            goto read_byte;
-          }                     /* else of if (ch[0] == '-') */
-
-        }                       /* if (ch[0] == '-') */
-        else
-        {
-          MIME_reader_jump_marker(&reader);
-          ignore = 1;
-          goto read_byte;
-        }                       /* else of if (ch[0] == '-') */
-
-      }                         /* else of if (ch[0] == '\r') */
-
-    }                           /* if ch[0] == '\r' && !ignore */
-    else
-    {
-      ignore = 0;
-      MIME_buffer_add(&buffer, ch[0]);
+#ifdef LINUX
+  if (p->held < _mime_spill_size &&
+      (p->part->fd = memfd_create("mime-part", MFD_CLOEXEC)) != -1)
+  {
+    sprintf(p->part->filename, "/proc/self/fd/%d", p->part->fd);
+    return 0;
+  }
 
-      /* Chec if buffer is full */
-      if (MIME_buffer_is_full(&buffer))
-      {
-        /* Invoke callback */
-        callbacks->received_bytes_cb(callbacks_userdata, buffer.data,
-                                     buffer.size);
+  if (p->held < _mime_spill_size)
+    log_warn("memfd_create failed (%s)", strerror(errno));
+#endif
 
-        /* Empty the buffer */
-        MIME_buffer_clear(&buffer);
-      }
-    }                           /* else of if ch[0] == '\r' && !ignore */
-  }                             /* while (1) */
+  return _mime_part_spill(p);
 }
 
 
+static int
+_mime_part_write(mime_parser_t * p, const byte_t * bytes, int size)
+{
+  ssize_t count;
 
+  if (!p->part->deleteOnExit && p->held + size > _mime_spill_size &&
+      _mime_part_spill(p) == -1)
+    return -1;
 
-MIME_read_status
-MIME_filereader_function(void *userdata, unsigned char *dest, int *size)
-{
-  FILE *f = (FILE *) userdata;
+  while (size > 0)
+  {
+    if ((count = write(p->part->fd, bytes, size)) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      log_error("Can not write part '%s' (%s)", p->part->filename,
+                strerror(errno));
+      return -1;
+    }
 
-  if (feof(f))
-    return MIME_READ_EOF;
+    bytes += count;
+    size -= count;
+    p->size += count;
+    if (!p->part->deleteOnExit)
+      p->held += count;
+  }
 
-  *size = fread(dest, 1, *size, f);
-  return MIME_READ_OK;
+  return 0;
 }
 
 
-/* ------------------------------------------------------------------
-  "multipart/related"  MIME Message Builder
- ------------------------------------------------------------------*/
-
 /*
-  Callback data to use internally
+  Splits "key: value" lines, 'buffer' is modified
 */
-typedef struct _mime_callback_data
+static hpair_t *
+_mime_process_header(char *buffer)
 {
-  int part_id;
-  attachments_t *message;
-  part_t *current_part;
-  int buffer_capacity;
-  char header[4064];
-  char root_id[256];
-  int header_index;
-  int header_search;
-  FILE *current_fd;
-  char root_dir[512];
-} mime_callback_data_t;
+  hpair_t *first = NULL, *last = NULL, *pair;
+  char *line, *end, *value;
 
+  for (line = buffer; (end = strstr(line, "\r\n")); line = end + 2)
+  {
+    *end = '\0';
 
+    if (!(value = strchr(line, ':')))
+      continue;
 
-MIME_read_status
-mime_streamreader_function(void *userdata, unsigned char *dest, int *size)
-{
-  int readed = 0;
-  http_input_stream_t *in = (http_input_stream_t *) userdata;
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t')
+      value++;
 
-  if (!http_input_stream_is_ready(in))
-    return MIME_READ_EOF;
-
-  readed = http_input_stream_read(in, dest, *size);
-  /* 
-     log_info("http_input_stream_read() returned 0"); */
-  if (readed == -1)
-  {
-    log_error("[%d] %s():%s ", herror_code(in->err), herror_func(in->err),
-               herror_message(in->err));
+    pair = hpairnode_new(line, value, NULL);
+    if (last)
+      last->next = pair;
+    else
+      first = pair;
+    last = pair;
   }
 
-  *size = readed;
-  if (*size != -1)
-  {
-    return MIME_READ_OK;
-  }
-  return MIME_READ_ERROR;
+  return first;
 }
 
 
 /*
-  Start Callback functions
+  Reads the header of the next part and opens its storage
 */
-static void
-_mime_parse_begin(void *data)
+static int
+_mime_part_begin(mime_parser_t * p)
 {
-/* Nothing to do
-  mime_callback_data_t *cbdata = (mime_callback_data_t)data;
- */
-  log_debug("Begin parse (%p)", data);
-}
-
-
-static void
-_mime_parse_end(void *data)
-{
-/* Nothing to do
-  mime_callback_data_t *cbdata = (mime_callback_data_t)data;
- */
-  log_debug("End parse (%p)", data);
-}
-
-
-static void
-_mime_part_begin(void *data)
-{
-  char buffer[1054];
-  mime_callback_data_t *cbdata = (mime_callback_data_t *) data;
+  char header[MIME_MAX_HEADER_SIZE + 3];
   part_t *part;
+  char *value;
+  int hlen;
 
-  log_debug("Begin Part (%p)", data);
-  part = (part_t *) malloc(sizeof(part_t));
-  part->next = NULL;
-
-
-  if (cbdata->current_part)
-    cbdata->current_part->next = part;
-
-  cbdata->current_part = part;
+  if (++p->parts > _mime_max_parts)
+  {
+    log_error("MIME message has more than %d parts", _mime_max_parts);
+    return -1;
+  }
 
-  if (!cbdata->message->parts)
-    cbdata->message->parts = part;
+  while (p->len - p->pos < 2)
+  {
+    if (_mime_fill(p) <= 0)
+      return -1;
+  }
 
-  cbdata->header[0] = '\0';
-  cbdata->header_index = 0;
-  cbdata->header_search = 0;
+  /* the header ends with an empty line, which may be the first one */
+  if (!memcmp(p->buf + p->pos, "\r\n", 2))
+  {
+    header[0] = '\0';
+    p->pos += 2;
+  }
+  else
+  {
+    hlen = _mime_find(p, "\r\n\r\n", 4, MIME_MAX_HEADER_SIZE);
+    if (hlen == -1 || hlen > MIME_MAX_HEADER_SIZE)
+    {
+      log_error("MIME part header too long or incomplete");
+      return -1;
+    }
 
-#ifdef WIN32
-  sprintf(buffer, "%s\\mime_%p_%d.part", cbdata->root_dir,
-          cbdata, cbdata->part_id++);
-#else
-  sprintf(buffer, "%s/mime_%p_%d.part", cbdata->root_dir,
-          cbdata, cbdata->part_id++);
-#endif
+    memcpy(header, p->buf + p->pos, hlen);
+    strcpy(header + hlen, "\r\n");
+    p->pos += hlen + 4;
+  }
 
-/*  log_info("Creating FILE ('%s') deleteOnExit=1", buffer);*/
-  part->deleteOnExit = 1;
-  cbdata->current_fd = fopen(buffer, "wb");
-  if (cbdata->current_fd)
-    strcpy(cbdata->current_part->filename, buffer);
-  else
-    log_error("Can not open file for write '%s'", buffer);
-}
+  if (!(part = (part_t *) calloc(1, sizeof(part_t))))
+  {
+    log_error("calloc failed (%s)", strerror(errno));
+    return -1;
+  }
 
+  part->fd = -1;
+  part->header = _mime_process_header(header);
+  attachments_add_part(p->message, part);
+  p->part = part;
 
-static void
-_mime_part_end(void *data)
-{
-  mime_callback_data_t *cbdata = (mime_callback_data_t *) data;
-  log_debug("End Part (%p)", data);
-  if (cbdata->current_fd)
+  if ((value = hpairnode_get_ignore_case(part->header, HEADER_CONTENT_ID)))
   {
-    fclose(cbdata->current_fd);
-    cbdata->current_fd = NULL;
+    snprintf(part->id, sizeof(part->id), "%s", value);
+    if (!strcmp(part->id, p->root_id))
+      p->message->root_part = part;
   }
-}
 
+  if ((value = hpairnode_get_ignore_case(part->header,
+                                         HEADER_CONTENT_LOCATION)))
+    snprintf(part->location, sizeof(part->location), "%s", value);
 
-static hpair_t *
-_mime_process_header(char *buffer)
-{
-  int i = 0, c = 0, proc_key, begin = 0;
-  hpair_t *first = NULL, *last = NULL;
-  char key[1054], value[1054];
+  if ((value = hpairnode_get_ignore_case(part->header, HEADER_CONTENT_TYPE)))
+    snprintf(part->content_type, sizeof(part->content_type), "%s", value);
 
-  key[0] = '\0';
-  value[0] = '\0';
-  proc_key = 1;
+  value = hpairnode_get_ignore_case(part->header,
+                                    HEADER_CONTENT_TRANSFER_ENCODING);
+  snprintf(part->transfer_encoding, sizeof(part->transfer_encoding), "%s",
+           value ? value : "binary");
 
-  while (buffer[i] != '\0')
-  {
-    if (buffer[i] == '\r' && buffer[i + 1] == '\n')
-    {
-      value[c] = '\0';
-      if (last)
-      {
-        last->next = hpairnode_new(key, value, NULL);
-        last = last->next;
-      }
-      else
-      {
-        first = last = hpairnode_new(key, value, NULL);
-      }
-      proc_key = 1;
-      c = 0;
-      i++;
-    }
-    else if (buffer[i] == ':')
-    {
-      key[c] = '\0';
-      c = 0;
-      begin = 0;
-      proc_key = 0;
-    }
-    else
-    {
-      if (proc_key)
-        key[c++] = buffer[i];
-      else
-      {
-        if (buffer[i] != ' ')
-          begin = 1;
-        if (begin)
-          value[c++] = buffer[i];
-      }
-    }
-    i++;
-  }
-  return first;
+  return _mime_part_open(p);
 }
 
 
-static void
-_mime_received_bytes(void *data, const unsigned char *bytes, int size)
+/*
+  Reads the message part by part. Bytes are copied to the current
+  part up to the next delimiter, except for a tail which could be
+  the start of one.
+*/
+static herror_t
+_mime_parse(mime_parser_t * p)
 {
-  int i = 0;
-  char *id, *type, *location;
-  mime_callback_data_t *cbdata = (mime_callback_data_t *) data;
+  int hit, safe, count;
 
-  if (!cbdata)
-  {
-    log_error
-      ("MIME transport error Called <received bytes> without initializing\n");
-    return;
-  }
-  if (!cbdata->current_part)
-  {
-    log_error
-      ("MIME transport error Called <received bytes> without initializing\n");
-    return;
-  }
-/*  log_debug("Received %d bytes (%p), header_search = %d", 
-    size, data, cbdata->header_search);
-*/
-  if (cbdata->header_search < 4)
+  while (1)
   {
-    /* Find \r\n\r\n in bytes */
-    for (i = 0; i < size; i++)
-    {
-      if (cbdata->header_search == 0)
-      {
-        if (bytes[i] == '\r')
-          cbdata->header_search++;
-        else
-        {
-          cbdata->header[cbdata->header_index++] = bytes[i];
-          cbdata->header_search = 0;
-        }
-      }
+    hit = _mime_find(p, p->delim, p->dlen, 0);
 
-      else if (cbdata->header_search == 1)
-      {
-        if (bytes[i] == '\n')
-          cbdata->header_search++;
-        else
-        {
-          cbdata->header[cbdata->header_index++] = '\r';
-          cbdata->header[cbdata->header_index++] = bytes[i];
-          cbdata->header_search = 0;
-        }
-      }
-
-      else if (cbdata->header_search == 2)
+    if (hit == -1)
+    {
+      safe = p->len - p->pos - (p->dlen - 1);
+      if (safe > 0)
       {
-        if (bytes[i] == '\r')
-          cbdata->header_search++;
-        else
-        {
-          cbdata->header[cbdata->header_index++] = '\r';
-          cbdata->header[cbdata->header_index++] = '\n';
-          cbdata->header[cbdata->header_index++] = bytes[i];
-          cbdata->header_search = 0;
-        }
+        /* the preamble is dropped */
+        if (p->part && _mime_part_write(p, p->buf + p->pos, safe) == -1)
+          return herror_new("mime_get_attachments", MIME_ERROR_PARSE_ERROR,
+                            "Can not store MIME part");
+        p->pos += safe;
       }
 
-      else if (cbdata->header_search == 3)
-      {
-        if (bytes[i] == '\n')
-        {
-          cbdata->header[cbdata->header_index++] = '\r';
-          cbdata->header[cbdata->header_index++] = '\n';
-          cbdata->header[cbdata->header_index++] = '\0';
-          cbdata->header_search = 4;
-          cbdata->current_part->header = _mime_process_header(cbdata->header);
-          hpairnode_dump_deep(cbdata->current_part->header);
-          /* set id */
-          id = hpairnode_get(cbdata->current_part->header, HEADER_CONTENT_ID);
-          if (id != NULL)
-          {
-            strcpy(cbdata->current_part->id, id);
-            if (!strcmp(id, cbdata->root_id))
-              cbdata->message->root_part = cbdata->current_part;
-          }
-          location =
-            hpairnode_get(cbdata->current_part->header,
-                          HEADER_CONTENT_LOCATION);
-          if (location != NULL)
-          {
-            strcpy(cbdata->current_part->location, location);
-          }
-          type =
-            hpairnode_get(cbdata->current_part->header, HEADER_CONTENT_TYPE);
-          if (type != NULL)
-          {
-            strcpy(cbdata->current_part->content_type, type);
-          }
-          i++;
-          break;
-        }
-        else
-        {
-          cbdata->header[cbdata->header_index++] = '\r';
-          cbdata->header[cbdata->header_index++] = '\n';
-          cbdata->header[cbdata->header_index++] = '\r';
-          cbdata->header[cbdata->header_index++] = bytes[i];
-          cbdata->header_search = 0;
-        }
-      }
-      /* TODO (#1#): Check for cbdata->header overflow */
+      if ((count = _mime_fill(p)) <= 0)
+        return herror_new("mime_get_attachments", MIME_ERROR_PARSE_ERROR,
+                          count ? "Read error" : "Incomplete message");
+      continue;
+    }
 
-    }                           /* for (i=0;i<size;i++) */
-  }                             /* if (cbdata->header_search < 4) */
+    if (p->part && _mime_part_write(p, p->buf + p->pos, hit) == -1)
+      return herror_new("mime_get_attachments", MIME_ERROR_PARSE_ERROR,
+                        "Can not store MIME part");
 
-  if (i >= size - 1)
-    return;
+    p->pos += hit + p->dlen;
+    p->part = NULL;
 
-  /* Write remaining bytes into the file or buffer (if root) (buffer is
-     disabled in this version) */
-  if (cbdata->current_fd)
-    fwrite(&(bytes[i]), 1, size - i, cbdata->current_fd);
-}
+    /* "--" closes the message, anything else is padding up to the LF */
+    while (p->len - p->pos < 2)
+    {
+      if (_mime_fill(p) <= 0)
+        return herror_new("mime_get_attachments", MIME_ERROR_PARSE_ERROR,
+                          "Incomplete message");
+    }
 
+    if (p->buf[p->pos] == '-' && p->buf[p->pos + 1] == '-')
+      return H_OK;
 
-/*
-  The mime message parser
-*/
+    if ((hit = _mime_find(p, "\n", 1, MIME_MAX_HEADER_SIZE)) == -1)
+      return herror_new("mime_get_attachments", MIME_ERROR_PARSE_ERROR,
+                        "Incomplete message");
+    p->pos += hit + 1;
 
-attachments_t *
-mime_message_parse(http_input_stream_t * in, const char *root_id,
-                   const char *boundary, const char *dest_dir)
-{
-  MIME_parser_status status;
-  MIME_callbacks callbacks;
-  attachments_t *message;
-
-  mime_callback_data_t *cbdata = (mime_callback_data_t *)
-    malloc(sizeof(mime_callback_data_t));
-
-  cbdata->part_id = 100;
-  cbdata->buffer_capacity = 0;
-  cbdata->current_fd = NULL;
-  cbdata->current_part = NULL;
-  cbdata->header_index = 0;
-  cbdata->header_search = 0;
-  strcpy(cbdata->root_id, root_id);
-  strcpy(cbdata->root_dir, dest_dir);
-  message = (attachments_t *) malloc(sizeof(attachments_t));
-  cbdata->message = message;
-  cbdata->message->parts = NULL;
-  cbdata->message->root_part = NULL;
-
-  callbacks.parse_begin_cb = _mime_parse_begin;
-  callbacks.parse_end_cb = _mime_parse_end;
-  callbacks.part_begin_cb = _mime_part_begin;
-  callbacks.part_end_cb = _mime_part_end;
-  callbacks.received_bytes_cb = _mime_received_bytes;
-
-  status = MIME_parse(mime_streamreader_function,
-                      in, boundary, &callbacks, cbdata);
-
-  if (status == MIME_PARSER_OK)
-  {
-    free(cbdata);
-    return message;
-  }
-  else
-  {
-    log_error("MIME parser error '%s'!",
-               status ==
-               MIME_PARSER_READ_ERROR ? "read error" : "Incomplete message");
-    return NULL;
+    if (_mime_part_begin(p) == -1)
+      return herror_new("mime_get_attachments", MIME_ERROR_PARSE_ERROR,
+                        "Can not read MIME part");
   }
 }
 
-attachments_t *
-mime_message_parse_from_file(FILE * in, const char *root_id,
-                             const char *boundary, const char *dest_dir)
-{
-  MIME_parser_status status;
-  MIME_callbacks callbacks;
-  attachments_t *message;
-
-  mime_callback_data_t *cbdata = (mime_callback_data_t *)
-    malloc(sizeof(mime_callback_data_t));
-
-  cbdata->part_id = 100;
-  cbdata->buffer_capacity = 0;
-  cbdata->current_fd = NULL;
-  cbdata->current_part = NULL;
-  cbdata->header_index = 0;
-  cbdata->header_search = 0;
-  strcpy(cbdata->root_id, root_id);
-  strcpy(cbdata->root_dir, dest_dir);
-  message = (attachments_t *) malloc(sizeof(attachments_t));
-  cbdata->message = message;
-  cbdata->message->parts = NULL;
-  cbdata->message->root_part = NULL;
-
-  callbacks.parse_begin_cb = _mime_parse_begin;
-  callbacks.parse_end_cb = _mime_parse_end;
-  callbacks.part_begin_cb = _mime_part_begin;
-  callbacks.part_end_cb = _mime_part_end;
-  callbacks.received_bytes_cb = _mime_received_bytes;
-
-  status = MIME_parse(MIME_filereader_function,
-                      in, boundary, &callbacks, cbdata);
-
-  if (status == MIME_PARSER_OK)
-  {
-    free(cbdata);
-    return message;
-  }
-  else
-  {
-    /* TODO (#1#): Free objects */
 
-    log_error("MIME parser error '%s'!",
-               status ==
-               MIME_PARSER_READ_ERROR ? "general error" :
-               "Incomplete message");
-    return NULL;
-  }
-}
+/* ------------------------------------------------------------------
+  "multipart/related"  MIME Message Builder
+ ------------------------------------------------------------------*/
 
 herror_t
 mime_get_attachments(content_type_t * ctype, http_input_stream_t * in,
@@ -884,6 +442,8 @@ mime_get_attachments(content_type_t * ctype, http_input_stream_t * in,
   attachments_t *mimeMessage;
   part_t *part, *tmp_part = NULL;
   char *boundary, *root_id;
+  mime_parser_t parser;
+  herror_t status;
 
   /* Check for MIME message */
   if (!(ctype && !strcmp(ctype->type, "multipart/related")))
@@ -892,7 +452,7 @@ mime_get_attachments(content_type_t * ctype, http_input_stream_t * in,
 
   boundary = hpairnode_get(ctype->params, "boundary");
   root_id = hpairnode_get(ctype->params, "start");
-  if (boundary == NULL)
+  if (boundary == NULL || strlen(boundary) > MIME_MAX_BOUNDARY)
   {
     /* TODO (#1#): Handle Error in http form */
     log_error("'boundary' not set for multipart/related");
@@ -908,14 +468,30 @@ mime_get_attachments(content_type_t * ctype, http_input_stream_t * in,
                       "'start' not set for multipart/related");
   }
 
-  mimeMessage =
-    mime_message_parse(in, root_id, boundary, ".");
-  if (mimeMessage == NULL)
-  {
-    /* TODO (#1#): Handle Error in http form */
-    log_error("MIME Parse Error");
+  memset(&parser, 0, sizeof(parser));
+  if (!(parser.buf = (byte_t *) malloc(MIME_BUFFER_SIZE)))
     return herror_new("mime_get_attachments", MIME_ERROR_PARSE_ERROR,
-                      "MIME Parse Error");
+                      "malloc failed (%s)", strerror(errno));
+
+  parser.in = in;
+  parser.root_id = root_id;
+  parser.message = mimeMessage = attachments_new();
+  parser.dlen = sprintf(parser.delim, "\r\n--%s", boundary);
+
+  /* the first delimiter may start the body, it has no CRLF then */
+  memcpy(parser.buf, "\r\n", 2);
+  parser.len = 2;
+
+  status = _mime_parse(&parser);
+  free(parser.buf);
+
+  if (status != H_OK)
+  {
+    log_error("MIME Parse Error (%s)", herror_message(status));
+    /* the root part is still in the list */
+    mimeMessage->root_part = NULL;
+    attachments_free(mimeMessage);
+    return status;
   }
 
   /* Find root */
@@ -937,6 +513,9 @@ mime_get_attachments(content_type_t * ctype, http_input_stream_t * in,
       else
         mimeMessage->parts = part->next;
 
+      if (mimeMessage->last == part)
+        mimeMessage->last = tmp_part;
+
       break;
     }
     tmp_part = part;
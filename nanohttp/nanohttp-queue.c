@@ -0,0 +1,155 @@
+/******************************************************************
+*  $Id$
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2003  Ferhat Ayaz
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+*
+* Email: ferhatayaz@yahoo.com
+******************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <nanohttp/nanohttp-queue.h>
+
+#include <log.h>
+
+herror_t
+hqueue_init(hqueue_t * queue, size_t size)
+{
+  size_t capacity, i;
+
+  for (capacity = 2; capacity < size; capacity <<= 1)
+    ;
+
+  memset(queue, 0, sizeof(hqueue_t));
+
+  if (!(queue->cells = (hqueue_cell_t *) calloc(capacity,
+                                                sizeof(hqueue_cell_t))))
+  {
+    log_error("calloc failed (%s)", strerror(errno));
+    return herror_new("hqueue_init", GENERAL_INVALID_PARAM,
+                      "Cannot allocate %lu queue cells",
+                      (unsigned long) capacity);
+  }
+
+  for (i = 0; i < capacity; i++)
+    queue->cells[i].seq = i;
+
+  queue->mask = capacity - 1;
+
+  return H_OK;
+}
+
+void
+hqueue_destroy(hqueue_t * queue)
+{
+  free(queue->cells);
+  queue->cells = NULL;
+
+  return;
+}
+
+int
+hqueue_push(hqueue_t * queue, void *data)
+{
+  hqueue_cell_t *cell;
+  size_t pos, seq;
+  long diff;
+
+  pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  while (1)
+  {
+    cell = &queue->cells[pos & queue->mask];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    diff = (long) seq - (long) pos;
+
+    if (diff == 0)
+    {
+      /* the cell is free, try to claim it */
+      if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      /* the consumer has not drained this cell yet */
+      return 0;
+    }
+    else
+    {
+      pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->data = data;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+void *
+hqueue_pop(hqueue_t * queue)
+{
+  hqueue_cell_t *cell;
+  size_t pos, seq;
+  long diff;
+  void *data;
+
+  pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  while (1)
+  {
+    cell = &queue->cells[pos & queue->mask];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    diff = (long) seq - (long) (pos + 1);
+
+    if (diff == 0)
+    {
+      /* the cell is filled, try to claim it */
+      if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (diff < 0)
+    {
+      /* the producer has not filled this cell yet */
+      return NULL;
+    }
+    else
+    {
+      pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  data = cell->data;
+  __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+  return data;
+}
+
+size_t
+hqueue_depth(hqueue_t * queue)
+{
+  size_t head, tail;
+
+  tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+  return head > tail ? head - tail : 0;
+}
@@ -32,20 +32,21 @@
 #include <log.h>
 
 static hrequest_t *
-hrequest_new(void)
+hrequest_new(harena_t * arena)
 {
   hrequest_t *req;
+  int i;
  
-  if (!(req = (hrequest_t *) malloc(sizeof(hrequest_t)))) {
-
-	  log_error("malloc failed (%s)", strerror(errno));
+  if (!(req = (hrequest_t *) harena_alloc(arena, sizeof(hrequest_t))))
 	  return NULL;
-  }
 
   req->method = HTTP_REQUEST_GET;
   req->version = HTTP_1_1;
+  req->path = "";
   req->query = NULL;
   req->header = NULL;
+  for (i = 0; i < HHEADER_MAX; i++)
+    req->known[i] = NULL;
   req->in = NULL;
   req->attachments = NULL;
   req->content_type = NULL;
@@ -55,10 +56,11 @@ hrequest_new(void)
 }
 
 static hrequest_t *
-_hrequest_parse_header(char *data)
+_hrequest_parse_header(harena_t * arena, char *data)
 {
   hrequest_t *req;
   hpair_t *hpair = NULL, *qpair = NULL, *tmppair = NULL;
+  hheader_id_t id;
 
   char *tmp;
   char *tmp2;
@@ -72,7 +74,8 @@ _hrequest_parse_header(char *data)
   char *sid;
   int firstline = 1;
 
-  req = hrequest_new();
+  if (!(req = hrequest_new(arena)))
+    return NULL;
   tmp = data;
 
   for (;;)
@@ -140,8 +143,8 @@ _hrequest_parse_header(char *data)
         tmp2 = saveptr2;
 
         /* save path */
-        /* req->path = (char *) malloc(strlen(key) + 1); */
-        strncpy(req->path, key, REQUEST_MAX_PATH_SIZE);
+        if (!(req->path = harena_strdup(arena, key)))
+          return NULL;
 
         /* parse options */
         for (;;)
@@ -161,11 +164,9 @@ _hrequest_parse_header(char *data)
           /* create option pair */
           if (opt_key != NULL)
           {
-            if (!(tmppair = (hpair_t *) malloc(sizeof(hpair_t))))
-            {
-              log_error("malloc failed (%s)", strerror(errno));
+            if (!(tmppair = hpairnode_new_arena(arena, opt_key, opt_value,
+                                                NULL)))
               return NULL;
-            }
 
             if (req->query == NULL)
             {
@@ -177,11 +178,6 @@ _hrequest_parse_header(char *data)
               qpair = tmppair;
             }
 
-            /* fill hpairnode_t struct */
-            qpair->next = NULL;
-            qpair->key = strdup(opt_key);
-            qpair->value = strdup(opt_value);
-
           }
         }
       }
@@ -194,8 +190,21 @@ _hrequest_parse_header(char *data)
          = saveptr2; */
 
       /* create pair */
-/*			tmppair = (hpair_t *) malloc(sizeof(hpair_t));*/
-      tmppair = hpairnode_parse(result, ":", NULL);
+      key = (char *) strtok_r(result, ":", &opt_value);
+      if (key == NULL)
+        continue;
+
+      if (opt_value == NULL)
+        opt_value = "";
+      while (*opt_value == ' ')
+        opt_value++;            /* skip white space */
+
+      if (!(tmppair = hpairnode_new_arena(arena, key, opt_value, NULL)))
+        return NULL;
+
+      id = hheader_classify(tmppair->key);
+      if (id != HHEADER_UNKNOWN && req->known[id] == NULL)
+        req->known[id] = tmppair->value;
 
       if (req->header == NULL)
       {
@@ -217,11 +226,11 @@ _hrequest_parse_header(char *data)
   }
 
   /* Check Content-type */
-  tmp = hpairnode_get_ignore_case(req->header, HEADER_CONTENT_TYPE);
+  tmp = req->known[HHEADER_CONTENT_TYPE];
   if (tmp != NULL)
-    req->content_type = content_type_new(tmp);
+    req->content_type = content_type_new_arena(arena, tmp);
 
-  if (sid = hpairnode_get_ignore_case(req->header, HEADER_X_TFS_SESSION))
+  if (sid = req->known[HHEADER_X_TFS_SESSION])
   {
       log_debug("TFS session ID is %s", sid);
       req->session = session_init(sid);
@@ -231,69 +240,107 @@ _hrequest_parse_header(char *data)
 }
 
 
+char *
+hrequest_get_header(hrequest_t * req, hheader_id_t id)
+{
+  if (id <= HHEADER_UNKNOWN || id >= HHEADER_MAX)
+    return NULL;
+
+  return req->known[id];
+}
+
+
 void
 hrequest_free(hrequest_t * req)
 {
   if (req == NULL)
     return;
 
-  hpairnode_free_deep(req->header);
-  hpairnode_free_deep(req->query);
+  /* header, query, path and content type belong to the arena */
 
   if (req->in)
     http_input_stream_free(req->in);
 
-  if (req->content_type)
-    content_type_free(req->content_type);
-
   if (req->attachments)
     attachments_free(req->attachments);
 
   if (req->session)
     session_close(req->session);
 
-  free(req);
-
   return;
 }
 
 
 herror_t
-hrequest_new_from_socket(hsocket_t *sock, hrequest_t ** out)
+hrequest_new_from_socket(hsocket_t *sock, harena_t * arena, hrequest_t ** out)
 {
-  int i, readed;
   herror_t status;
   hrequest_t *req;
-  char buffer[MAX_HEADER_SIZE + 1];
-  attachments_t *mimeMessage;
+  char *buffer, *tmp;
+  char length[24];
+  long content_length;
+  int framing;
 
-  memset(buffer, 0, MAX_HEADER_SIZE);
   /* Read header */
-  for(i=0; i < MAX_HEADER_SIZE; i++)
+  if ((status = hsocket_read_header(sock, MAX_HEADER_SIZE, &buffer)) != H_OK)
   {
-    if ((status = hsocket_read(sock, &(buffer[i]), 1, 1, &readed)) != H_OK)
-    {
-      log_error("hsocket_read failed (%s)", herror_message(status));
-      return status;
-    }
+    log_error("hsocket_read_header failed (%s)", herror_message(status));
+    return status;
+  }
+
+  /* Frame the body the way the reactor did, before the header is parsed */
+  if ((framing = http_input_stream_framing(buffer, strlen(buffer),
+                                           &content_length)) == -1)
+    return herror_new("hrequest_new_from_socket", STREAM_ERROR_FRAMING,
+                      "Request has conflicting framing headers");
 
-    buffer[i + 1] = '\0';       /* for strmp */
+  /* Create request */
+  if (!(req = _hrequest_parse_header(arena, buffer)))
+    return herror_new("hrequest_new_from_socket", GENERAL_HEADER_PARSE_ERROR,
+                      "Cannot allocate request");
+
+  /* Create input stream, a request without framing headers has no body */
+  if (framing == HTTP_TRANSFER_CHUNKED)
+  {
+    req->in = http_input_stream_new_framed(sock, NULL,
+                                           TRANSFER_ENCODING_CHUNKED);
+  }
+  else
+  {
+    snprintf(length, sizeof(length), "%ld", content_length);
+    req->in = http_input_stream_new_framed(sock, length, NULL);
+  }
 
-/*    log_error("buffer=\"%s\"", buffer); */
+  /* Check for a compressed body */
+  if ((tmp = req->known[HHEADER_CONTENT_ENCODING]) &&
+      strcasecmp(tmp, "identity"))
+  {
+    if (!strcasecmp(tmp, CONTENT_ENCODING_GZIP))
+      status = http_input_stream_inflate(req->in, HTTP_CONTENT_ENCODING_GZIP);
+    else if (!strcasecmp(tmp, CONTENT_ENCODING_DEFLATE))
+      status = http_input_stream_inflate(req->in,
+                                         HTTP_CONTENT_ENCODING_DEFLATE);
+    else
+      status = herror_new("hrequest_new_from_socket", STREAM_ERROR_ENCODING,
+                          "Content-Encoding '%s' is not supported", tmp);
 
-    if (i > 3)
+    if (status != H_OK)
     {
-      if (!strcmp(&(buffer[i - 1]), "\n\n") ||
-          !strcmp(&(buffer[i - 2]), "\n\r\n"))
-        break;
+      hrequest_free(req);
+      return status;
     }
   }
 
-  /* Create response */
-  req = _hrequest_parse_header(buffer);
+  *out = req;
+  return H_OK;
+}
+
 
-  /* Create input stream */
-  req->in = http_input_stream_new(sock, req->header);
+herror_t
+hrequest_read_attachments(hrequest_t * req)
+{
+  herror_t status;
+  attachments_t *mimeMessage;
 
   /* Check for MIME message */
   if ((req->content_type &&
@@ -301,20 +348,13 @@ hrequest_new_from_socket(hsocket_t *sock, hrequest_t ** out)
   {
     status = mime_get_attachments(req->content_type, req->in, &mimeMessage);
     if (status != H_OK)
-    {
-      /* TODO (#1#): Handle error */
-      hrequest_free(req);
       return status;
-    }
-    else
-    {
-      http_input_stream_free(req->in);
-      req->attachments = mimeMessage;
-      req->in =
-        http_input_stream_new_from_file(mimeMessage->root_part->filename);
-    }
+
+    http_input_stream_free(req->in);
+    req->attachments = mimeMessage;
+    req->in =
+      http_input_stream_new_from_file(mimeMessage->root_part->filename);
   }
 
-  *out = req;
   return H_OK;
 }
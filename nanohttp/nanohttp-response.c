@@ -135,31 +135,17 @@ _hresponse_parse_header(const char *buffer)
 herror_t
 hresponse_new_from_socket(hsocket_t *sock, hresponse_t ** out)
 {
-  int i = 0, count;
   herror_t status;
   hresponse_t *res;
   attachments_t *mimeMessage;
-  char buffer[MAX_HEADER_SIZE + 1];
+  char *buffer;
 
 read_header:                   /* for errorcode: 100 (continue) */
   /* Read header */
-  while (i < MAX_HEADER_SIZE)
+  if ((status = hsocket_read_header(sock, MAX_HEADER_SIZE, &buffer)) != H_OK)
   {
-    if ((status = hsocket_read(sock, &(buffer[i]), 1, 1, &count)) != H_OK)
-    {
-      log_error("Socket read error");
-      return status;
-    }
-
-    buffer[i + 1] = '\0';       /* for strmp */
-
-    if (i > 3)
-    {
-      if (!strcmp(&(buffer[i - 1]), "\n\n") ||
-          !strcmp(&(buffer[i - 2]), "\n\r\n"))
-        break;
-    }
-    i++;
+    log_error("Socket read error");
+    return status;
   }
 
   /* Create response */
@@ -176,7 +162,6 @@ read_header:                   /* for errorcode: 100 (continue) */
   if (res->errcode == 100)
   {
     hresponse_free(res);
-    i = 0;
     goto read_header;
   }
 
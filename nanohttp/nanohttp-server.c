@@ -22,41 +22,132 @@
 * Email: ayaz@jprogrammer.net
 ******************************************************************/
 
+#ifdef LINUX
+#define _GNU_SOURCE             /* pthread_setaffinity_np() */
+#endif
+
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
 //#include <process.h>  TODO bob
 
 #include <nanohttp/nanohttp-server.h>
 #include <nanohttp/nanohttp-base64.h>
 #include <nanohttp/nanohttp-ssl.h>
+#include <nanohttp/nanohttp-queue.h>
+#include <nanohttp/nanohttp-timer.h>
 
 #include <log.h>
 
+struct _httpd_reactor;
+
 typedef struct _conndata
 {
   volatile int flag;
+  struct _httpd_reactor *reactor;       /* event loop owning the socket */
   hsocket_t sock;
+  harena_t arena;               /* request-scoped allocations */
 #ifdef WIN32
   HANDLE tid;
 #else
   pthread_t tid;
-  pthread_attr_t attr;
 #endif
   time_t atime;
+  htimer_t timer;               /* current deadline, reactor only */
+  int deadline;                 /* what the timer is waiting for */
+  struct timespec queued;       /* time the request was queued */
+  int complete;                 /* request fully buffered at dispatch */
+  int keepalive;                /* set by the worker when handing back */
+  struct _conndata *next;       /* link in the reactor's resume list */
 }
 conndata_t;
 
 #define CONNECTION_FREE		0
-#define CONNECTION_IN_USE	1
+#define CONNECTION_IN_USE	1     /* idle, owned by the reactor */
+#define CONNECTION_DISPATCHED	2     /* request handed to a worker */
+
+#define DEADLINE_NONE		0
+#define DEADLINE_IDLE		1     /* keep-alive, waiting for a request */
+#define DEADLINE_HEADER		2     /* request header incomplete */
+#define DEADLINE_BODY		3     /* request body incomplete */
+#define DEADLINE_HANDLER	4     /* request served by a worker */
+#define DEADLINE_EXPIRED	5     /* socket shut down, close on resume */
+
+/*
+ * A reactor owns the client sockets it accepted while they are idle.
+ * It waits on them with edge-triggered one-shot epoll events, buffers
+ * what arrives and hands a connection to a worker only once a complete
+ * request sits in its read-ahead buffer. Workers hand connections
+ * back through the resume list and wake the reactor via eventfd.
+ *
+ * With several listeners every reactor runs in its own thread on its
+ * own SO_REUSEPORT socket, so accepting and connection state stay on
+ * one core. The slot table and the worker pool are shared.
+ */
+typedef struct _httpd_reactor
+{
+  hsocket_t listener;
+  pthread_t tid;
+  int cpu;                      /* pinned to this CPU, -1 if not */
+  int epfd;
+  int wakefd;
+  int paused;                   /* listener disarmed, no free slots */
+  pthread_mutex_t lock;
+  conndata_t *resumed;
+  htimer_wheel_t timers;        /* connection deadlines */
+}
+httpd_reactor_t;
+
+/* requests larger than this are dispatched before fully received */
+#define HTTPD_MAX_BUFFERED	(64 * 1024)
+#define HTTPD_MAX_EVENTS	64
+
+/* request bytes read off a refused connection before it is closed */
+#define HTTPD_MAX_DRAINED	(64 * 1024)
+
+/* requests a worker serves in a row before the reactor gets the
+   connection back, the rest of the pipeline is dispatched again */
+#define HTTPD_MAX_PIPELINED	16
+
+/*
+ * Worker threads pop dispatched connections from a lock-free queue.
+ * The semaphore counts queued connections, so idle workers sleep
+ * instead of spinning on the empty queue.
+ */
+typedef struct _httpd_worker
+{
+  pthread_t tid;
+  httpd_conn_t conn;            /* reused for every request */
+}
+httpd_worker_t;
+
+typedef struct _httpd_pool
+{
+  hqueue_t queue;
+  sem_t ready;
+  httpd_worker_t *workers;
+  long depth_max;
+  unsigned long dispatched;
+  unsigned long long wait_total;
+  unsigned long wait_max;
+  unsigned long shed;
+}
+httpd_pool_t;
 
 /*
  * -----------------------------------------------------
@@ -66,17 +157,39 @@ conndata_t;
  */
 static volatile int _httpd_run = 1;
 
-static hsocket_t _httpd_socket;
 static int _httpd_port = 10000;
 static int _httpd_max_connections = 20;
 static int _httpd_timeout = 10;
+static int _httpd_idle_timeout = -1;    /* defaults to _httpd_timeout */
+static int _httpd_header_timeout = -1;
+static int _httpd_body_timeout = -1;
+static int _httpd_handler_timeout = 300;
+static int _httpd_workers = 8;
+static int _httpd_listeners = 1;
+static int _httpd_backlog = HSOCKET_LISTEN_BACKLOG;
+static int _httpd_defer_accept = 0;     /* seconds, 0 disables */
+static int _httpd_pin_cpus = 0;
+static int _httpd_shed_limit = -1;      /* 0 disables, -1 derives */
+static int _httpd_retry_after = 5;
+static char _httpd_retry_after_str[12];
+static char _httpd_unavailable[128];    /* canned response on accept */
+static httpd_load_probe _httpd_load_probe = NULL;
+static int _httpd_gzip_level = 0;       /* 0 disables compression */
+static int _httpd_gzip_min = 1024;
 static char *_httpd_auth_helper = NULL;
+static int _httpd_auth_helpers = NTLM_POOL_SIZE;
+static int _httpd_sessions = SESSION_CAPACITY;
+static int _httpd_session_ttl = SESSION_TTL;
 
 static hservice_t *_httpd_services_default = NULL;
 static hservice_t *_httpd_services_head = NULL;
 static hservice_t *_httpd_services_tail = NULL;
+static hservice_t **_httpd_service_table = NULL;        /* by ctx hash */
+static unsigned long _httpd_service_mask = 0;
 
 static conndata_t *_httpd_connection;
+static hqueue_t _httpd_free_slots;      /* slots not in use */
+static long _httpd_conncount = 0;       /* slots in use */
 
 static int _httpd_enable_service_list = 0;
 static int _httpd_enable_statistics = 0;
@@ -91,8 +204,9 @@ LPCTSTR _httpd_connection_lock_str;
 #define snprintf(buffer, num, s1, s2) sprintf(buffer, s1,s2)
 #else
 static int _httpd_terminate_signal = SIGINT;
-static sigset_t thrsigset;
-static pthread_mutex_t _httpd_connection_lock;
+static pthread_attr_t _httpd_thread_attr;
+static httpd_reactor_t *_httpd_reactors;
+static httpd_pool_t _httpd_pool;
 #endif
 
 static void
@@ -118,32 +232,234 @@ _httpd_parse_arguments(int argc, char **argv)
     {
       _httpd_timeout = atoi(argv[i]);
     }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_IDLETIMEOUT))
+    {
+      _httpd_idle_timeout = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_HEADERTIMEOUT))
+    {
+      _httpd_header_timeout = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_BODYTIMEOUT))
+    {
+      _httpd_body_timeout = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_HANDLERTIMEOUT))
+    {
+      _httpd_handler_timeout = atoi(argv[i]);
+    }
     else if (!strcmp(argv[i - 1], NHTTPD_ARG_NTLMHELP))
     {
       _httpd_auth_helper = argv[i];
       log_debug("setting NTLM helper path: %s", _httpd_auth_helper);
     }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_NTLMHELPERS))
+    {
+      _httpd_auth_helpers = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_NTLMTIMEOUT))
+    {
+      ntlm_auth_set_timeout(atoi(argv[i]));
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_SESSIONS))
+    {
+      _httpd_sessions = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_SESSIONTTL))
+    {
+      _httpd_session_ttl = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_WORKERS))
+    {
+      _httpd_workers = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_LISTENERS))
+    {
+      _httpd_listeners = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_BACKLOG))
+    {
+      _httpd_backlog = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_DEFERACCEPT))
+    {
+      _httpd_defer_accept = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_PINCPUS))
+    {
+      _httpd_pin_cpus = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_SHEDLIMIT))
+    {
+      _httpd_shed_limit = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_RETRYAFTER))
+    {
+      _httpd_retry_after = atoi(argv[i]);
+      if (_httpd_retry_after < 1)
+        _httpd_retry_after = 1;
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_GZIPLEVEL))
+    {
+      _httpd_gzip_level = atoi(argv[i]);
+      if (_httpd_gzip_level > 9)
+        _httpd_gzip_level = 9;
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_GZIPMIN))
+    {
+      _httpd_gzip_min = atoi(argv[i]);
+      if (_httpd_gzip_min < 1)
+        _httpd_gzip_min = 1;
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_MIMESPILL))
+    {
+      mime_set_spill_size(atol(argv[i]));
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_MIMEPARTS))
+    {
+      mime_set_max_parts(atoi(argv[i]));
+    }
+    else if (!strcmp(argv[i - 1], NHTTPD_ARG_MIMEDIR))
+    {
+      mime_set_spool_dir(argv[i]);
+    }
   }
 
+  /* deadlines which were not given follow the general timeout */
+  if (_httpd_idle_timeout < 0)
+    _httpd_idle_timeout = _httpd_timeout;
+  if (_httpd_header_timeout < 0)
+    _httpd_header_timeout = _httpd_timeout;
+  if (_httpd_body_timeout < 0)
+    _httpd_body_timeout = _httpd_timeout;
+
+  /* normal requests are refused once this many wait per worker */
+  if (_httpd_shed_limit < 0)
+    _httpd_shed_limit = 4 * (_httpd_workers > 0 ? _httpd_workers : 1);
+
+  snprintf(_httpd_retry_after_str, sizeof(_httpd_retry_after_str), "%d",
+           _httpd_retry_after);
+  snprintf(_httpd_unavailable, sizeof(_httpd_unavailable),
+           "HTTP/1.1 503 Service Unavailable\r\n"
+           HEADER_RETRY_AFTER ": %d\r\n"
+           HEADER_CONTENT_LENGTH ": 0\r\n"
+           HEADER_CONNECTION ": close\r\n\r\n", _httpd_retry_after);
+
   return;
 }
 
 
+/*--------------------------------------------------
+FUNCTION: _httpd_raise_fd_limit
+DESC: Makes sure the process may open a descriptor for
+every connection slot, as far as the hard limit allows.
+----------------------------------------------------*/
 static void
+_httpd_raise_fd_limit(void)
+{
+  struct rlimit rl;
+  rlim_t need;
+
+  /* listener, epoll, eventfd, logs and database connections */
+  need = (rlim_t) _httpd_max_connections + 64;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur >= need)
+    return;
+
+  rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= need) ?
+    need : rl.rlim_max;
+
+  if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+    log_warn("setrlimit failed (%s)", strerror(errno));
+
+  if (rl.rlim_cur < need)
+    log_warn("descriptor limit %lu is too low for %d connections",
+             (unsigned long) rl.rlim_cur, _httpd_max_connections);
+
+  return;
+}
+
+static herror_t
 _httpd_connection_slots_init(void)
 {
+  herror_t status;
   int i;
 
-#ifdef WIN32
-  _httpd_connection_lock = CreateMutex( NULL, TRUE, _httpd_connection_lock_str );
-#else
-  pthread_mutex_init(&_httpd_connection_lock, NULL);
-#endif
-  _httpd_connection = calloc(_httpd_max_connections, sizeof(conndata_t));
+  if (_httpd_max_connections < 1)
+  {
+    log_warn("at least one connection slot is needed (was %d)",
+             _httpd_max_connections);
+    _httpd_max_connections = 1;
+  }
+
+  _httpd_raise_fd_limit();
+
+  if (!(_httpd_connection = calloc(_httpd_max_connections,
+                                   sizeof(conndata_t))))
+  {
+    log_error("calloc failed (%s)", strerror(errno));
+    return herror_new("httpd_init", GENERAL_INVALID_PARAM,
+                      "Cannot allocate %d connection slots",
+                      _httpd_max_connections);
+  }
+
+  if ((status = hqueue_init(&_httpd_free_slots, _httpd_max_connections))
+      != H_OK)
+    return status;
+
   for (i = 0; i < _httpd_max_connections; i++)
+  {
     hsocket_init(&(_httpd_connection[i].sock));
+    harena_init(&(_httpd_connection[i].arena));
+    htimer_init(&(_httpd_connection[i].timer), &_httpd_connection[i]);
+    hqueue_push(&_httpd_free_slots, &_httpd_connection[i]);
+  }
 
-  return;
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_listeners_init
+DESC: Binds one listening socket per reactor. More than
+one listener share the port through SO_REUSEPORT.
+----------------------------------------------------*/
+static herror_t
+_httpd_listeners_init(void)
+{
+  herror_t status;
+  int i;
+
+  if (_httpd_listeners < 1)
+  {
+    log_warn("at least one listener is needed (was %d)", _httpd_listeners);
+    _httpd_listeners = 1;
+  }
+
+  if (!(_httpd_reactors =
+        (httpd_reactor_t *) calloc(_httpd_listeners,
+                                   sizeof(httpd_reactor_t))))
+    return herror_new("httpd_init", GENERAL_INVALID_PARAM,
+                      "Cannot allocate %d listeners", _httpd_listeners);
+
+  for (i = 0; i < _httpd_listeners; i++)
+  {
+    if ((status = hsocket_init(&(_httpd_reactors[i].listener))) != H_OK)
+    {
+      log_error("hsocket_init failed (%s)", herror_message(status));
+      return status;
+    }
+
+    if (_httpd_listeners == 1)
+      status = hsocket_bind(&(_httpd_reactors[i].listener), _httpd_port);
+    else
+      status = hsocket_bind_shared(&(_httpd_reactors[i].listener),
+                                   _httpd_port);
+
+    if (status != H_OK)
+      return status;
+  }
+
+  return H_OK;
 }
 
 static void
@@ -179,10 +495,17 @@ httpd_init(int argc, char *argv[])
 
   log_info("socket bind to port '%d'", _httpd_port);
 
-  _httpd_connection_slots_init();
+  if ((status = _httpd_connection_slots_init()) != H_OK)
+    return status;
 
   _httpd_register_builtin_services();
 
+  /* helpers are started up front, not on the first logon */
+  if (_httpd_auth_helper)
+    ntlm_auth_pool_init(_httpd_auth_helper, _httpd_auth_helpers);
+
+  session_store_init(_httpd_sessions, _httpd_session_ttl);
+
 #ifdef WIN32
   /* 
      if (_beginthread (WSAReaper, 0, NULL) == -1) { log_error ("Winsock
@@ -191,13 +514,24 @@ httpd_init(int argc, char *argv[])
    */
 #endif
 
-  if ((status = hsocket_init(&_httpd_socket)) != H_OK)
-  {
-    log_error("hsocket_init failed (%s)", herror_message(status));
-    return status;
-  }
+  return _httpd_listeners_init();
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_ctx_hash
+DESC: Case insensitive FNV-1a hash of a service
+context, contexts are matched with strcasecmp().
+----------------------------------------------------*/
+static unsigned long
+_httpd_ctx_hash(const char *ctx)
+{
+  unsigned long hash = 2166136261UL;
 
-  return hsocket_bind(&_httpd_socket, _httpd_port);
+  for (; *ctx; ctx++)
+    hash = (hash ^ (unsigned char) tolower((unsigned char) *ctx)) *
+      16777619UL;
+
+  return hash;
 }
 
 /*
@@ -206,10 +540,18 @@ httpd_init(int argc, char *argv[])
  * -----------------------------------------------------
  */
 int
-httpd_register_secure(const char *ctx, httpd_service func, httpd_auth auth)
+httpd_register_secure_data(const char *ctx, httpd_service func,
+                           httpd_auth auth, void *data)
 {
   hservice_t *service;
 
+  /* the dispatch table is read without locks */
+  if (_httpd_service_table)
+  {
+    log_error("cannot register '%s' while the server runs", SAVE_STR(ctx));
+    return 0;
+  }
+
   if (!(service = (hservice_t *) malloc(sizeof(hservice_t))))
   {
     log_error("malloc failed (%s)", strerror(errno));
@@ -219,7 +561,11 @@ httpd_register_secure(const char *ctx, httpd_service func, httpd_auth auth)
   service->next = NULL;
   service->auth = auth;
   service->func = func;
+  service->priority = HTTPD_PRIORITY_NORMAL;
+  service->shed = NULL;
+  service->data = data;
   strcpy(service->ctx, ctx);
+  service->hash = _httpd_ctx_hash(ctx);
 
   log_debug("register service:t(%p):%s", service, SAVE_STR(ctx));
   if (_httpd_services_head == NULL)
@@ -235,6 +581,12 @@ httpd_register_secure(const char *ctx, httpd_service func, httpd_auth auth)
   return 1;
 }
 
+int
+httpd_register_secure(const char *ctx, httpd_service func, httpd_auth auth)
+{
+  return httpd_register_secure_data(ctx, func, auth, NULL);
+}
+
 int
 httpd_register(const char *ctx, httpd_service service)
 {
@@ -261,6 +613,40 @@ httpd_register_default(const char *ctx, httpd_service service)
   return httpd_register_default_secure(ctx, service, NONE);
 }
 
+/*--------------------------------------------------
+FUNCTION: httpd_set_admission
+DESC: Sets the admission priority of a registered
+service and the handler answering the requests which
+are refused while the server is saturated. Without a
+handler a plain 503 is sent.
+----------------------------------------------------*/
+int
+httpd_set_admission(const char *ctx, httpd_priority priority,
+                    httpd_service shed)
+{
+  hservice_t *service;
+
+  for (service = _httpd_services_head; service; service = service->next)
+  {
+    if (!strcasecmp(service->ctx, ctx))
+    {
+      service->priority = priority;
+      service->shed = shed;
+      return 1;
+    }
+  }
+
+  log_warn("no service registered for '%s'", SAVE_STR(ctx));
+
+  return 0;
+}
+
+void
+httpd_set_load_probe(httpd_load_probe probe)
+{
+  _httpd_load_probe = probe;
+}
+
 int
 httpd_get_port(void)
 {
@@ -291,19 +677,34 @@ FUNCTION: httpd_get_conncount
 int
 httpd_get_conncount(void)
 {
-  int i;
-  int c=0;
+  return (int) __atomic_load_n(&_httpd_conncount, __ATOMIC_RELAXED);
+}
 
-  for (i = 0;i<_httpd_max_connections; i++)
-  {
+int
+httpd_get_workers(void)
+{
+  return _httpd_workers;
+}
 
-    if (_httpd_connection[i].flag == CONNECTION_IN_USE)
-    {
-      c++;
-    }
-  }
+/*--------------------------------------------------
+FUNCTION: httpd_get_pool_stats
+----------------------------------------------------*/
+void
+httpd_get_pool_stats(httpd_pool_stats_t * stats)
+{
+  stats->workers = _httpd_workers;
+  stats->queue_depth =
+    _httpd_pool.workers ? (long) hqueue_depth(&_httpd_pool.queue) : 0;
+  stats->queue_depth_max =
+    __atomic_load_n(&_httpd_pool.depth_max, __ATOMIC_RELAXED);
+  stats->dispatched =
+    __atomic_load_n(&_httpd_pool.dispatched, __ATOMIC_RELAXED);
+  stats->wait_total =
+    __atomic_load_n(&_httpd_pool.wait_total, __ATOMIC_RELAXED);
+  stats->wait_max = __atomic_load_n(&_httpd_pool.wait_max, __ATOMIC_RELAXED);
+  stats->shed = __atomic_load_n(&_httpd_pool.shed, __ATOMIC_RELAXED);
 
-  return c;
+  return;
 }
 
 /*
@@ -338,20 +739,77 @@ hservice_free(hservice_t * service)
 static hservice_t *
 httpd_find_service(const char *ctx)
 {
-  hservice_t *cur = _httpd_services_head;
+  hservice_t *cur;
+  unsigned long hash, i;
 
-  while (cur != NULL)
+  if (!_httpd_service_table)
   {
-    if (!strcasecmp(cur->ctx, ctx))
+    for (cur = _httpd_services_head; cur; cur = cur->next)
     {
-      return cur;
+      if (!strcasecmp(cur->ctx, ctx))
+        return cur;
     }
-    cur = cur->next;
+
+    return _httpd_services_default;
+  }
+
+  hash = _httpd_ctx_hash(ctx);
+
+  for (i = hash & _httpd_service_mask; (cur = _httpd_service_table[i]);
+       i = (i + 1) & _httpd_service_mask)
+  {
+    if (cur->hash == hash && !strcasecmp(cur->ctx, ctx))
+      return cur;
   }
 
   return _httpd_services_default;
 }
 
+/*--------------------------------------------------
+FUNCTION: _httpd_services_compile
+DESC: Builds the open addressing table which maps a
+context to its service. It never changes once the
+server runs, so workers read it without locks.
+----------------------------------------------------*/
+static herror_t
+_httpd_services_compile(void)
+{
+  hservice_t *cur, **table;
+  unsigned long size, i;
+  int count;
+
+  for (count = 0, cur = _httpd_services_head; cur; cur = cur->next)
+    count++;
+
+  /* keep the table at most half full */
+  for (size = 8; size < 2UL * count; size <<= 1)
+    ;
+
+  if (!(table = (hservice_t **) calloc(size, sizeof(hservice_t *))))
+    return herror_new("_httpd_services_compile", GENERAL_INVALID_PARAM,
+                      "calloc failed (%s)", strerror(errno));
+
+  for (cur = _httpd_services_head; cur; cur = cur->next)
+  {
+    for (i = cur->hash & (size - 1); table[i]; i = (i + 1) & (size - 1))
+    {
+      if (table[i]->hash == cur->hash && !strcasecmp(table[i]->ctx, cur->ctx))
+        break;
+    }
+
+    /* the first registration of a context wins, as before */
+    if (!table[i])
+      table[i] = cur;
+  }
+
+  _httpd_service_mask = size - 1;
+  _httpd_service_table = table;
+
+  log_debug("compiled %d services into %lu slots", count, size);
+
+  return H_OK;
+}
+
 
 /*
  * -----------------------------------------------------
@@ -381,6 +839,22 @@ httpd_send_header(httpd_conn_t * res, int code, const char *text)
   char header[1024];
   hpair_t *cur;
   herror_t status;
+  char *length, *chunked;
+  int compress, hold;
+
+  /* compress large bodies if the client takes it */
+  compress = hold = 0;
+  if (res->accept != HTTP_CONTENT_ENCODING_IDENTITY &&
+      !hpairnode_get_ignore_case(res->header, HEADER_CONTENT_ENCODING))
+  {
+    length = hpairnode_get_ignore_case(res->header, HEADER_CONTENT_LENGTH);
+    chunked = hpairnode_get_ignore_case(res->header, HEADER_TRANSFER_ENCODING);
+
+    if (length)
+      compress = atol(length) >= _httpd_gzip_min;
+    else if (chunked && !strcmp(chunked, TRANSFER_ENCODING_CHUNKED))
+      hold = 1;
+  }
 
   /* set status code */
   sprintf(header, "HTTP/1.1 %d %s\r\n", code, text);
@@ -407,10 +881,38 @@ httpd_send_header(httpd_conn_t * res, int code, const char *text)
   /* add pairs */
   for (cur = res->header; cur; cur = cur->next)
   {
+    /* the compressed length is not known up front */
+    if (compress && !strcasecmp(cur->key, HEADER_CONTENT_LENGTH))
+      continue;
+
     sprintf(buffer, "%s: %s\r\n", cur->key, cur->value);
     strcat(header, buffer);
   }
 
+  if (compress || hold)
+    strcat(header, HEADER_VARY ": " HEADER_ACCEPT_ENCODING "\r\n");
+
+  if (compress)
+  {
+    sprintf(buffer, "%s: %s\r\n", HEADER_CONTENT_ENCODING,
+            res->accept == HTTP_CONTENT_ENCODING_GZIP ?
+            CONTENT_ENCODING_GZIP : CONTENT_ENCODING_DEFLATE);
+    strcat(header, buffer);
+
+    /* HTTP/1.0 clients get the body up to the close */
+    if (res->version == HTTP_1_1)
+      strcat(header, HEADER_TRANSFER_ENCODING ": "
+             TRANSFER_ENCODING_CHUNKED "\r\n");
+  }
+
+  http_output_stream_init(&(res->stream), res->sock, res->header);
+  res->out = &(res->stream);
+
+  /* the body decides whether it is worth compressing */
+  if (hold)
+    return http_output_stream_hold(res->out, header, res->accept,
+                                   _httpd_gzip_level, _httpd_gzip_min);
+
   /* set end of header */
   strcat(header, "\r\n");
 
@@ -418,7 +920,16 @@ httpd_send_header(httpd_conn_t * res, int code, const char *text)
   if ((status = hsocket_nsend(res->sock, header, strlen(header))) != H_OK)
     return status;
 
-  res->out = http_output_stream_new(res->sock, res->header);
+  if (compress)
+  {
+    res->out->type = res->version == HTTP_1_1 ?
+      HTTP_TRANSFER_CHUNKED : HTTP_TRANSFER_CONNECTION_CLOSE;
+    res->out->content_length = 0;
+
+    return http_output_stream_deflate(res->out, res->accept,
+                                      _httpd_gzip_level);
+  }
+
   return H_OK;
 }
 
@@ -441,6 +952,30 @@ httpd_send_internal_error(httpd_conn_t * conn, const char *errmsg)
   return http_output_stream_write_string(conn->out, buffer);
 }
 
+/*
+ * -----------------------------------------------------
+ * FUNCTION: httpd_send_unavailable
+ * NOTE: Refuses the request, the client is asked to
+ * come back after the Retry-After delay.
+ * -----------------------------------------------------
+ */
+herror_t
+httpd_send_unavailable(httpd_conn_t * conn)
+{
+  const char *message =
+    "<html><body><h3>Service Unavailable</h3><hr> "
+    "The server is too busy, please try again later. </body></html>\r\n";
+  char buflen[12];
+
+  snprintf(buflen, sizeof(buflen), "%d", (int) strlen(message));
+
+  httpd_set_header(conn, HEADER_CONTENT_LENGTH, buflen);
+  httpd_set_header(conn, HEADER_CONTENT_TYPE, "text/html");
+  httpd_send_header(conn, 503, "Service Unavailable");
+
+  return http_output_stream_write_string(conn->out, message);
+}
+
 /*
  * -----------------------------------------------------
  * FUNCTION: httpd_request_print
@@ -472,6 +1007,33 @@ httpd_request_print(hrequest_t * req)
 }
 
 
+/*
+ * -----------------------------------------------------
+ * FUNCTION: _httpd_conn_reset
+ * NOTE: Prepares a response object for the next request.
+ * -----------------------------------------------------
+ */
+static void
+_httpd_conn_reset(httpd_conn_t * conn, hsocket_t * sock)
+{
+  if (conn->header)
+    hpairnode_free_deep(conn->header);
+
+  if (conn->out)
+    http_output_stream_release(conn->out);
+
+  conn->sock = sock;
+  conn->service = NULL;
+  conn->out = NULL;
+  conn->version = HTTP_1_1;
+  conn->accept = HTTP_CONTENT_ENCODING_IDENTITY;
+  conn->content_type[0] = '\0';
+  conn->header = NULL;
+
+  return;
+}
+
+
 httpd_conn_t *
 httpd_new(hsocket_t * sock)
 {
@@ -483,10 +1045,9 @@ httpd_new(hsocket_t * sock)
     log_error("malloc failed (%s)", strerror(errno));
     return NULL;
   }
-  conn->sock = sock;
-  conn->out = NULL;
-  conn->content_type[0] = '\0';
   conn->header = NULL;
+  conn->out = NULL;
+  _httpd_conn_reset(conn, sock);
 
   return conn;
 }
@@ -498,36 +1059,17 @@ httpd_free(httpd_conn_t * conn)
   if (!conn)
     return;
 
-  if (conn->out)
-    http_output_stream_free(conn->out);
-
   if (conn->header)
     hpairnode_free_deep(conn->header);
 
+  if (conn->out)
+    http_output_stream_release(conn->out);
+
   free(conn);
 
   return;
 }
 
-void
-do_req_timeout(int signum)
-{
-/*
-    struct sigaction req_timeout;
-    memset(&req_timeout, 0, sizeof(&req_timeout));
-    req_timeout.sa_handler=SIG_IGN;
-    sigaction(SIGALRM, &req_timeout, NULL);
-*/
-
-  /* XXX this is not real pretty, is there a better way? */
-  log_debug("Thread timeout.");
-#ifdef WIN32
-  _endthread();
-#else
-  pthread_exit(0);
-#endif
-}
-
 static int
 _httpd_decode_authorization(const char *value, char **user, char **pass)
 {
@@ -601,7 +1143,7 @@ _httpd_authenticate_request(hrequest_t * req, httpd_auth auth, char **authdata)
     }
 
     session_auth_init(req->session, req->path, &authctx);
-    authorization = hpairnode_get_ignore_case(req->header, HEADER_AUTHORIZATION);
+    authorization = hrequest_get_header(req, HHEADER_AUTHORIZATION);
 
     if (ntlm_auth_challenge(authctx, authorization, authdata)) {
       session_bind_user(req->session, *authdata);
@@ -618,352 +1160,1407 @@ _httpd_authenticate_request(hrequest_t * req, httpd_auth auth, char **authdata)
   return 0;
 }
 
+/*--------------------------------------------------
+FUNCTION: _httpd_chunked_complete
+----------------------------------------------------*/
+static int
+_httpd_chunked_complete(const char *buf, int len, int pos)
+{
+  const char *p;
+  long size;
+
+  while ((p = memchr(buf + pos, '\n', len - pos)))
+  {
+    /* strtol stops at the CR, extension or LF */
+    size = strtol(buf + pos, NULL, 16);
+    pos = p - buf + 1;
+
+    if (size < 0)
+      return 1;                 /* let the stream report the error */
+
+    if (size == 0)
+    {
+      /* skip trailers until the empty line */
+      while ((p = memchr(buf + pos, '\n', len - pos)))
+      {
+        if (p == buf + pos || (p == buf + pos + 1 && buf[pos] == '\r'))
+          return 1;
+        pos = p - buf + 1;
+      }
+      return 0;
+    }
+
+    /* chunk data and its CRLF */
+    if (len - pos < size + 2)
+      return 0;
+    pos += size + 2;
+  }
+
+  return 0;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_request_complete
+DESC: Checks whether the read-ahead buffer of the
+socket holds a complete request. Only the framing
+headers are looked at, hrequest_new_from_socket()
+does the real parsing in the worker.
+----------------------------------------------------*/
+static int
+_httpd_request_complete(hsocket_t * sock)
+{
+  const char *buf;
+  long content_length;
+  int len, hlen;
+
+  buf = (const char *) sock->rbuf + sock->rbuf_pos;
+  len = hsocket_buffered(sock);
+
+  if (!(hlen = hsocket_header_length(sock)))
+    return 0;
+
+  switch (http_input_stream_framing(buf, hlen, &content_length))
+  {
+  case HTTP_TRANSFER_CHUNKED:
+    return _httpd_chunked_complete(buf, len, hlen);
+  case HTTP_TRANSFER_CONTENT_LENGTH:
+    return len - hlen >= content_length;
+  default:
+    /* the worker refuses it without reading a body */
+    return 1;
+  }
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_request_expects
+DESC: Checks whether the buffered request header
+carries an Expect header. Such a client waits for an
+interim response before it sends the body, so the
+request is dispatched without one.
+----------------------------------------------------*/
+static int
+_httpd_request_expects(hsocket_t * sock)
+{
+  const char *buf, *line, *p;
+  int hlen;
+
+  buf = (const char *) sock->rbuf + sock->rbuf_pos;
+
+  if (!(hlen = hsocket_header_length(sock)))
+    return 0;
+
+  for (line = buf; line < buf + hlen; line = p + 1)
+  {
+    p = memchr(line, '\n', buf + hlen - line);
+
+    if (p - line > 7 && !strncasecmp(line, HEADER_EXPECT ":", 7))
+      return 1;
+  }
+
+  return 0;
+}
+
 /*
  * -----------------------------------------------------
- * FUNCTION: httpd_session_main
+ * FUNCTION: _httpd_skip_body
+ * NOTE: Consumes what the service left unread of the
+ * request body, so that the next request on the
+ * connection starts at a message boundary. Returns 0
+ * if the connection has to be closed instead.
  * -----------------------------------------------------
  */
-#ifdef WIN32
-static unsigned _stdcall
-httpd_session_main(void *data)
-#else
-static void *
-httpd_session_main(void *data)
-#endif
+static int
+_httpd_skip_body(conndata_t * conn, hrequest_t * req)
 {
-  hrequest_t *req;              /* only for test */
-  conndata_t *conn;
-  httpd_conn_t *rconn;
+  byte_t buffer[1024];
+
+  if (!req->in || (req->in->type != HTTP_TRANSFER_CONTENT_LENGTH &&
+                   req->in->type != HTTP_TRANSFER_CHUNKED))
+    return 1;
+
+  if (!http_input_stream_is_ready(req->in))
+    return 1;
+
+  /* don't block on a body which is still on the wire */
+  if (!conn->complete)
+    return 0;
+
+  while (http_input_stream_is_ready(req->in))
+  {
+    if (http_input_stream_read(req->in, buffer, sizeof(buffer)) < 0)
+      return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * -----------------------------------------------------
+ * FUNCTION: _httpd_accept_encoding
+ * NOTE: Picks the content coding for the response from
+ * the Accept-Encoding header. gzip is preferred.
+ * -----------------------------------------------------
+ */
+static http_content_encoding_t
+_httpd_accept_encoding(const char *value)
+{
+  http_content_encoding_t result = HTTP_CONTENT_ENCODING_IDENTITY;
+  const char *token, *end, *q;
+  int len;
+
+  if (value == NULL)
+    return result;
+
+  for (token = value; *token; token = *end ? end + 1 : end)
+  {
+    while (*token == ' ' || *token == '\t')
+      token++;
+
+    if (!(end = strchr(token, ',')))
+      end = token + strlen(token);
+
+    /* "gzip;q=0" refuses the coding */
+    if ((q = memchr(token, ';', end - token)))
+    {
+      len = q - token;
+      while (q < end && *q != '=')
+        q++;
+      if (q < end && atof(q + 1) <= 0.0)
+        continue;
+    }
+    else
+      len = end - token;
+
+    while (len > 0 && (token[len - 1] == ' ' || token[len - 1] == '\t'))
+      len--;
+
+    if (len == 4 && !strncasecmp(token, CONTENT_ENCODING_GZIP, 4))
+      return HTTP_CONTENT_ENCODING_GZIP;
+
+    if (len == 7 && !strncasecmp(token, CONTENT_ENCODING_DEFLATE, 7))
+      result = HTTP_CONTENT_ENCODING_DEFLATE;
+  }
+
+  return result;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_admit
+DESC: Decides whether a request for the service is
+served. The load is the number of requests waiting for
+a worker plus the work the load probe reports waiting
+on a backend. Low priority services are refused at
+half the limit, high priority ones never.
+----------------------------------------------------*/
+static int
+_httpd_admit(hservice_t * service)
+{
+  long load, limit;
+
+  if (_httpd_shed_limit <= 0 || service->priority == HTTPD_PRIORITY_HIGH)
+    return 1;
+
+  load = (long) hqueue_depth(&_httpd_pool.queue);
+  if (_httpd_load_probe)
+    load += _httpd_load_probe();
+
+  limit = _httpd_shed_limit;
+  if (service->priority == HTTPD_PRIORITY_LOW)
+    limit = (limit + 1) / 2;
+
+  return load < limit;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_drain_body
+DESC: Reads and discards the body of a refused
+request. Closing the connection with the body unread
+resets it, and the client may lose the response. The
+response goes out first, then at most
+HTTPD_MAX_DRAINED bytes are read, each read bounded
+by the body deadline.
+----------------------------------------------------*/
+static void
+_httpd_drain_body(conndata_t * conn, hrequest_t * req)
+{
+  byte_t buffer[1024];
+  herror_t status;
+  int drained, n;
+
+  if (!req->in || (req->in->type != HTTP_TRANSFER_CONTENT_LENGTH &&
+                   req->in->type != HTTP_TRANSFER_CHUNKED))
+    return;
+
+  if ((status = hsocket_uncork(&(conn->sock))) != H_OK)
+  {
+    herror_release(status);
+    return;
+  }
+  hsocket_cork(&(conn->sock));
+
+  for (drained = 0; drained < HTTPD_MAX_DRAINED; drained += n)
+  {
+    if (!http_input_stream_is_ready(req->in) ||
+        (n = http_input_stream_read(req->in, buffer, sizeof(buffer))) <= 0)
+      break;
+  }
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_send_continue
+DESC: Tells a client which sent "Expect: 100-continue"
+to go on with the body. The interim response cannot
+wait in the write buffer, the client waits for it.
+----------------------------------------------------*/
+static herror_t
+_httpd_send_continue(hsocket_t * sock)
+{
+  herror_t status;
+
+  if ((status = hsocket_uncork(sock)) != H_OK)
+    return status;
+
+  status = hsocket_send(sock, "HTTP/1.1 100 Continue\r\n\r\n");
+  hsocket_cork(sock);
+
+  return status;
+}
+
+/*
+ * -----------------------------------------------------
+ * FUNCTION: _httpd_serve_request
+ * NOTE: Reads one request from the connection and runs
+ * the matching service. Returns 1 if the connection has
+ * to be closed afterwards.
+ * -----------------------------------------------------
+ */
+static int
+_httpd_serve_request(conndata_t * conn, httpd_conn_t * rconn)
+{
+  hrequest_t *req;
   hservice_t *service;
   herror_t status;
   char *authdata;
-  int done;
+  char *conn_str;
+  char *expect;
+  int done, refused;
+
+  log_debug("starting HTTP request on socket %p (%d)", &(conn->sock), conn->sock.sock);
+
+  if ((status = hrequest_new_from_socket(&(conn->sock), &(conn->arena),
+                                         &req)) != H_OK)
+  {
+    int code;
+
+    switch ((code = herror_code(status)))
+    {
+    case HSOCKET_ERROR_SSLCLOSE:
+    case HSOCKET_ERROR_RECEIVE:
+      log_error("hrequest_new_from_socket failed (%s)",
+                 herror_message(status));
+      break;
+    case STREAM_ERROR_FRAMING:
+      log_info("%s", herror_message(status));
+      httpd_set_header(rconn, HEADER_CONTENT_LENGTH, "0");
+      httpd_set_header(rconn, HEADER_CONNECTION, "close");
+      httpd_send_header(rconn, 400, "Bad Request");
+      break;
+    default:
+      httpd_send_internal_error(rconn, herror_message(status));
+      break;
+    }
+    herror_release(status);
+    harena_reset(&(conn->arena));
+    return 1;
+  }
+
+  httpd_request_print(req);
+
+  /* header and body of the response go out together */
+  hsocket_cork(&(conn->sock));
+
+  rconn->version = req->version;
+  if (_httpd_gzip_level > 0)
+    rconn->accept =
+      _httpd_accept_encoding(hrequest_get_header(req, HHEADER_ACCEPT_ENCODING));
+
+  done = 0;
+  conn_str = hrequest_get_header(req, HHEADER_CONNECTION);
+  if (conn_str && strncasecmp(conn_str, "close", 6) == 0)
+    done = 1;
+
+  if (!done)
+    done = req->version == HTTP_1_0 ? 1 : 0;
+
+  /* nothing below reads the body before the request is accepted */
+  refused = 0;
+  expect = hrequest_get_header(req, HHEADER_EXPECT);
+  if (expect && req->version == HTTP_1_0)
+    expect = NULL;
+
+  rconn->service = service = httpd_find_service(req->path);
+
+  if (expect && strcasecmp(expect, EXPECT_CONTINUE))
+  {
+    log_debug("unsupported expectation '%s'", expect);
+    httpd_set_header(rconn, HEADER_CONTENT_LENGTH, "0");
+    httpd_send_header(rconn, 417, "Expectation Failed");
+    done = refused = 1;
+  }
+  else if (service && !_httpd_admit(service))
+  {
+    log_info("server saturated, refusing request for '%s'", req->path);
+    __atomic_add_fetch(&_httpd_pool.shed, 1, __ATOMIC_RELAXED);
+
+    /* refused before authentication, that costs a helper round trip */
+    httpd_set_header(rconn, HEADER_RETRY_AFTER, _httpd_retry_after_str);
+    if (service->shed)
+      service->shed(rconn, req);
+    else
+      httpd_send_unavailable(rconn);
+
+    /* free the slot for someone else */
+    done = refused = 1;
+  }
+  else if (service)
+  {
+    log_debug("service '%s' for '%s' found", service->ctx, req->path);
+
+    if (_httpd_authenticate_request(req, service->auth, &authdata))
+    {
+      if (expect && !conn->complete &&
+          (status = _httpd_send_continue(&(conn->sock))) != H_OK)
+      {
+        log_error("sending 100 Continue failed (%s)",
+                  herror_message(status));
+        herror_release(status);
+        done = 1;
+      }
+      else if ((status = hrequest_read_attachments(req)) != H_OK)
+      {
+        log_error("hrequest_read_attachments failed (%s)",
+                  herror_message(status));
+        httpd_send_internal_error(rconn, herror_message(status));
+        herror_release(status);
+        done = 1;
+      }
+      else if (service->func != NULL)
+      {
+        service->func(rconn, req);
+        if (rconn->out
+            && rconn->out->type == HTTP_TRANSFER_CONNECTION_CLOSE)
+        {
+          log_debug("Connection close requested");
+          done = 1;
+        }
+      }
+      else
+      {
+        char buffer[256];
+
+        /* the path is only bounded by the header size */
+        snprintf(buffer, sizeof(buffer),
+                 "service '%s' not registered properly (func == NULL)",
+                 req->path);
+        log_debug("%s", buffer);
+        httpd_send_internal_error(rconn, buffer);
+      }
+    }
+    else
+    {
+      char *template =
+        "<html>"
+        "<head>"
+        "<title>Unauthorized</title>"
+        "</head>"
+        "<body>"
+        "<h1>Unauthorized request logged</h1>"
+        "</body>"
+        "</html>";
+
+      if (authdata)
+      {
+        httpd_set_header(rconn, HEADER_WWW_AUTHENTICATE, authdata);
+        free(authdata);
+      }
+
+      char templsz[1024];
+      sprintf(templsz, "%lu", (unsigned long)strlen(template));
+
+      httpd_set_header(rconn, HEADER_CONTENT_LENGTH, templsz);
+      httpd_set_header(rconn, HEADER_CONTENT_TYPE, "text/html");
+
+      httpd_send_header(rconn, 401, "Unauthorized");
+      http_output_stream_write_string(rconn->out, template);
+      done = refused = 1;
+    }
+  }
+  else
+  {
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "no service for '%s' found", req->path);
+    log_debug("%s", buffer);
+    httpd_send_internal_error(rconn, buffer);
+    done = refused = 1;
+  }
+
+  /* writers of a Content-Length body do not flush the stream, so the
+     end of a body compressed on the way out is still in the compressor */
+  if (rconn->out && (rconn->out->zstream || rconn->out->held_header) &&
+      (status = http_output_stream_flush(rconn->out)) != H_OK)
+  {
+    log_error("http_output_stream_flush failed (%s)",
+              herror_message(status));
+    herror_release(status);
+    done = 1;
+  }
+
+  /* a client still waiting for 100 Continue does not send the body */
+  if (refused && !(expect && !strcasecmp(expect, EXPECT_CONTINUE) &&
+                   !conn->complete))
+    _httpd_drain_body(conn, req);
+
+  if (!done && !_httpd_skip_body(conn, req))
+    done = 1;
+
+  hrequest_free(req);
+  harena_reset(&(conn->arena));
+
+  return done;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_reactor_resume
+DESC: Hands a connection back to the reactor thread.
+----------------------------------------------------*/
+static void
+_httpd_reactor_wakeup(httpd_reactor_t * reactor)
+{
+  uint64_t one = 1;
+
+  if (write(reactor->wakefd, &one, sizeof(one)) != sizeof(one))
+    log_warn("write to wakeup fd failed (%s)", strerror(errno));
+
+  return;
+}
+
+static void
+_httpd_reactor_resume(conndata_t * conn)
+{
+  httpd_reactor_t *reactor;
+
+  reactor = conn->reactor;
+
+  pthread_mutex_lock(&(reactor->lock));
+  conn->next = reactor->resumed;
+  reactor->resumed = conn;
+  pthread_mutex_unlock(&(reactor->lock));
+
+  _httpd_reactor_wakeup(reactor);
+
+  return;
+}
+
+/*
+ * -----------------------------------------------------
+ * FUNCTION: httpd_session_main
+ * NOTE: Serves the request the reactor dispatched.
+ * Returns 1 if the connection has to be closed.
+ * -----------------------------------------------------
+ */
+static int
+httpd_session_main(conndata_t * conn, httpd_conn_t * rconn)
+{
+  herror_t status;
+  int done, pipelined, served;
+
+  if (hssl_enabled() && !conn->sock.ssl)
+  {
+    /* the request follows once the handshake is through */
+    if ((status = hssl_server_ssl(&(conn->sock))) != H_OK)
+    {
+      log_warn("SSL startup failed (%s)", herror_message(status));
+      herror_release(status);
+      return 1;
+    }
+    return 0;
+  }
+
+  served = 0;
+
+  do
+  {
+    _httpd_conn_reset(rconn, &(conn->sock));
+    done = _httpd_serve_request(conn, rconn);
+
+    /* a pipelined request which is already buffered is served right
+       away, its response joins this one in the write buffer */
+    pipelined = !done && ++served < HTTPD_MAX_PIPELINED &&
+      _httpd_request_complete(&(conn->sock));
+
+    if (!pipelined &&
+        (status = hsocket_uncork(&(conn->sock))) != H_OK)
+    {
+      log_error("hsocket_uncork failed (%s)", herror_message(status));
+      herror_release(status);
+      done = 1;
+    }
+
+    /* decrypted data is invisible to epoll */
+    conn->complete = pipelined;
+  }
+  while (!done && (pipelined || hssl_pending(&(conn->sock))));
+
+  _httpd_conn_reset(rconn, NULL);
+
+  return done;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_pool_account_wait
+----------------------------------------------------*/
+static void
+_httpd_pool_account_wait(conndata_t * conn)
+{
+  struct timespec now;
+  unsigned long wait, max;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait = (now.tv_sec - conn->queued.tv_sec) * 1000000L +
+    (now.tv_nsec - conn->queued.tv_nsec) / 1000L;
+
+  __atomic_add_fetch(&_httpd_pool.wait_total, wait, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&_httpd_pool.wait_max, __ATOMIC_RELAXED);
+  while (wait > max &&
+         !__atomic_compare_exchange_n(&_httpd_pool.wait_max, &max, wait, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_worker_main
+DESC: Worker thread, takes dispatched connections
+from the queue until the server stops.
+----------------------------------------------------*/
+static void *
+_httpd_worker_main(void *data)
+{
+  httpd_worker_t *worker;
+  conndata_t *conn;
+
+  worker = (httpd_worker_t *) data;
+
+  while (1)
+  {
+    while (sem_wait(&_httpd_pool.ready) == -1 && errno == EINTR)
+      ;
+
+    /* each worker takes one of the wakeups posted on shutdown */
+    if (!_httpd_run)
+      return NULL;
+
+    /* a producer may still be publishing the cell */
+    while (!(conn = (conndata_t *) hqueue_pop(&_httpd_pool.queue)))
+      sched_yield();
+
+    _httpd_pool_account_wait(conn);
+
+    conn->keepalive = !httpd_session_main(conn, &(worker->conn));
+    _httpd_reactor_resume(conn);
+  }
+
+  /* pthread_exits automagically */
+  return NULL;
+}
+
+int
+httpd_set_header(httpd_conn_t * conn, const char *key, const char *value)
+{
+  hpair_t *p;
+
+  if (conn == NULL)
+  {
+    log_warn("Connection object is NULL");
+    return 0;
+  }
+
+  for (p = conn->header; p; p = p->next)
+  {
+    if (p->key && !strcmp(p->key, key))
+    {
+      free(p->value);
+      p->value = strdup(value);
+      return 1;
+    }
+  }
+
+  conn->header = hpairnode_new(key, value, conn->header);
+
+  return 0;
+}
+
+void
+httpd_set_headers(httpd_conn_t * conn, hpair_t * header)
+{
+  while (header)
+  {
+    httpd_set_header(conn, header->key, header->value);
+    header = header->next;
+  }
+}
+
+int
+httpd_add_header(httpd_conn_t * conn, const char *key, const char *value)
+{
+  if (!conn)
+  {
+    log_warn("Connection object is NULL");
+    return 0;
+  }
+
+  conn->header = hpairnode_new(key, value, conn->header);
+
+  return 1;
+}
+
+void
+httpd_add_headers(httpd_conn_t * conn, const hpair_t * values)
+{
+  if (!conn)
+  {
+    log_warn("Connection object is NULL");
+    return;
+  }
+
+  while (values)
+  {
+    httpd_add_header(conn, values->key, values->value);
+    values = values->next;
+  }
+  return;
+}
+
+/*
+ * -----------------------------------------------------
+ * FUNCTION: httpd_term
+ * -----------------------------------------------------
+ */
+#ifdef WIN32
+BOOL WINAPI
+httpd_term(DWORD sig)
+{
+  /* log_debug ("Got signal %d", sig); */
+  if (sig == _httpd_terminate_signal)
+    _httpd_run = 0;
+
+  return TRUE;
+}
+#else
+void
+httpd_term(int sig)
+{
+  log_debug("Got signal %d", sig);
+
+  if (sig == _httpd_terminate_signal)
+    _httpd_run = 0;
+
+  return;
+}
+#endif
+
+/*
+ * -----------------------------------------------------
+ * FUNCTION: _httpd_register_signal_handler
+ * -----------------------------------------------------
+ */
+static void
+_httpd_register_signal_handler(void)
+{
+  log_debug("registering termination signal handler (SIGNAL:%d)",
+               _httpd_terminate_signal);
+#ifdef WIN32
+  if (SetConsoleCtrlHandler((PHANDLER_ROUTINE) httpd_term, TRUE) == FALSE)
+  {
+    log_error("Unable to install console event handler!");
+  }
+
+#else
+  signal(_httpd_terminate_signal, httpd_term);
+
+  /* a client going away must not take the server down with it */
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_acquire_conn
+DESC: Returns a free connection slot or NULL if all
+slots are in use.
+----------------------------------------------------*/
+static conndata_t *
+_httpd_acquire_conn(void)
+{
+  conndata_t *conn;
+
+  if ((conn = (conndata_t *) hqueue_pop(&_httpd_free_slots)))
+  {
+    conn->flag = CONNECTION_IN_USE;
+    __atomic_add_fetch(&_httpd_conncount, 1, __ATOMIC_RELAXED);
+  }
+
+  return conn;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_release_conn
+DESC: Puts a slot back on the free list.
+----------------------------------------------------*/
+static void
+_httpd_release_conn(conndata_t * conn)
+{
+  conn->flag = CONNECTION_FREE;
+  __atomic_sub_fetch(&_httpd_conncount, 1, __ATOMIC_RELAXED);
+
+  /* the queue holds every slot, so this cannot fail */
+  hqueue_push(&_httpd_free_slots, conn);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_listener_arm
+----------------------------------------------------*/
+static void
+_httpd_listener_arm(httpd_reactor_t * reactor, int op)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &(reactor->listener);
+
+  if (epoll_ctl(reactor->epfd, op, reactor->listener.sock, &ev) == -1)
+    log_error("epoll_ctl on listener failed (%s)", strerror(errno));
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_conn_arm
+----------------------------------------------------*/
+static int
+_httpd_conn_arm(conndata_t * conn, int op)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+  ev.data.ptr = conn;
+
+  if (epoll_ctl(conn->reactor->epfd, op, conn->sock.sock, &ev) == -1)
+  {
+    log_error("epoll_ctl on socket %d failed (%s)", conn->sock.sock,
+               strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_reactor_unpause
+DESC: Arms the listener of a reactor again which ran
+out of connection slots.
+----------------------------------------------------*/
+static void
+_httpd_reactor_unpause(httpd_reactor_t * reactor)
+{
+  log_debug("connection slot freed, accepting again");
+  __atomic_store_n(&(reactor->paused), 0, __ATOMIC_RELAXED);
+  _httpd_listener_arm(reactor, EPOLL_CTL_ADD);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_conn_deadline
+DESC: Arms the timer of the connection for the given
+phase. The deadline only moves when the phase changes,
+so a client trickling bytes cannot extend it.
+----------------------------------------------------*/
+static void
+_httpd_conn_deadline(conndata_t * conn, int deadline)
+{
+  int seconds;
+
+  if (conn->deadline == deadline)
+    return;
+
+  switch (deadline)
+  {
+  case DEADLINE_IDLE:
+    seconds = _httpd_idle_timeout;
+    break;
+  case DEADLINE_HEADER:
+    seconds = _httpd_header_timeout;
+    break;
+  case DEADLINE_BODY:
+    seconds = _httpd_body_timeout;
+    break;
+  case DEADLINE_HANDLER:
+    seconds = _httpd_handler_timeout;
+    /* the worker still has to read the rest of the body */
+    if (!conn->complete)
+      seconds += _httpd_body_timeout;
+    break;
+  default:
+    seconds = 0;
+    break;
+  }
+
+  conn->deadline = deadline;
+
+  if (seconds > 0)
+    htimer_schedule(&(conn->reactor->timers), &(conn->timer),
+                    seconds * 1000UL);
+  else
+    htimer_cancel(&(conn->reactor->timers), &(conn->timer));
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_conn_close
+----------------------------------------------------*/
+static void
+_httpd_conn_close(conndata_t * conn)
+{
+  httpd_reactor_t *reactor;
+  int i;
+
+  reactor = conn->reactor;
+
+  htimer_cancel(&(reactor->timers), &(conn->timer));
+  conn->deadline = DEADLINE_NONE;
+
+  /* closing the descriptor removes it from the epoll set */
+  hsocket_close(&(conn->sock));
+  harena_free(&(conn->arena));
+  _httpd_release_conn(conn);
+
+  if (reactor->paused)
+    _httpd_reactor_unpause(reactor);
+
+  /* the other reactors resume accepting when they wake up */
+  for (i = 0; i < _httpd_listeners; i++)
+  {
+    if (&_httpd_reactors[i] != reactor &&
+        __atomic_load_n(&(_httpd_reactors[i].paused), __ATOMIC_RELAXED))
+      _httpd_reactor_wakeup(&_httpd_reactors[i]);
+  }
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_conn_expired
+DESC: Timer callback. Idle connections are closed
+right away. A worker is never interrupted, its socket
+is shut down instead so pending and further I/O fail
+and the request unwinds through the normal error
+paths.
+----------------------------------------------------*/
+static void
+_httpd_conn_expired(htimer_t * timer)
+{
+  conndata_t *conn;
+
+  conn = (conndata_t *) timer->data;
+
+  if (conn->flag == CONNECTION_DISPATCHED)
+  {
+    log_warn("request on socket %d timed out, shutting it down",
+             conn->sock.sock);
+    conn->deadline = DEADLINE_EXPIRED;
+    shutdown(conn->sock.sock, SHUT_RDWR);
+  }
+  else if (conn->flag == CONNECTION_IN_USE)
+  {
+    log_debug("closing %s socket %d",
+              conn->deadline == DEADLINE_IDLE ? "idle" : "stalled",
+              conn->sock.sock);
+    _httpd_conn_close(conn);
+  }
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_dispatch
+----------------------------------------------------*/
+static void
+_httpd_dispatch(conndata_t * conn, int complete)
+{
+  long depth, max;
+
+  conn->flag = CONNECTION_DISPATCHED;
+  conn->complete = complete;
+  clock_gettime(CLOCK_MONOTONIC, &(conn->queued));
+  _httpd_conn_deadline(conn, DEADLINE_HANDLER);
+
+  /* the queue holds every slot, so this only fails on a bug */
+  if (!hqueue_push(&_httpd_pool.queue, conn))
+  {
+    log_error("request queue full, dropping socket %d", conn->sock.sock);
+    _httpd_conn_close(conn);
+    return;
+  }
+
+  sem_post(&_httpd_pool.ready);
+
+  depth = (long) hqueue_depth(&_httpd_pool.queue);
+  max = __atomic_load_n(&_httpd_pool.depth_max, __ATOMIC_RELAXED);
+  while (depth > max &&
+         !__atomic_compare_exchange_n(&_httpd_pool.depth_max, &max, depth, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  __atomic_add_fetch(&_httpd_pool.dispatched, 1, __ATOMIC_RELAXED);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_conn_process
+DESC: Dispatches a buffered request or waits for
+more data.
+----------------------------------------------------*/
+static void
+_httpd_conn_process(conndata_t * conn, int closed)
+{
+  int complete;
+
+  if ((complete = _httpd_request_complete(&(conn->sock))) ||
+      hsocket_buffered(&(conn->sock)) >= HTTPD_MAX_BUFFERED ||
+      _httpd_request_expects(&(conn->sock)))
+  {
+    _httpd_dispatch(conn, complete);
+  }
+  else if (closed)
+  {
+    _httpd_conn_close(conn);
+  }
+  else
+  {
+    if (hsocket_header_length(&(conn->sock)))
+      _httpd_conn_deadline(conn, DEADLINE_BODY);
+    else if (hsocket_buffered(&(conn->sock))
+             || conn->deadline == DEADLINE_HEADER)
+      _httpd_conn_deadline(conn, DEADLINE_HEADER);
+    else
+      _httpd_conn_deadline(conn, DEADLINE_IDLE);
+
+    conn->flag = CONNECTION_IN_USE;
+    hsocket_buffer_release(&(conn->sock));
+
+    if (_httpd_conn_arm(conn, EPOLL_CTL_MOD) == -1)
+      _httpd_conn_close(conn);
+  }
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_conn_readable
+----------------------------------------------------*/
+static void
+_httpd_conn_readable(conndata_t * conn)
+{
+  int closed;
+
+  conn->atime = time(NULL);
+
+  /* TLS records are read and decrypted by the worker */
+  if (hssl_enabled())
+  {
+    _httpd_dispatch(conn, 0);
+    return;
+  }
+
+  if (hsocket_read_ahead(&(conn->sock), HTTPD_MAX_BUFFERED, &closed) < 0)
+  {
+    _httpd_conn_close(conn);
+    return;
+  }
+
+  _httpd_conn_process(conn, closed);
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_refuse_connections
+DESC: Answers the pending connections with a canned
+503 while all slots are in use, so clients back off
+instead of timing out in the listen backlog.
+----------------------------------------------------*/
+static void
+_httpd_refuse_connections(httpd_reactor_t * reactor)
+{
+  hsocket_t sock;
+  char junk[4096];
+  int len, drained;
+  ssize_t n;
+
+  len = strlen(_httpd_unavailable);
+
+  while (hsocket_accept_pending(&(reactor->listener), &sock) == 1)
+  {
+    log_debug("all %d connection slots in use, refusing socket %d",
+              _httpd_max_connections, sock.sock);
+    __atomic_add_fetch(&_httpd_pool.shed, 1, __ATOMIC_RELAXED);
+
+    /* a fresh socket buffer takes this without blocking */
+    if (send(sock.sock, _httpd_unavailable, len,
+             MSG_DONTWAIT | MSG_NOSIGNAL) != len)
+      log_debug("cannot refuse socket %d (%s)", sock.sock, strerror(errno));
+
+    /* closing with the request unread resets the connection, and the
+       client may lose the 503 with it. The FIN goes out after the
+       response and what already arrived of the request is read, the
+       reactor does not wait for the rest. */
+    shutdown(sock.sock, SHUT_WR);
+    for (drained = 0; drained < HTTPD_MAX_DRAINED; drained += n)
+    {
+      if ((n = recv(sock.sock, junk, sizeof(junk), MSG_DONTWAIT)) <= 0)
+        break;
+    }
+
+    hsocket_close(&sock);
+  }
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _httpd_accept_connections
+----------------------------------------------------*/
+static void
+_httpd_accept_connections(httpd_reactor_t * reactor)
+{
+  conndata_t *conn;
+
+  while (_httpd_run)
+  {
+    if (!(conn = _httpd_acquire_conn()) && _httpd_shed_limit > 0 &&
+        !hssl_enabled())
+    {
+      _httpd_refuse_connections(reactor);
+      break;
+    }
+    else if (!conn)
+    {
+      log_debug("all %d connection slots in use, pausing accept",
+                   _httpd_max_connections);
+      __atomic_store_n(&(reactor->paused), 1, __ATOMIC_RELAXED);
+      _httpd_listener_arm(reactor, EPOLL_CTL_DEL);
+      break;
+    }
+
+    if (hsocket_accept_pending(&(reactor->listener), &(conn->sock)) != 1)
+    {
+      _httpd_release_conn(conn);
+      break;
+    }
+
+    conn->reactor = reactor;
+    conn->atime = time(NULL);
+    conn->deadline = DEADLINE_NONE;
+    _httpd_conn_deadline(conn, DEADLINE_HEADER);
+
+    if (_httpd_conn_arm(conn, EPOLL_CTL_ADD) == -1)
+      _httpd_conn_close(conn);
+  }
 
-  conn = (conndata_t *) data;
+  return;
+}
 
-  log_debug("starting new httpd session on socket %d", conn->sock);
+/*--------------------------------------------------
+FUNCTION: _httpd_process_resumed
+DESC: Takes back the connections workers are done
+with.
+----------------------------------------------------*/
+static void
+_httpd_process_resumed(httpd_reactor_t * reactor)
+{
+  conndata_t *conn, *next;
+  uint64_t count;
 
-  rconn = httpd_new(&(conn->sock));
+  if (read(reactor->wakefd, &count, sizeof(count)) == -1
+      && errno != EAGAIN)
+    log_warn("read from wakeup fd failed (%s)", strerror(errno));
 
-  done = 0;
-  while (!done)
-  {
-    log_debug("starting HTTP request on socket %p (%d)", conn->sock, conn->sock.sock);
+  pthread_mutex_lock(&(reactor->lock));
+  conn = reactor->resumed;
+  reactor->resumed = NULL;
+  pthread_mutex_unlock(&(reactor->lock));
 
-    /* XXX: only used in WSAreaper */
+  for (; conn; conn = next)
+  {
+    next = conn->next;
     conn->atime = time(NULL);
 
-    if ((status = hrequest_new_from_socket(&(conn->sock), &req)) != H_OK)
+    if (!conn->keepalive || conn->deadline == DEADLINE_EXPIRED)
     {
-      int code;
-
-      switch ((code = herror_code(status)))
-      {
-      case HSOCKET_ERROR_SSLCLOSE:
-      case HSOCKET_ERROR_RECEIVE:
-        log_error("hrequest_new_from_socket failed (%s)",
-                   herror_message(status));
-        break;
-      default:
-        httpd_send_internal_error(rconn, herror_message(status));
-        break;
-      }
-      herror_release(status);
-      done = 1;
+      _httpd_conn_close(conn);
     }
     else
     {
-      char *conn_str;
-
-      httpd_request_print(req);
-
-      conn_str = hpairnode_get_ignore_case(req->header, HEADER_CONNECTION);
-      if (conn_str && strncasecmp(conn_str, "close", 6) == 0)
-        done = 1;
-
-      if (!done)
-        done = req->version == HTTP_1_0 ? 1 : 0;
-
-      if ((service = httpd_find_service(req->path)))
-      {
-        log_debug("service '%s' for '%s' found", service->ctx, req->path);
-
-        if (_httpd_authenticate_request(req, service->auth, &authdata))
-        {
-          if (service->func != NULL)
-          {
-            service->func(rconn, req);
-            if (rconn->out
-                && rconn->out->type == HTTP_TRANSFER_CONNECTION_CLOSE)
-            {
-              log_debug("Connection close requested");
-              done = 1;
-            }
-          }
-          else
-          {
-            char buffer[256];
-
-            sprintf(buffer,
-                    "service '%s' not registered properly (func == NULL)",
-                    req->path);
-            log_debug(buffer);
-            httpd_send_internal_error(rconn, buffer);
-          }
-        }
-        else
-        {
-          char *template =
-            "<html>"
-            "<head>"
-            "<title>Unauthorized</title>"
-            "</head>"
-            "<body>"
-            "<h1>Unauthorized request logged</h1>"
-            "</body>"
-            "</html>";
-
-          if (authdata)
-          {
-            httpd_set_header(rconn, HEADER_WWW_AUTHENTICATE, authdata);
-            free(authdata);
-          }
-
-          char templsz[1024];
-          sprintf(templsz, "%lu", (unsigned long)strlen(template));
-
-          httpd_set_header(rconn, HEADER_CONTENT_LENGTH, templsz);
-          httpd_set_header(rconn, HEADER_CONTENT_TYPE, "text/html");
-
-          httpd_send_header(rconn, 401, "Unauthorized");
-          http_output_stream_write_string(rconn->out, template);
-          done = 1;
-        }
-      }
-      else
-      {
-        char buffer[256];
-        sprintf(buffer, "no service for '%s' found", req->path);
-        log_debug(buffer);
-        httpd_send_internal_error(rconn, buffer);
-        done = 1;
-      }
-      hrequest_free(req);
+      /* the next request gets fresh deadlines */
+      conn->deadline = DEADLINE_NONE;
+      _httpd_conn_process(conn, 0);
     }
   }
 
-  httpd_free(rconn);
-
-  hsocket_close(&(conn->sock));
-
-#ifdef WIN32
-  CloseHandle((HANDLE) conn->tid);
-#else
-  pthread_attr_destroy(&(conn->attr));
-#endif
-
-  conn->flag = CONNECTION_FREE;
-
-#ifdef WIN32
-  _endthread();
-  return 0;
-#else
-  /* pthread_exits automagically */
-  return NULL;
-#endif
+  return;
 }
 
-int
-httpd_set_header(httpd_conn_t * conn, const char *key, const char *value)
+/*--------------------------------------------------
+FUNCTION: _httpd_pool_init
+----------------------------------------------------*/
+static herror_t
+_httpd_pool_init(void)
 {
-  hpair_t *p;
+  herror_t status;
+  int i, err;
 
-  if (conn == NULL)
+  if (_httpd_workers < 1)
   {
-    log_warn("Connection object is NULL");
-    return 0;
+    log_warn("at least one worker is needed (was %d)", _httpd_workers);
+    _httpd_workers = 1;
   }
 
-  for (p = conn->header; p; p = p->next)
+  if ((status = hqueue_init(&_httpd_pool.queue, _httpd_max_connections))
+      != H_OK)
+    return status;
+
+  sem_init(&_httpd_pool.ready, 0, 0);
+
+  if (!(_httpd_pool.workers =
+        (httpd_worker_t *) calloc(_httpd_workers, sizeof(httpd_worker_t))))
+    return herror_new("_httpd_pool_init", THREAD_BEGIN_ERROR,
+                      "calloc failed (%s)", strerror(errno));
+
+  for (i = 0; i < _httpd_workers; i++)
   {
-    if (p->key && !strcmp(p->key, key))
+    if ((err = pthread_create(&(_httpd_pool.workers[i].tid),
+                              &_httpd_thread_attr, _httpd_worker_main,
+                              &(_httpd_pool.workers[i]))))
     {
-      free(p->value);
-      p->value = strdup(value);
-      return 1;
+      /* only the workers started are joined */
+      _httpd_workers = i;
+      return herror_new("_httpd_pool_init", THREAD_BEGIN_ERROR,
+                        "pthread_create failed (%s)", strerror(err));
     }
   }
 
-  conn->header = hpairnode_new(key, value, conn->header);
+  log_info("started %d worker threads", _httpd_workers);
 
-  return 0;
+  return H_OK;
 }
 
-void
-httpd_set_headers(httpd_conn_t * conn, hpair_t * header)
+/*--------------------------------------------------
+FUNCTION: _httpd_pool_stop
+DESC: Stops the workers and waits for them to return.
+Requests in progress fail on their shut down sockets,
+requests still queued are dropped. Runs after the
+reactors stopped.
+----------------------------------------------------*/
+static void
+_httpd_pool_stop(void)
 {
-  while (header)
+  httpd_pool_stats_t stats;
+  int i;
+
+  httpd_get_pool_stats(&stats);
+  log_info("worker pool: %lu requests, max queue depth %ld, "
+           "avg wait %llu usec, max wait %lu usec, %lu refused",
+           stats.dispatched, stats.queue_depth_max,
+           stats.dispatched ? stats.wait_total / stats.dispatched : 0,
+           stats.wait_max, stats.shed);
+
+  _httpd_run = 0;
+
+  /* no reactor enforces the deadlines anymore */
+  for (i = 0; i < _httpd_max_connections; i++)
   {
-    httpd_set_header(conn, header->key, header->value);
-    header = header->next;
+    if (_httpd_connection[i].flag == CONNECTION_DISPATCHED)
+      shutdown(_httpd_connection[i].sock.sock, SHUT_RDWR);
   }
-}
 
-int
-httpd_add_header(httpd_conn_t * conn, const char *key, const char *value)
-{
-  if (!conn)
+  for (i = 0; i < _httpd_workers; i++)
+    sem_post(&_httpd_pool.ready);
+
+  for (i = 0; i < _httpd_workers; i++)
+    pthread_join(_httpd_pool.workers[i].tid, NULL);
+
+  /* connections handed back or left in the queue */
+  for (i = 0; i < _httpd_max_connections; i++)
   {
-    log_warn("Connection object is NULL");
-    return 0;
+    if (_httpd_connection[i].flag == CONNECTION_DISPATCHED)
+      _httpd_conn_close(&_httpd_connection[i]);
   }
 
-  conn->header = hpairnode_new(key, value, conn->header);
+  free(_httpd_pool.workers);
+  _httpd_pool.workers = NULL;
 
-  return 1;
+  return;
 }
 
-void
-httpd_add_headers(httpd_conn_t * conn, const hpair_t * values)
+/*--------------------------------------------------
+FUNCTION: _httpd_reactor_init
+----------------------------------------------------*/
+static herror_t
+_httpd_reactor_init(httpd_reactor_t * reactor)
 {
-  if (!conn)
-  {
-    log_warn("Connection object is NULL");
-    return;
-  }
+  struct epoll_event ev;
+  herror_t status;
 
-  while (values)
+  reactor->paused = 0;
+  reactor->resumed = NULL;
+  reactor->cpu = -1;
+  pthread_mutex_init(&(reactor->lock), NULL);
+  htimer_wheel_init(&(reactor->timers));
+
+  if ((status = hsocket_listen_backlog(&(reactor->listener), _httpd_backlog))
+      != H_OK)
+    return status;
+
+  if ((status = hsocket_set_nonblocking(&(reactor->listener))) != H_OK)
+    return status;
+
+  /* requests usually arrive with the handshake's last ACK */
+  if (_httpd_defer_accept > 0 &&
+      (status = hsocket_defer_accept(&(reactor->listener),
+                                     _httpd_defer_accept)) != H_OK)
   {
-    httpd_add_header(conn, values->key, values->value);
-    values = values->next;
+    log_warn("hsocket_defer_accept failed (%s)", herror_message(status));
+    herror_release(status);
   }
-  return;
-}
 
-/*
- * -----------------------------------------------------
- * FUNCTION: httpd_term
- * -----------------------------------------------------
- */
-#ifdef WIN32
-BOOL WINAPI
-httpd_term(DWORD sig)
-{
-  /* log_debug ("Got signal %d", sig); */
-  if (sig == _httpd_terminate_signal)
-    _httpd_run = 0;
+  if ((reactor->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    return herror_new("_httpd_reactor_init", THREAD_BEGIN_ERROR,
+                      "epoll_create1 failed (%s)", strerror(errno));
 
-  return TRUE;
-}
-#else
-void
-httpd_term(int sig)
-{
-  log_debug("Got signal %d", sig);
+  if ((reactor->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    return herror_new("_httpd_reactor_init", THREAD_BEGIN_ERROR,
+                      "eventfd failed (%s)", strerror(errno));
 
-  if (sig == _httpd_terminate_signal)
-    _httpd_run = 0;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &(reactor->wakefd);
+  if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakefd, &ev) == -1)
+    return herror_new("_httpd_reactor_init", THREAD_BEGIN_ERROR,
+                      "epoll_ctl failed (%s)", strerror(errno));
 
-  return;
+  _httpd_listener_arm(reactor, EPOLL_CTL_ADD);
+
+  return H_OK;
 }
-#endif
 
-/*
- * -----------------------------------------------------
- * FUNCTION: _httpd_register_signal_handler
- * -----------------------------------------------------
- */
+/*--------------------------------------------------
+FUNCTION: _httpd_reactor_pin
+DESC: Binds the calling reactor thread to one CPU.
+----------------------------------------------------*/
 static void
-_httpd_register_signal_handler(void)
+_httpd_reactor_pin(httpd_reactor_t * reactor)
 {
-  log_debug("registering termination signal handler (SIGNAL:%d)",
-               _httpd_terminate_signal);
-#ifdef WIN32
-  if (SetConsoleCtrlHandler((PHANDLER_ROUTINE) httpd_term, TRUE) == FALSE)
+#ifdef LINUX
+  cpu_set_t set;
+  long ncpu;
+  int err;
+
+  if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+    return;
+
+  reactor->cpu = (reactor - _httpd_reactors) % ncpu;
+
+  CPU_ZERO(&set);
+  CPU_SET(reactor->cpu, &set);
+
+  if ((err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)))
   {
-    log_error("Unable to install console event handler!");
+    log_warn("cannot pin listener to CPU %d (%s)", reactor->cpu,
+             strerror(err));
+    reactor->cpu = -1;
   }
-
-#else
-  signal(_httpd_terminate_signal, httpd_term);
 #endif
 
   return;
 }
 
 /*--------------------------------------------------
-FUNCTION: _httpd_wait_for_empty_conn
+FUNCTION: _httpd_reactor_main
+DESC: Event loop of one listener. Runs until the
+server stops.
 ----------------------------------------------------*/
-static conndata_t *
-_httpd_wait_for_empty_conn(void)
+static void *
+_httpd_reactor_main(void *data)
 {
-  int i;
+  struct epoll_event events[HTTPD_MAX_EVENTS];
+  httpd_reactor_t *reactor;
+  int i, n;
 
-#ifdef WIN32
-  WaitForSingleObject(_httpd_connection_lock, INFINITE);
-#else
-  pthread_mutex_lock(&_httpd_connection_lock);
-#endif
-  for (i = 0;; i++)
-  {
-    if (!_httpd_run)
-    {
+  reactor = (httpd_reactor_t *) data;
 
-#ifdef WIN32
-	  ReleaseMutex(_httpd_connection_lock);
-#else
-      pthread_mutex_unlock(&_httpd_connection_lock);
-#endif
-      return NULL;
-    }
+  if (_httpd_pin_cpus)
+    _httpd_reactor_pin(reactor);
+
+  log_debug("listener %d running on socket %d (cpu %d)",
+            (int) (reactor - _httpd_reactors), reactor->listener.sock,
+            reactor->cpu);
 
-    if (i >= _httpd_max_connections)
+  while (_httpd_run)
+  {
+    /* wake up every tick only while deadlines are pending */
+    if ((n = epoll_wait(reactor->epfd, events, HTTPD_MAX_EVENTS,
+                        reactor->timers.count ? HTIMER_TICK_MS :
+                        1000)) == -1)
     {
-      system_sleep(1);
-      i = -1;
+      if (errno != EINTR)
+        log_error("epoll_wait failed (%s)", strerror(errno));
+      n = 0;
     }
-    else if (_httpd_connection[i].flag == CONNECTION_FREE)
+
+    for (i = 0; i < n && _httpd_run; i++)
     {
-      _httpd_connection[i].flag = CONNECTION_IN_USE;
-      break;
+      if (events[i].data.ptr == &(reactor->listener))
+        _httpd_accept_connections(reactor);
+      else if (events[i].data.ptr == &(reactor->wakefd))
+        _httpd_process_resumed(reactor);
+      else
+        _httpd_conn_readable((conndata_t *) events[i].data.ptr);
     }
-  }
-#ifdef WIN32
-	  ReleaseMutex(_httpd_connection_lock);
-#else
-      pthread_mutex_unlock(&_httpd_connection_lock);
-#endif
-
-  return &_httpd_connection[i];
-}
-
-/*
- * -----------------------------------------------------
- * FUNCTION: _httpd_start_thread
- * -----------------------------------------------------
- */
-static void
-_httpd_start_thread(conndata_t * conn)
-{
-  int err;
 
-#ifdef WIN32
-  conn->tid =
-    (HANDLE) _beginthreadex(NULL, 65535, httpd_session_main, conn, 0, &err);
-#else
-  pthread_attr_init(&(conn->attr));
+    htimer_advance(&(reactor->timers), _httpd_conn_expired);
 
-#ifdef PTHREAD_CREATE_DETACHED
-  pthread_attr_setdetachstate(&(conn->attr), PTHREAD_CREATE_DETACHED);
-#endif
+    /* a slot may have been freed while another reactor paused */
+    if (reactor->paused && hqueue_depth(&_httpd_free_slots) > 0)
+      _httpd_reactor_unpause(reactor);
+  }
 
-  pthread_sigmask(SIG_BLOCK, &thrsigset, NULL);
-  if ((err =
-       pthread_create(&(conn->tid), &(conn->attr), httpd_session_main, conn)))
-    log_error("pthread_create failed (%s)", strerror(err));
-#endif
+  /* connections still in a worker are left to it */
+  for (i = 0; i < _httpd_max_connections; i++)
+  {
+    if (_httpd_connection[i].flag == CONNECTION_IN_USE &&
+        _httpd_connection[i].reactor == reactor)
+      _httpd_conn_close(&_httpd_connection[i]);
+  }
 
-  return;
+  return NULL;
 }
 
 
@@ -976,78 +2573,59 @@ _httpd_start_thread(conndata_t * conn)
 herror_t
 httpd_run(void)
 {
-  struct timeval timeout;
-  conndata_t *conn;
   herror_t err;
-  fd_set fds;
+  int i, started;
 
   log_debug("starting run routine");
 
-#ifndef WIN32
-  sigemptyset(&thrsigset);
-  sigaddset(&thrsigset, SIGALRM);
-#endif
+  pthread_attr_init(&_httpd_thread_attr);
+  pthread_attr_setdetachstate(&_httpd_thread_attr, PTHREAD_CREATE_JOINABLE);
 
   _httpd_register_signal_handler();
 
-  if ((err = hsocket_listen(&_httpd_socket)) != H_OK)
+  if ((err = _httpd_services_compile()) != H_OK)
   {
-    log_error("hsocket_listen failed (%s)", herror_message(err));
+    log_error("_httpd_services_compile failed (%s)", herror_message(err));
     return err;
   }
 
-  while (_httpd_run)
+  if ((err = _httpd_pool_init()) != H_OK)
   {
-    conn = _httpd_wait_for_empty_conn();
-    if (!_httpd_run)
-      break;
+    log_error("_httpd_pool_init failed (%s)", herror_message(err));
+    return err;
+  }
 
-    /* Wait for a socket to accept */
-    while (_httpd_run)
+  for (i = 0; i < _httpd_listeners; i++)
+  {
+    if ((err = _httpd_reactor_init(&_httpd_reactors[i])) != H_OK)
     {
-
-      /* set struct timeval to the proper timeout */
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
-
-      /* zero and set file descriptior */
-      FD_ZERO(&fds);
-      FD_SET(_httpd_socket.sock, &fds);
-
-      /* select socket descriptor */
-      switch (select(_httpd_socket.sock + 1, &fds, NULL, NULL, &timeout))
-      {
-      case 0:
-        /* descriptor is not ready */
-        continue;
-      case -1:
-        /* got a signal? */
-        continue;
-      default:
-        /* no nothing */
-        break;
-      }
-      if (FD_ISSET(_httpd_socket.sock, &fds))
-      {
-        break;
-      }
+      log_error("_httpd_reactor_init failed (%s)", herror_message(err));
+      return err;
     }
+  }
 
-    /* check signal status */
-    if (!_httpd_run)
+  /* the calling thread runs the first listener itself */
+  for (started = 1; started < _httpd_listeners; started++)
+  {
+    if ((i = pthread_create(&(_httpd_reactors[started].tid), NULL,
+                            _httpd_reactor_main,
+                            &_httpd_reactors[started])))
+    {
+      log_error("pthread_create failed (%s)", strerror(i));
+      _httpd_run = 0;
       break;
+    }
+  }
 
-    if ((err = hsocket_accept(&_httpd_socket, &(conn->sock))) != H_OK)
-    {
-      log_error("hsocket_accept failed (%s)", herror_message(err));
+  if (_httpd_listeners > 1)
+    log_info("accepting on %d listeners", _httpd_listeners);
 
-      hsocket_close(&(conn->sock));
+  _httpd_reactor_main(&_httpd_reactors[0]);
 
-      continue;
-    }
+  for (i = 1; i < started; i++)
+    pthread_join(_httpd_reactors[i].tid, NULL);
 
-    _httpd_start_thread(conn);
-  }
+  _httpd_pool_stop();
 
   return 0;
 }
@@ -1056,6 +2634,10 @@ void
 httpd_destroy(void)
 {
   hservice_t *tmp, *cur = _httpd_services_head;
+  int i;
+
+  free(_httpd_service_table);
+  _httpd_service_table = NULL;
 
   while (cur != NULL)
   {
@@ -1065,8 +2647,14 @@ httpd_destroy(void)
   }
 
   hsocket_module_destroy();
+  session_store_free();
+  ntlm_auth_pool_destroy();
 
+  for (i = 0; i < _httpd_max_connections; i++)
+    harena_free(&(_httpd_connection[i].arena));
   free(_httpd_connection);
+  free(_httpd_reactors);
+  hqueue_destroy(&_httpd_free_slots);
 
   return;
 }
@@ -1129,7 +2717,7 @@ httpd_get_postdata(httpd_conn_t * conn, hrequest_t * req, long *received,
   {
 
     content_length_str =
-      hpairnode_get_ignore_case(req->header, HEADER_CONTENT_LENGTH);
+      hrequest_get_header(req, HHEADER_CONTENT_LENGTH);
 
     if (content_length_str != NULL)
       content_length = atol(content_length_str);
@@ -1281,41 +2869,33 @@ httpd_mime_send_file(httpd_conn_t * conn, const char *content_id,
                      const char *content_type, const char *transfer_encoding,
                      const char *filename)
 {
-  byte_t buffer[MAX_FILE_BUFFER_SIZE];
   herror_t status;
-  FILE *fd;
-  size_t size;
+  struct stat st;
+  int fd;
 
-  if ((fd = fopen(filename, "rb")) == NULL)
+  if ((fd = open(filename, O_RDONLY)) == -1)
     return herror_new("httpd_mime_send_file", FILE_ERROR_OPEN,
-                      "Can not open file '%d'", filename);
+                      "Can not open file '%s'", filename);
+
+  if (fstat(fd, &st) == -1)
+  {
+    close(fd);
+    return herror_new("httpd_mime_send_file", FILE_ERROR_READ,
+                      "Can not stat file '%s'", filename);
+  }
 
   status = httpd_mime_next(conn, content_id, content_type, transfer_encoding);
   if (status != H_OK)
   {
-    fclose(fd);
+    close(fd);
     return status;
   }
 
-  while (!feof(fd))
-  {
-    size = fread(buffer, 1, MAX_FILE_BUFFER_SIZE, fd);
-    if (size == -1)
-    {
-      fclose(fd);
-      return herror_new("httpd_mime_send_file", FILE_ERROR_READ,
-                        "Can not read from file '%d'", filename);
-    }
-
-    if ((status = http_output_stream_write(conn->out, buffer, size)) != H_OK)
-    {
-      fclose(fd);
-      return status;
-    }
-  }
+  /* the kernel copies the file to the socket */
+  status = http_output_stream_write_file(conn->out, fd, 0, st.st_size);
 
-  fclose(fd);
-  return H_OK;
+  close(fd);
+  return status;
 }
 
 /**
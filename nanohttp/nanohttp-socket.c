@@ -24,15 +24,23 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 
+#ifdef LINUX
+#include <sys/sendfile.h>
+#endif
+
 #ifdef WIN32
 #include "wsockcompat.h"
 #include <winsock2.h>
@@ -55,6 +63,10 @@ typedef int ssize_t;
 
 #include <log.h>
 
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 #ifdef WIN32
 static inline void
 _hsocket_module_sys_init(int argc, char **argv)
@@ -167,6 +179,9 @@ hsocket_open(hsocket_t * dsock, const char *hostname, int port, int ssl)
     return herror_new("hsocket_open", HSOCKET_ERROR_CONNECT,
                       "Socket error (%s)", strerror(errno));
 
+  /* nothing else bounds how long a client waits for the server */
+  dsock->timeout = httpd_get_timeout();
+
   if (ssl)
   {
     herror_t status;
@@ -182,10 +197,10 @@ hsocket_open(hsocket_t * dsock, const char *hostname, int port, int ssl)
 }
 
 /*--------------------------------------------------
-FUNCTION: hsocket_bind
+FUNCTION: _hsocket_bind
 ----------------------------------------------------*/
-herror_t
-hsocket_bind(hsocket_t * dsock, int port)
+static herror_t
+_hsocket_bind(hsocket_t * dsock, int port, int shared)
 {
   hsocket_t sock;
   struct sockaddr_in addr;
@@ -200,6 +215,26 @@ hsocket_bind(hsocket_t * dsock, int port)
   }
 
   setsockopt(sock.sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+#ifdef SO_REUSEPORT
+  /* the kernel balances connections across all sockets on the port */
+  if (shared &&
+      setsockopt(sock.sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+  {
+    log_error("Cannot share port %d (%s)", port, strerror(errno));
+    close(sock.sock);
+    return herror_new("hsocket_bind", HSOCKET_ERROR_BIND,
+                      "Socket error (%s)", strerror(errno));
+  }
+#else
+  if (shared)
+  {
+    close(sock.sock);
+    return herror_new("hsocket_bind", HSOCKET_ERROR_BIND,
+                      "SO_REUSEPORT is not supported");
+  }
+#endif
+
   /* bind socket */
   addr.sin_family = AF_INET;
   addr.sin_port = htons((unsigned short) port); /* short, network byte order */
@@ -217,6 +252,24 @@ hsocket_bind(hsocket_t * dsock, int port)
   return H_OK;
 }
 
+/*--------------------------------------------------
+FUNCTION: hsocket_bind
+----------------------------------------------------*/
+herror_t
+hsocket_bind(hsocket_t * dsock, int port)
+{
+  return _hsocket_bind(dsock, port, 0);
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_bind_shared
+----------------------------------------------------*/
+herror_t
+hsocket_bind_shared(hsocket_t * dsock, int port)
+{
+  return _hsocket_bind(dsock, port, 1);
+}
+
 #ifdef WIN32
 static herror_t
 _hsocket_sys_accept(hsocket_t * sock, hsocket_t * dest)
@@ -294,17 +347,76 @@ hsocket_accept(hsocket_t * sock, hsocket_t * dest)
   return H_OK;
 }
 
+/*----------------------------------------------------------
+FUNCTION: hsocket_accept_pending
+----------------------------------------------------------*/
+int
+hsocket_accept_pending(hsocket_t * sock, hsocket_t * dest)
+{
+  socklen_t len;
+
+  if (sock->sock < 0)
+    return -1;
+
+  hsocket_init(dest);
+  len = sizeof(struct sockaddr_in);
+
+  if ((dest->sock =
+       accept(sock->sock, (struct sockaddr *) &(dest->addr), &len)) == -1)
+  {
+    dest->sock = HSOCKET_FREE;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+        errno == ECONNABORTED)
+      return 0;
+
+    log_warn("accept failed (%s)", strerror(errno));
+    return -1;
+  }
+
+  log_debug("accepting connection from '%s' socket=%d",
+               SAVE_STR(((char *) inet_ntoa(dest->addr.sin_addr))),
+               dest->sock);
+
+  return 1;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_set_nonblocking
+----------------------------------------------------*/
+herror_t
+hsocket_set_nonblocking(hsocket_t * sock)
+{
+  int flags;
+
+  if ((flags = fcntl(sock->sock, F_GETFL, 0)) == -1 ||
+      fcntl(sock->sock, F_SETFL, flags | O_NONBLOCK) == -1)
+    return herror_new("hsocket_set_nonblocking", HSOCKET_ERROR_IOCTL,
+                      "Socket error (%s)", strerror(errno));
+
+  return H_OK;
+}
+
 /*--------------------------------------------------
 FUNCTION: hsocket_listen
 ----------------------------------------------------*/
 herror_t
 hsocket_listen(hsocket_t * sock)
+{
+  return hsocket_listen_backlog(sock, HSOCKET_LISTEN_BACKLOG);
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_listen_backlog
+----------------------------------------------------*/
+herror_t
+hsocket_listen_backlog(hsocket_t * sock, int backlog)
 {
   if (sock->sock < 0)
     return herror_new("hsocket_listen", HSOCKET_ERROR_NOT_INITIALIZED,
                       "Called hsocket_listen before initializing!");
 
-  if (listen(sock->sock, 15) == -1)
+  if (listen(sock->sock, backlog) == -1)
   {
     log_error("listen failed (%s)", strerror(errno));
     return herror_new("hsocket_listen", HSOCKET_ERROR_LISTEN,
@@ -314,6 +426,24 @@ hsocket_listen(hsocket_t * sock)
   return H_OK;
 }
 
+/*--------------------------------------------------
+FUNCTION: hsocket_defer_accept
+----------------------------------------------------*/
+herror_t
+hsocket_defer_accept(hsocket_t * sock, int seconds)
+{
+#ifdef TCP_DEFER_ACCEPT
+  if (setsockopt(sock->sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds,
+                 sizeof(seconds)) == -1)
+    return herror_new("hsocket_defer_accept", HSOCKET_ERROR_IOCTL,
+                      "Socket error (%s)", strerror(errno));
+#else
+  log_warn("TCP_DEFER_ACCEPT is not supported, ignoring");
+#endif
+
+  return H_OK;
+}
+
 #ifdef WIN32
 static inline void
 _hsocket_sys_close(hsocket_t * sock)
@@ -354,21 +484,114 @@ hsocket_close(hsocket_t * sock)
 
   _hsocket_sys_close(sock);
 
+  free(sock->rbuf);
+  sock->rbuf = NULL;
+  sock->rbuf_size = sock->rbuf_len = sock->rbuf_pos = 0;
+
+  free(sock->wbuf);
+  sock->wbuf = NULL;
+  sock->wbuf_len = 0;
+  sock->corked = 0;
+
   log_debug("socket closed");
 
   return;
 }
 
 /*--------------------------------------------------
-FUNCTION: hsocket_send
+FUNCTION: _hsocket_write
+DESC: Sends 'n' bytes, looping over short writes.
 ----------------------------------------------------*/
-herror_t
-hsocket_nsend(hsocket_t * sock, const byte_t * bytes, int n)
+static herror_t
+_hsocket_write(hsocket_t * sock, const byte_t * bytes, int n)
 {
   herror_t status;
   size_t total = 0;
   size_t size;
 
+  while (n > 0)
+  {
+    if ((status = hssl_write(sock, bytes + total, n, &size)) != H_OK)
+    {
+      log_warn("hssl_write failed (%s)", herror_message(status));
+      return status;
+    }
+
+    n -= size;
+    total += size;
+  }
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hsocket_writev
+DESC: Sends the write buffer followed by 'n' bytes of
+'bytes' with as few syscalls as the kernel allows.
+----------------------------------------------------*/
+static herror_t
+_hsocket_writev(hsocket_t * sock, const byte_t * bytes, int n, int flags)
+{
+  herror_t status;
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t count;
+  int i;
+
+  /* with kTLS the kernel cuts the records, a plain sendmsg() will do */
+  if (sock->ssl && !sock->ktls)
+  {
+    /* one SSL record per buffer, the rest goes out as it is */
+    if ((status = _hsocket_write(sock, sock->wbuf, sock->wbuf_len)) != H_OK)
+      return status;
+    sock->wbuf_len = 0;
+
+    return _hsocket_write(sock, bytes, n);
+  }
+
+  iov[0].iov_base = sock->wbuf;
+  iov[0].iov_len = sock->wbuf_len;
+  iov[1].iov_base = (void *) bytes;
+  iov[1].iov_len = n;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+
+  i = 0;
+  while (i < 2)
+  {
+    if ((count = sendmsg(sock->sock, &msg, flags)) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return herror_new("hsocket_nsend", HSOCKET_ERROR_SEND,
+                        "sendmsg failed (%s)", strerror(errno));
+    }
+
+    /* skip what was sent */
+    for (; i < 2 && (size_t) count >= iov[i].iov_len; i++)
+      count -= iov[i].iov_len;
+
+    if (i < 2)
+    {
+      iov[i].iov_base = (char *) iov[i].iov_base + count;
+      iov[i].iov_len -= count;
+    }
+    msg.msg_iov = iov + i;
+    msg.msg_iovlen = 2 - i;
+  }
+  sock->wbuf_len = 0;
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_send
+----------------------------------------------------*/
+herror_t
+hsocket_nsend(hsocket_t * sock, const byte_t * bytes, int n)
+{
   log_debug("Starting to send on sock=%p", &sock);
   if (sock->sock < 0)
     return herror_new("hsocket_nsend", HSOCKET_ERROR_NOT_INITIALIZED,
@@ -376,22 +599,146 @@ hsocket_nsend(hsocket_t * sock, const byte_t * bytes, int n)
 
   /* log_debug( "SENDING %s", bytes ); */
 
-  while (1)
+  if (!sock->corked)
+    return _hsocket_write(sock, bytes, n);
+
+  if (sock->wbuf_len + n <= HSOCKET_WRITE_BUFFER_SIZE)
   {
+    memcpy(sock->wbuf + sock->wbuf_len, bytes, n);
+    sock->wbuf_len += n;
+    return H_OK;
+  }
 
-    if ((status = hssl_write(sock, bytes + total, n, &size)) != H_OK)
-    {
-      log_warn("hssl_write failed (%s)", herror_message(status));
+  /* buffer full, more will follow before the uncork */
+  return _hsocket_writev(sock, bytes, n, MSG_MORE);
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_cork
+----------------------------------------------------*/
+void
+hsocket_cork(hsocket_t * sock)
+{
+  if (!sock->wbuf &&
+      !(sock->wbuf = (byte_t *) malloc(HSOCKET_WRITE_BUFFER_SIZE)))
+  {
+    /* writes simply stay unbuffered */
+    log_error("malloc failed (%s)", strerror(errno));
+    return;
+  }
+
+  sock->corked = 1;
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_uncork
+----------------------------------------------------*/
+herror_t
+hsocket_uncork(hsocket_t * sock)
+{
+  herror_t status;
+
+  if (!sock->corked)
+    return H_OK;
+
+  sock->corked = 0;
+  if (sock->wbuf_len == 0)
+    return H_OK;
+
+  if (sock->sock < 0)
+    return herror_new("hsocket_uncork", HSOCKET_ERROR_NOT_INITIALIZED,
+                      "hsocket not initialized");
+
+  status = _hsocket_write(sock, sock->wbuf, sock->wbuf_len);
+  sock->wbuf_len = 0;
+
+  return status;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hsocket_copyfile
+DESC: Sends a part of a file through a buffer.
+----------------------------------------------------*/
+static herror_t
+_hsocket_copyfile(hsocket_t * sock, int fd, off_t offset, size_t size)
+{
+  byte_t buffer[HSOCKET_FILE_BUFFER_SIZE];
+  herror_t status;
+  ssize_t count;
+
+  while (size > 0)
+  {
+    count = pread(fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer),
+                  offset);
+    if (count == -1 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return herror_new("hsocket_sendfile", FILE_ERROR_READ,
+                        "pread failed (%s)",
+                        count ? strerror(errno) : "unexpected end of file");
+
+    if ((status = hsocket_nsend(sock, buffer, count)) != H_OK)
       return status;
+
+    offset += count;
+    size -= count;
+  }
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_sendfile
+----------------------------------------------------*/
+herror_t
+hsocket_sendfile(hsocket_t * sock, int fd, off_t offset, size_t size)
+{
+#ifdef LINUX
+  herror_t status;
+  ssize_t count;
+#endif
+
+  if (sock->sock < 0)
+    return herror_new("hsocket_sendfile", HSOCKET_ERROR_NOT_INITIALIZED,
+                      "hsocket not initialized");
+
+#ifdef LINUX
+  /* OpenSSL has to see every byte */
+  if (sock->ssl && !sock->ktls)
+    return _hsocket_copyfile(sock, fd, offset, size);
+
+  /* what was written before goes first, the file completes the segment */
+  if (sock->wbuf_len > 0 &&
+      (status = _hsocket_writev(sock, NULL, 0, MSG_MORE)) != H_OK)
+    return status;
+
+  while (size > 0)
+  {
+    if ((count = sendfile(sock->sock, fd, &offset, size)) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      /* file systems which can't do it */
+      if (errno == EINVAL || errno == ENOSYS)
+        return _hsocket_copyfile(sock, fd, offset, size);
+      return herror_new("hsocket_sendfile", HSOCKET_ERROR_SEND,
+                        "sendfile failed (%s)", strerror(errno));
     }
 
-    n -= size;
-    total += size;
-    if (n <= 0)
-      break;
+    /* the file shrank, the promised framing can't be kept */
+    if (count == 0)
+      return herror_new("hsocket_sendfile", FILE_ERROR_READ,
+                        "unexpected end of file");
+
+    size -= count;
   }
 
   return H_OK;
+#else
+  return _hsocket_copyfile(sock, fd, offset, size);
+#endif
 }
 
 /*--------------------------------------------------
@@ -403,23 +750,40 @@ hsocket_send(hsocket_t * sock, const char *str)
   return hsocket_nsend(sock, str, strlen(str));
 }
 
+/*--------------------------------------------------
+FUNCTION: hsocket_wait_read
+DESC: Waits at most 'timeout' seconds for data on
+'sock'. Returns -1 with errno set to ETIMEDOUT if
+none arrived. Does not wait if 'timeout' is 0.
+----------------------------------------------------*/
 int
-hsocket_select_read(int sock, char *buf, size_t len)
+hsocket_wait_read(int sock, int timeout)
 {
-  struct timeval timeout;
-  fd_set fds;
+  struct pollfd pfd;
   int ret;
-  FD_ZERO(&fds);
-  FD_SET(sock, &fds);
-  timeout.tv_sec = httpd_get_timeout();
-  timeout.tv_usec = 0;
-  ret = select(sock + 1, &fds, NULL, NULL, &timeout);
+
+  if (timeout <= 0)
+    return 0;
+
+  /* select() cannot watch descriptors past FD_SETSIZE */
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  ret = poll(&pfd, 1, timeout * 1000);
   if (ret == 0)
   {
     errno = ETIMEDOUT;
     log_debug("Socket %d timeout", sock);
     return -1;
   }
+  return 0;
+}
+
+int
+hsocket_select_read(int sock, char *buf, size_t len, int timeout)
+{
+  if (hsocket_wait_read(sock, timeout) == -1)
+    return -1;
 #ifdef WIN32
   return recv(sock, buf, len, 0);
 #else
@@ -427,6 +791,233 @@ hsocket_select_read(int sock, char *buf, size_t len)
 #endif
 }
 
+/*--------------------------------------------------
+FUNCTION: _hsocket_buffer_reserve
+DESC: Moves unread bytes to the front of the read-ahead
+buffer and grows it if it is full. Returns the free
+space, which is 0 once 'limit' is reached, or -1.
+----------------------------------------------------*/
+static int
+_hsocket_buffer_reserve(hsocket_t * sock, int limit)
+{
+  byte_t *tmp;
+  int size;
+
+  if (sock->rbuf_pos > 0)
+  {
+    memmove(sock->rbuf, sock->rbuf + sock->rbuf_pos,
+            sock->rbuf_len - sock->rbuf_pos);
+    sock->rbuf_len -= sock->rbuf_pos;
+    sock->rbuf_pos = 0;
+  }
+
+  if (sock->rbuf_len == sock->rbuf_size && sock->rbuf_size < limit)
+  {
+    size = sock->rbuf_size ? sock->rbuf_size * 2 : HSOCKET_READAHEAD_SIZE;
+    if (size > limit)
+      size = limit;
+
+    if (!(tmp = (byte_t *) realloc(sock->rbuf, size)))
+    {
+      log_error("realloc failed (%s)", strerror(errno));
+      return -1;
+    }
+    sock->rbuf = tmp;
+    sock->rbuf_size = size;
+  }
+
+  return sock->rbuf_size - sock->rbuf_len;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_read_ahead
+----------------------------------------------------*/
+int
+hsocket_read_ahead(hsocket_t * sock, int limit, int *closed)
+{
+  int space, count, total;
+
+  *closed = 0;
+
+  if (sock->ssl)
+    return 0;
+
+  total = 0;
+  while (1)
+  {
+    if ((space = _hsocket_buffer_reserve(sock, limit)) == -1)
+      return -1;
+
+    if (space == 0)
+      break;
+
+    count = recv(sock->sock, sock->rbuf + sock->rbuf_len, space,
+                 MSG_DONTWAIT);
+
+    if (count > 0)
+    {
+      sock->rbuf_len += count;
+      total += count;
+    }
+    else if (count == 0)
+    {
+      *closed = 1;
+      break;
+    }
+    else if (errno == EINTR)
+      continue;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      break;
+    else
+    {
+      log_debug("recv failed on socket %d (%s)", sock->sock,
+                strerror(errno));
+      return -1;
+    }
+  }
+
+  return total;
+}
+
+/*--------------------------------------------------
+FUNCTION: _hsocket_fill
+DESC: One blocking read into the read-ahead buffer.
+'count' is 0 if the peer closed the connection.
+----------------------------------------------------*/
+static herror_t
+_hsocket_fill(hsocket_t * sock, int limit, size_t * count)
+{
+  herror_t status;
+  int space;
+
+  if ((space = _hsocket_buffer_reserve(sock, limit)) == -1)
+    return herror_new("hsocket_fill", HSOCKET_ERROR_RECEIVE,
+                      "Cannot allocate read-ahead buffer");
+
+  if (space == 0)
+    return herror_new("hsocket_fill", HSOCKET_ERROR_RECEIVE,
+                      "Read-ahead buffer exhausted (limit=%d)", limit);
+
+  if ((status = hssl_read(sock, (char *) sock->rbuf + sock->rbuf_len, space,
+                          count)) != H_OK)
+    return status;
+
+  sock->rbuf_len += *count;
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_fill
+----------------------------------------------------*/
+herror_t
+hsocket_fill(hsocket_t * sock, int limit)
+{
+  herror_t status;
+  size_t count;
+
+  if ((status = _hsocket_fill(sock, limit, &count)) != H_OK)
+    return status;
+
+  if (count == 0)
+    return herror_new("hsocket_fill", HSOCKET_ERROR_RECEIVE,
+                      "Connection closed by peer");
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_header_length
+----------------------------------------------------*/
+int
+hsocket_header_length(hsocket_t * sock)
+{
+  const byte_t *buf, *p;
+  int len, pos;
+
+  buf = sock->rbuf + sock->rbuf_pos;
+  len = sock->rbuf_len - sock->rbuf_pos;
+
+  /* stray line breaks between messages */
+  for (pos = 0; pos < len && (buf[pos] == '\r' || buf[pos] == '\n'); pos++)
+    ;
+
+  while ((p = memchr(buf + pos, '\n', len - pos)))
+  {
+    pos = p - buf + 1;
+
+    if (pos < len && buf[pos] == '\n')
+      return pos + 1;
+
+    if (pos + 1 < len && buf[pos] == '\r' && buf[pos + 1] == '\n')
+      return pos + 2;
+  }
+
+  return 0;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_read_header
+----------------------------------------------------*/
+herror_t
+hsocket_read_header(hsocket_t * sock, int max, char **header)
+{
+  herror_t status;
+  int len;
+
+  while (!(len = hsocket_header_length(sock)))
+  {
+    if (hsocket_buffered(sock) >= max)
+      return herror_new("hsocket_read_header", GENERAL_HEADER_PARSE_ERROR,
+                        "Header exceeds %d bytes", max);
+
+    if ((status = hsocket_fill(sock, max > HSOCKET_READAHEAD_SIZE ? max :
+                               HSOCKET_READAHEAD_SIZE)) != H_OK)
+      return status;
+  }
+
+  /* terminate in place, the last byte is the final LF */
+  *header = (char *) sock->rbuf + sock->rbuf_pos;
+  (*header)[len - 1] = '\0';
+
+  sock->rbuf_pos += len;
+  if (sock->rbuf_pos == sock->rbuf_len)
+    sock->rbuf_pos = sock->rbuf_len = 0;
+
+  return H_OK;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_buffered
+----------------------------------------------------*/
+int
+hsocket_buffered(hsocket_t * sock)
+{
+  return sock->rbuf_len - sock->rbuf_pos;
+}
+
+/*--------------------------------------------------
+FUNCTION: hsocket_buffer_release
+----------------------------------------------------*/
+void
+hsocket_buffer_release(hsocket_t * sock)
+{
+  if (sock->rbuf && sock->rbuf_pos >= sock->rbuf_len)
+  {
+    free(sock->rbuf);
+    sock->rbuf = NULL;
+    sock->rbuf_size = sock->rbuf_len = sock->rbuf_pos = 0;
+  }
+
+  if (sock->wbuf && !sock->corked && sock->wbuf_len == 0)
+  {
+    free(sock->wbuf);
+    sock->wbuf = NULL;
+  }
+
+  return;
+}
+
 herror_t
 hsocket_read(hsocket_t * sock, byte_t * buffer, int total, int force,
              int *received)
@@ -438,6 +1029,66 @@ hsocket_read(hsocket_t * sock, byte_t * buffer, int total, int force,
 /* log_debug("Entering hsocket_read(total=%d,force=%d)", total, force); */
 
   totalRead = 0;
+
+  /* serve buffered bytes first */
+  if (sock->rbuf_pos < sock->rbuf_len)
+  {
+    count = sock->rbuf_len - sock->rbuf_pos;
+    if (count > total)
+      count = total;
+
+    memcpy(buffer, sock->rbuf + sock->rbuf_pos, count);
+    sock->rbuf_pos += count;
+
+    if (sock->rbuf_pos == sock->rbuf_len)
+      sock->rbuf_pos = sock->rbuf_len = 0;
+
+    if (!force || count == total)
+    {
+      *received = count;
+      return H_OK;
+    }
+
+    totalRead = count;
+  }
+
+  /* small reads are served from a refilled read-ahead buffer */
+  if (total - totalRead < HSOCKET_READAHEAD_SIZE / 4)
+  {
+    do
+    {
+      if ((status = _hsocket_fill(sock, HSOCKET_READAHEAD_SIZE, &count))
+          != H_OK)
+      {
+        log_warn("hsocket_fill failed (%s)", herror_message(status));
+        return status;
+      }
+
+      if (count == 0)
+      {
+        if (force)
+          return herror_new("hsocket_read", HSOCKET_ERROR_RECEIVE,
+                            "Connection closed by peer");
+        break;
+      }
+
+      count = sock->rbuf_len - sock->rbuf_pos;
+      if (count > total - totalRead)
+        count = total - totalRead;
+
+      memcpy(&buffer[totalRead], sock->rbuf + sock->rbuf_pos, count);
+      sock->rbuf_pos += count;
+      totalRead += count;
+
+      if (sock->rbuf_pos == sock->rbuf_len)
+        sock->rbuf_pos = sock->rbuf_len = 0;
+    }
+    while (force && totalRead < total);
+
+    *received = totalRead;
+    return H_OK;
+  }
+
   do
   {
 
@@ -453,10 +1104,14 @@ hsocket_read(hsocket_t * sock, byte_t * buffer, int total, int force,
     {
       /* log_debug("Leaving !force (received=%d)(status=%d)", *received,
          status); */
-      *received = count;
+      *received = totalRead + count;
       return H_OK;
     }
 
+    if (count == 0)
+      return herror_new("hsocket_read", HSOCKET_ERROR_RECEIVE,
+                        "Connection closed by peer");
+
     totalRead += count;
 
     if (totalRead == total)
@@ -30,15 +30,18 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 //#include <io.h>   TODO bob
 
 #ifdef HAVE_SSL
-#ifdef HAVE_OPENSSL_RAND_H
 #include <openssl/rand.h>
-#endif
-
-#ifdef HAVE_OPENSSL_ERR_H
 #include <openssl/err.h>
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
 #endif
 #endif
 
@@ -55,8 +58,42 @@ static char *certpass = "";
 static char *ca_list = NULL;
 static SSL_CTX *context = NULL;
 
+/* TLS 1.2 suites, forward secret only */
+static char *ciphers = "ECDHE-ECDSA-AES128-GCM-SHA256:"
+  "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:"
+  "ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-CHACHA20-POLY1305:"
+  "ECDHE-RSA-CHACHA20-POLY1305";
+/* TLS 1.3 suites, NULL keeps the library defaults */
+static char *ciphersuites = NULL;
+
 static int enabled = 0;
 
+/* sessions held in the server side cache, 0 turns it off */
+static int _hssl_cache_size = 20480;
+/* seconds a ticket key encrypts new tickets, 0 turns tickets off */
+static int _hssl_ticket_lifetime = 3600;
+/* hand the record layer to the kernel after the handshake */
+static int _hssl_ktls = 0;
+
+/*
+  Session ticket keys. New tickets are encrypted with the current
+  key, tickets under the previous key are still accepted but get
+  renewed. The current key is replaced once it is older than the
+  ticket lifetime.
+ */
+typedef struct _hssl_ticket_key
+{
+  unsigned char name[16];
+  unsigned char aes[32];
+  unsigned char hmac[32];
+  time_t created;
+} hssl_ticket_key_t;
+
+static hssl_ticket_key_t _hssl_keys[2];
+static pthread_mutex_t _hssl_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static hssl_stats_t _hssl_stats;
+
 static int _hssl_dummy_verify_cert(X509 * cert);
 int (*_hssl_verify_cert) (X509 * cert) = _hssl_dummy_verify_cert;
 
@@ -187,6 +224,124 @@ _hssl_cert_verify_callback(int prev_ok, X509_STORE_CTX * ctx)
   }
 }
 
+/* fills a ticket key with fresh random bytes */
+static int
+_hssl_ticket_key_new(hssl_ticket_key_t * key, time_t now)
+{
+  if (RAND_bytes(key->name, sizeof(key->name)) != 1
+      || RAND_bytes(key->aes, sizeof(key->aes)) != 1
+      || RAND_bytes(key->hmac, sizeof(key->hmac)) != 1)
+  {
+    log_error("Cannot generate session ticket key");
+    return 0;
+  }
+
+  key->created = now;
+
+  return 1;
+}
+
+/* retires the current key when it is too old, call with the lock held */
+static void
+_hssl_ticket_keys_rotate(time_t now)
+{
+  hssl_ticket_key_t key;
+
+  if (now - _hssl_keys[0].created < _hssl_ticket_lifetime)
+    return;
+
+  if (!_hssl_ticket_key_new(&key, now))
+    return;
+
+  _hssl_keys[1] = _hssl_keys[0];
+  _hssl_keys[0] = key;
+
+  log_debug("Session ticket key rotated");
+
+  return;
+}
+
+/*
+  Encrypts (enc = 1) or decrypts a session ticket. Returns 1 if the
+  ticket is fine, 2 if it should be renewed, 0 if it is unknown and
+  a full handshake has to be done, -1 on errors.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+_hssl_ticket_key_callback(SSL * ssl, unsigned char *name, unsigned char *iv,
+                          EVP_CIPHER_CTX * ectx, EVP_MAC_CTX * hctx, int enc)
+#else
+static int
+_hssl_ticket_key_callback(SSL * ssl, unsigned char *name, unsigned char *iv,
+                          EVP_CIPHER_CTX * ectx, HMAC_CTX * hctx, int enc)
+#endif
+{
+  hssl_ticket_key_t key;
+  int ret, i;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[3];
+#endif
+
+  pthread_mutex_lock(&_hssl_keys_lock);
+
+  _hssl_ticket_keys_rotate(time(NULL));
+
+  if (enc)
+  {
+    key = _hssl_keys[0];
+    ret = 1;
+  }
+  else
+  {
+    for (i = 0; i < 2; i++)
+    {
+      if (!memcmp(name, _hssl_keys[i].name, sizeof(key.name)))
+        break;
+    }
+
+    ret = i < 2 ? i + 1 : 0;
+
+    if (ret)
+      key = _hssl_keys[i];
+  }
+
+  pthread_mutex_unlock(&_hssl_keys_lock);
+
+  if (!ret)
+    return 0;
+
+  if (enc)
+  {
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+      return -1;
+
+    memcpy(name, key.name, sizeof(key.name));
+
+    if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv))
+      return -1;
+  }
+  else if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv))
+  {
+    return -1;
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac,
+                                                sizeof(key.hmac));
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                               "SHA256", 0);
+  params[2] = OSSL_PARAM_construct_end();
+
+  if (!EVP_MAC_CTX_set_params(hctx, params))
+    return -1;
+#else
+  if (!HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL))
+    return -1;
+#endif
+
+  return ret;
+}
+
 void
 hssl_set_certificate(char *c)
 {
@@ -205,6 +360,18 @@ hssl_set_ca(char *c)
   ca_list = c;
 }
 
+void
+hssl_set_ciphers(char *c)
+{
+  ciphers = c;
+}
+
+void
+hssl_set_ciphersuites(char *c)
+{
+  ciphersuites = c;
+}
+
 void
 hssl_enable(void)
 {
@@ -231,6 +398,26 @@ _hssl_parse_arguments(int argc, char **argv)
     {
       ca_list = argv[i];
     }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_CIPHERS))
+    {
+      ciphers = argv[i];
+    }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_CIPHERSUITES))
+    {
+      ciphersuites = argv[i];
+    }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_SSLCACHE))
+    {
+      _hssl_cache_size = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_SSLTICKETS))
+    {
+      _hssl_ticket_lifetime = atoi(argv[i]);
+    }
+    else if (!strcmp(argv[i - 1], NHTTP_ARG_KTLS))
+    {
+      _hssl_ktls = atoi(argv[i]);
+    }
     else if (!strcmp(argv[i - 1], NHTTP_ARG_HTTPS))
     {
       enabled = 1;
@@ -241,6 +428,17 @@ _hssl_parse_arguments(int argc, char **argv)
 }
 
 
+/*
+  Server connections wait for data as long as the socket is open,
+  the server shuts down the sockets of connections past their deadline
+ */
+static BIO *
+_hssl_bio_new(int fd)
+{
+  return BIO_new_socket(fd, BIO_NOCLOSE);
+}
+
+
 static void
 _hssl_library_init(void)
 {
@@ -272,7 +470,11 @@ _hssl_server_context_init(void)
   if (!enabled || !certificate)
     return H_OK;
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  if (!(context = SSL_CTX_new(TLS_server_method())))
+#else
   if (!(context = SSL_CTX_new(SSLv23_method())))
+#endif
   {
     log_error("Cannot create SSL context");
     return herror_new("_hssl_server_context_init", HSSL_ERROR_CONTEXT,
@@ -317,10 +519,80 @@ _hssl_server_context_init(void)
 
   SSL_CTX_set_mode(context, SSL_MODE_AUTO_RETRY);
 
-  SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_options(context, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3
+                      | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1
+                      | SSL_OP_NO_COMPRESSION
+                      | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  SSL_CTX_set_ecdh_auto(context, 1);
+#endif
+
+  if (!SSL_CTX_set_cipher_list(context, ciphers))
+  {
+    log_error("Invalid cipher list: \"%s\"", ciphers);
+    SSL_CTX_free(context);
+    context = NULL;
+    return herror_new("_hssl_server_context_init", HSSL_ERROR_CONTEXT,
+                      "Unable to use cipher list \"%s\"", ciphers);
+  }
+
+#ifdef TLS1_3_VERSION
+  if (ciphersuites && !SSL_CTX_set_ciphersuites(context, ciphersuites))
+  {
+    log_error("Invalid TLS 1.3 cipher suites: \"%s\"", ciphersuites);
+    SSL_CTX_free(context);
+    context = NULL;
+    return herror_new("_hssl_server_context_init", HSSL_ERROR_CONTEXT,
+                      "Unable to use cipher suites \"%s\"", ciphersuites);
+  }
+#endif
 
   _hssl_superseed();
 
+  /* resumed sessions skip client certificate checks of this context */
+  SSL_CTX_set_session_id_context(context, (unsigned char *) "nanohttp", 8);
+
+  if (_hssl_cache_size > 0)
+  {
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(context, _hssl_cache_size);
+  }
+  else
+  {
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+  }
+
+  if (_hssl_ticket_lifetime > 0
+      && _hssl_ticket_key_new(&_hssl_keys[0], time(NULL))
+      && _hssl_ticket_key_new(&_hssl_keys[1], time(NULL)))
+  {
+    /* a ticket outlives its key by at most one rotation */
+    SSL_CTX_set_timeout(context, 2 * _hssl_ticket_lifetime);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(context, _hssl_ticket_key_callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(context, _hssl_ticket_key_callback);
+#endif
+  }
+  else
+  {
+    SSL_CTX_set_options(context, SSL_OP_NO_TICKET);
+  }
+
+  /* OpenSSL falls back to its own record layer if the kernel or
+     the negotiated cipher cannot do it */
+  if (_hssl_ktls)
+  {
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+#else
+    log_warn("kTLS is not supported by this OpenSSL");
+#endif
+  }
+
+  log_debug("session cache %d, ticket lifetime %d, ktls %d",
+            _hssl_cache_size, _hssl_ticket_lifetime, _hssl_ktls);
+
   return H_OK;
 }
 
@@ -328,11 +600,23 @@ _hssl_server_context_init(void)
 static void
 _hssl_server_context_destroy(void)
 {
+  hssl_stats_t stats;
+
   if (context)
   {
+    hssl_get_stats(&stats);
+    log_info("ssl: %lu full handshakes (avg %llu usec), %lu resumed "
+             "(avg %llu usec), %lu failed, %lu in kernel", stats.full,
+             stats.full ? stats.time_full / stats.full : 0, stats.resumed,
+             stats.resumed ? stats.time_resumed / stats.resumed : 0,
+             stats.failed, stats.ktls);
+
     SSL_CTX_free(context);
     context = NULL;
   }
+
+  memset(_hssl_keys, 0, sizeof(_hssl_keys));
+
   return;
 }
 
@@ -372,6 +656,55 @@ hssl_enabled(void)
 }
 
 
+void
+hssl_get_stats(hssl_stats_t * stats)
+{
+  int i;
+
+  stats->full = __atomic_load_n(&_hssl_stats.full, __ATOMIC_RELAXED);
+  stats->resumed = __atomic_load_n(&_hssl_stats.resumed, __ATOMIC_RELAXED);
+  stats->failed = __atomic_load_n(&_hssl_stats.failed, __ATOMIC_RELAXED);
+  stats->ktls = __atomic_load_n(&_hssl_stats.ktls, __ATOMIC_RELAXED);
+  stats->time_full =
+    __atomic_load_n(&_hssl_stats.time_full, __ATOMIC_RELAXED);
+  stats->time_resumed =
+    __atomic_load_n(&_hssl_stats.time_resumed, __ATOMIC_RELAXED);
+
+  for (i = 0; i < HSSL_LATENCY_BUCKETS; i++)
+    stats->latency[i] =
+      __atomic_load_n(&_hssl_stats.latency[i], __ATOMIC_RELAXED);
+
+  return;
+}
+
+
+/* counts a finished server handshake that took 'usec' */
+static void
+_hssl_stats_handshake(SSL * ssl, unsigned long usec)
+{
+  static const unsigned long bounds[] = HSSL_LATENCY_BOUNDS;
+  int i;
+
+  if (SSL_session_reused(ssl))
+  {
+    __atomic_add_fetch(&_hssl_stats.resumed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_hssl_stats.time_resumed, usec, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_add_fetch(&_hssl_stats.full, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_hssl_stats.time_full, usec, __ATOMIC_RELAXED);
+  }
+
+  for (i = 0; i < HSSL_LATENCY_BUCKETS - 1 && usec >= bounds[i] * 1000; i++)
+    ;
+
+  __atomic_add_fetch(&_hssl_stats.latency[i], 1, __ATOMIC_RELAXED);
+
+  return;
+}
+
+
 herror_t
 hssl_client_ssl(hsocket_t * sock)
 {
@@ -416,19 +749,13 @@ hssl_client_ssl(hsocket_t * sock)
   return H_OK;
 }
 
-static int
-_hssl_bio_read(BIO * b, char *out, int outl)
-{
-
-  return hsocket_select_read(b->num, out, outl);;
-}
-
 herror_t
 hssl_server_ssl(hsocket_t * sock)
 {
   SSL *ssl;
   int ret;
   BIO *sbio;
+  struct timespec start, end;
 
   if (!enabled)
     return H_OK;
@@ -443,22 +770,23 @@ hssl_server_ssl(hsocket_t * sock)
   }
   /* SSL_set_fd(ssl, sock->sock); */
 
-  sbio = BIO_new_socket(sock->sock, BIO_NOCLOSE);
-
-  if (sbio == NULL)
+  if (!(sbio = _hssl_bio_new(sock->sock)))
   {
-    log_error("BIO_new_socket failed");
-    return NULL;
+    log_error("BIO_new failed");
+    SSL_free(ssl);
+    return herror_new("hssl_server_ssl", HSSL_ERROR_SERVER,
+                      "Cannot create BIO object");
   }
-  // BIO_set_callback(sbio, hssl_bio_cb);
-  sbio->method->bread = _hssl_bio_read;
   SSL_set_bio(ssl, sbio, sbio);
 
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
   if ((ret = SSL_accept(ssl)) <= 0)
   {
     herror_t err;
 
+    __atomic_add_fetch(&_hssl_stats.failed, 1, __ATOMIC_RELAXED);
+
     log_error("SSL_accept failed (%s)", _hssl_get_error(ssl, ret));
 
     err =
@@ -469,6 +797,16 @@ hssl_server_ssl(hsocket_t * sock)
     return err;
   }
 
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  _hssl_stats_handshake(ssl, (end.tv_sec - start.tv_sec) * 1000000UL
+                        + (end.tv_nsec - start.tv_nsec) / 1000);
+
+#ifdef SSL_OP_ENABLE_KTLS
+  /* from now on plain writes to the socket are sent encrypted */
+  if ((sock->ktls = BIO_get_ktls_send(SSL_get_wbio(ssl))))
+    __atomic_add_fetch(&_hssl_stats.ktls, 1, __ATOMIC_RELAXED);
+#endif
+
   sock->ssl = ssl;
 
   return H_OK;
@@ -483,11 +821,18 @@ hssl_cleanup(hsocket_t * sock)
     SSL_shutdown(sock->ssl);
     SSL_free(sock->ssl);
     sock->ssl = NULL;
+    sock->ktls = 0;
   }
 
   return;
 }
 
+int
+hssl_pending(hsocket_t * sock)
+{
+  return sock->ssl ? SSL_pending(sock->ssl) : 0;
+}
+
 herror_t
 hssl_read(hsocket_t * sock, char *buf, size_t len, size_t * received)
 {
@@ -504,7 +849,8 @@ hssl_read(hsocket_t * sock, char *buf, size_t len, size_t * received)
   }
   else
   {
-    if ((count = hsocket_select_read(sock->sock, buf, len)) == -1)
+    if ((count =
+         hsocket_select_read(sock->sock, buf, len, sock->timeout)) == -1)
       return herror_new("hssl_read", HSOCKET_ERROR_RECEIVE,
                         "recv failed (%s)", strerror(errno));
   }
@@ -521,7 +867,7 @@ hssl_write(hsocket_t * sock, const char *buf, size_t len, size_t * sent)
 
 /*  log_debug("sock->sock=%d, sock->ssl=%p, len=%li", sock->sock, sock->ssl, len); */
 
-  if (sock->ssl)
+  if (sock->ssl && !sock->ktls)
   {
     if ((count = SSL_write(sock->ssl, buf, len)) == -1)
       return herror_new("SSL_write", HSOCKET_ERROR_SEND,
@@ -546,7 +892,8 @@ hssl_read(hsocket_t * sock, char *buf, size_t len, size_t * received)
 {
   int count;
 
-  if ((count = hsocket_select_read(sock->sock, buf, len)) == -1)
+  if ((count =
+       hsocket_select_read(sock->sock, buf, len, sock->timeout)) == -1)
     return herror_new("hssl_read", HSOCKET_ERROR_RECEIVE, "recv failed (%s)",
                       strerror(errno));
   *received = count;
@@ -23,8 +23,12 @@
 ******************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <nanohttp/nanohttp-stream.h>
 
@@ -66,11 +70,26 @@ _http_stream_is_chunked(hpair_t * header)
 http_input_stream_t *
 http_input_stream_new(hsocket_t *sock, hpair_t * header)
 {
-  http_input_stream_t *result;
-  char *content_length;
-
   /* Paranoya check */
   /* if (header == NULL) return NULL; */
+
+  hpairnode_dump_deep(header);
+
+  return http_input_stream_new_framed(sock,
+           hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH),
+           hpairnode_get_ignore_case(header, HEADER_TRANSFER_ENCODING));
+}
+
+/**
+  Creates a new input stream from the already looked up
+  framing headers.
+*/
+http_input_stream_t *
+http_input_stream_new_framed(hsocket_t *sock, const char *content_length,
+                             const char *transfer_encoding)
+{
+  http_input_stream_t *result;
+
   /* Create object */
   if (!(result = (http_input_stream_t *) malloc(sizeof(http_input_stream_t))))
   {
@@ -80,20 +99,21 @@ http_input_stream_new(hsocket_t *sock, hpair_t * header)
 
   result->sock = sock;
   result->err = H_OK;
+  result->zstream = NULL;
+  result->zbuf = NULL;
+  result->zdone = 0;
 
-  /* Find connection type */
-  hpairnode_dump_deep(header);
   /* Check if Content-type */
-  if (_http_stream_is_content_length(header))
+  if (content_length != NULL)
   {
     log_debug("Stream transfer with 'Content-length'");
-    content_length = hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH);
     result->content_length = atoi(content_length);
     result->received = 0;
     result->type = HTTP_TRANSFER_CONTENT_LENGTH;
   }
   /* Check if Chunked */
-  else if (_http_stream_is_chunked(header))
+  else if (transfer_encoding != NULL
+           && !strcmp(transfer_encoding, TRANSFER_ENCODING_CHUNKED))
   {
     log_debug("Stream transfer with 'chunked'");
     result->type = HTTP_TRANSFER_CHUNKED;
@@ -111,6 +131,79 @@ http_input_stream_new(hsocket_t *sock, hpair_t * header)
   return result;
 }
 
+/**
+  Trims the value of the header line at the given offset.
+  Returns the length of the value.
+*/
+static int
+_http_header_value(const char *line, int llen, int offset, const char **value)
+{
+  while (offset < llen && (line[offset] == ' ' || line[offset] == '\t'))
+    offset++;
+
+  while (llen > offset && isspace((unsigned char) line[llen - 1]))
+    llen--;
+
+  *value = line + offset;
+  return llen - offset;
+}
+
+int
+http_input_stream_framing(const char *header, size_t len,
+                          long *content_length)
+{
+  const char *line, *p, *value;
+  int llen, vlen, i, chunked = 0;
+  long length = -1, l;
+
+  for (line = header; line < header + len; line = p + 1)
+  {
+    if (!(p = memchr(line, '\n', header + len - line)))
+      p = header + len;
+    llen = p - line;
+
+    if (llen > 15 && !strncasecmp(line, HEADER_CONTENT_LENGTH ":", 15))
+    {
+      vlen = _http_header_value(line, llen, 15, &value);
+      if (vlen == 0 || vlen > 10)
+        return -1;
+
+      for (i = 0, l = 0; i < vlen; i++)
+      {
+        if (!isdigit((unsigned char) value[i]))
+          return -1;
+        l = l * 10 + value[i] - '0';
+      }
+
+      /* streams count the body in an int */
+      if (l > INT_MAX)
+        return -1;
+
+      if (length != -1 && length != l)
+        return -1;
+      length = l;
+    }
+    else if (llen > 18
+             && !strncasecmp(line, HEADER_TRANSFER_ENCODING ":", 18))
+    {
+      vlen = _http_header_value(line, llen, 18, &value);
+      if (chunked || vlen != 7
+          || strncasecmp(value, TRANSFER_ENCODING_CHUNKED, 7))
+        return -1;
+      chunked = 1;
+    }
+  }
+
+  if (chunked && length != -1)
+    return -1;
+
+  if (chunked)
+    return HTTP_TRANSFER_CHUNKED;
+
+  *content_length = length == -1 ? 0 : length;
+  return HTTP_TRANSFER_CONTENT_LENGTH;
+}
+
 /**
   Creates a new input stream from file. 
   This function was added for MIME messages 
@@ -139,6 +232,9 @@ http_input_stream_new_from_file(const char *filename)
   result->type = HTTP_TRANSFER_FILE;
   result->fd = fd;
   result->deleteOnExit = 0;
+  result->zstream = NULL;
+  result->zbuf = NULL;
+  result->zdone = 0;
   strcpy(result->filename, filename);
 
   return result;
@@ -158,9 +254,56 @@ http_input_stream_free(http_input_stream_t * stream)
     /* remove(stream->filename); */
   }
 
+  if (stream->zstream)
+  {
+    inflateEnd(stream->zstream);
+    free(stream->zstream);
+    free(stream->zbuf);
+  }
+
   free(stream);
 }
 
+/**
+  Makes the stream decompress its body.
+*/
+herror_t
+http_input_stream_inflate(http_input_stream_t * stream,
+                          http_content_encoding_t encoding)
+{
+  z_stream *zs;
+
+  if (encoding != HTTP_CONTENT_ENCODING_GZIP &&
+      encoding != HTTP_CONTENT_ENCODING_DEFLATE)
+    return herror_new("http_input_stream_inflate", STREAM_ERROR_ENCODING,
+                      "%d is invalid content encoding", encoding);
+
+  if (!(zs = (z_stream *) calloc(1, sizeof(z_stream))))
+    return herror_new("http_input_stream_inflate", STREAM_ERROR_INFLATE,
+                      "calloc failed (%s)", strerror(errno));
+
+  /* 32 lets zlib detect gzip and zlib headers */
+  if (inflateInit2(zs, 15 + 32) != Z_OK)
+  {
+    free(zs);
+    return herror_new("http_input_stream_inflate", STREAM_ERROR_INFLATE,
+                      "inflateInit2 failed");
+  }
+
+  if (!(stream->zbuf = (byte_t *) malloc(MAX_SOCKET_BUFFER_SIZE)))
+  {
+    inflateEnd(zs);
+    free(zs);
+    return herror_new("http_input_stream_inflate", STREAM_ERROR_INFLATE,
+                      "malloc failed (%s)", strerror(errno));
+  }
+
+  stream->zstream = zs;
+  stream->zdone = 0;
+
+  return H_OK;
+}
+
 static int
 _http_input_stream_is_content_length_ready(http_input_stream_t * stream)
 {
@@ -408,19 +551,9 @@ _http_input_stream_file_read(http_input_stream_t * stream, byte_t * dest,
   return len;
 }
 
-/**
-  Returns the actual status of the stream.
-*/
-int
-http_input_stream_is_ready(http_input_stream_t * stream)
+static int
+_http_input_stream_raw_is_ready(http_input_stream_t * stream)
 {
-  /* paranoia check */
-  if (stream == NULL)
-    return 0;
-
-  /* reset error flag */
-  stream->err = H_OK;
-
   switch (stream->type)
   {
   case HTTP_TRANSFER_CONTENT_LENGTH:
@@ -437,22 +570,11 @@ http_input_stream_is_ready(http_input_stream_t * stream)
 
 }
 
-/**
-  Returns the actual read bytes
-  <0 on error
-*/
-int
-http_input_stream_read(http_input_stream_t * stream, byte_t * dest, int size)
+static int
+_http_input_stream_raw_read(http_input_stream_t * stream, byte_t * dest,
+                            int size)
 {
   int len = 0;
-  /* paranoia check */
-  if (stream == NULL)
-  {
-    return -1;
-  }
-
-  /* XXX: possible memleak! reset error flag */
-  stream->err = H_OK;
 
   switch (stream->type)
   {
@@ -478,6 +600,100 @@ http_input_stream_read(http_input_stream_t * stream, byte_t * dest, int size)
   return len;
 }
 
+static int
+_http_input_stream_inflate_read(http_input_stream_t * stream, byte_t * dest,
+                                int size)
+{
+  z_stream *zs = stream->zstream;
+  int len, ret;
+
+  zs->next_out = dest;
+  zs->avail_out = size;
+
+  while (!stream->zdone && zs->avail_out > 0)
+  {
+    if (zs->avail_in == 0)
+    {
+      /* hand out what we have before waiting for more input */
+      if (zs->avail_out < (uInt) size)
+        break;
+
+      if (!_http_input_stream_raw_is_ready(stream))
+      {
+        stream->zdone = 1;
+        break;
+      }
+
+      if ((len = _http_input_stream_raw_read(stream, stream->zbuf,
+                                             MAX_SOCKET_BUFFER_SIZE)) < 0)
+        return -1;
+
+      if (len == 0)
+      {
+        stream->zdone = 1;
+        break;
+      }
+
+      zs->next_in = stream->zbuf;
+      zs->avail_in = len;
+    }
+
+    ret = inflate(zs, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END)
+      stream->zdone = 1;
+    else if (ret != Z_OK)
+    {
+      stream->err = herror_new("http_input_stream_read", STREAM_ERROR_INFLATE,
+                               "inflate failed (%s)",
+                               zs->msg ? zs->msg : "unknown error");
+      return -1;
+    }
+  }
+
+  return size - zs->avail_out;
+}
+
+/**
+  Returns the actual status of the stream.
+*/
+int
+http_input_stream_is_ready(http_input_stream_t * stream)
+{
+  /* paranoia check */
+  if (stream == NULL)
+    return 0;
+
+  /* reset error flag */
+  stream->err = H_OK;
+
+  if (stream->zstream)
+    return !stream->zdone;
+
+  return _http_input_stream_raw_is_ready(stream);
+}
+
+/**
+  Returns the actual read bytes
+  <0 on error
+*/
+int
+http_input_stream_read(http_input_stream_t * stream, byte_t * dest, int size)
+{
+  /* paranoia check */
+  if (stream == NULL)
+  {
+    return -1;
+  }
+
+  /* XXX: possible memleak! reset error flag */
+  stream->err = H_OK;
+
+  if (stream->zstream)
+    return _http_input_stream_inflate_read(stream, dest, size);
+
+  return _http_input_stream_raw_read(stream, dest, size);
+}
+
 
 /*
 -------------------------------------------------------------------
@@ -490,27 +706,21 @@ HTTP OUTPUT STREAM
 
 
 /**
-  Creates a new output stream. Transfer code will be found from header.
+  Initializes an output stream. Transfer code will be found from header.
 */
-http_output_stream_t *
-http_output_stream_new(hsocket_t *sock, hpair_t * header)
+void
+http_output_stream_init(http_output_stream_t * stream, hsocket_t *sock,
+                        hpair_t * header)
 {
-  http_output_stream_t *result;
   char *content_length;
 
-  /* Paranoya check */
-/*  if (header == NULL)
-    return NULL;
-*/
-  /* Create object */
-  if (!(result = (http_output_stream_t *) malloc(sizeof(http_output_stream_t))))
-  {
-    log_error("malloc failed (%s)", strerror(errno));
-    return NULL;
-  }
-
-  result->sock = sock;
-  result->sent = 0;
+  stream->sock = sock;
+  stream->sent = 0;
+  stream->content_length = 0;
+  stream->zstream = NULL;
+  stream->held_header = NULL;
+  stream->held = NULL;
+  stream->held_len = 0;
 
   /* Find connection type */
 
@@ -519,22 +729,46 @@ http_output_stream_new(hsocket_t *sock, hpair_t * header)
   {
     log_debug("Stream transfer with 'Content-length'");
     content_length = hpairnode_get_ignore_case(header, HEADER_CONTENT_LENGTH);
-    result->content_length = atoi(content_length);
-    result->type = HTTP_TRANSFER_CONTENT_LENGTH;
+    stream->content_length = atoi(content_length);
+    stream->type = HTTP_TRANSFER_CONTENT_LENGTH;
   }
   /* Check if Chunked */
   else if (_http_stream_is_chunked(header))
   {
     log_debug("Stream transfer with 'chunked'");
-    result->type = HTTP_TRANSFER_CHUNKED;
+    stream->type = HTTP_TRANSFER_CHUNKED;
   }
   /* Assume connection close */
   else
   {
     log_debug("Stream transfer with 'Connection: close'");
-    result->type = HTTP_TRANSFER_CONNECTION_CLOSE;
+    stream->type = HTTP_TRANSFER_CONNECTION_CLOSE;
   }
 
+  return;
+}
+
+/**
+  Creates a new output stream. Transfer code will be found from header.
+*/
+http_output_stream_t *
+http_output_stream_new(hsocket_t *sock, hpair_t * header)
+{
+  http_output_stream_t *result;
+
+  /* Paranoya check */
+/*  if (header == NULL)
+    return NULL;
+*/
+  /* Create object */
+  if (!(result = (http_output_stream_t *) malloc(sizeof(http_output_stream_t))))
+  {
+    log_error("malloc failed (%s)", strerror(errno));
+    return NULL;
+  }
+
+  http_output_stream_init(result, sock, header);
+
   return result;
 }
 
@@ -544,17 +778,17 @@ http_output_stream_new(hsocket_t *sock, hpair_t * header)
 void
 http_output_stream_free(http_output_stream_t * stream)
 {
+  http_output_stream_release(stream);
   free(stream);
 
   return;
 }
 
 /**
-  Writes 'size' bytes of 'bytes' into stream.
-  Returns socket error flags or H_OK.
+  Sends 'size' bytes with the framing of the transfer style.
 */
-herror_t
-http_output_stream_write(http_output_stream_t * stream,
+static herror_t
+_http_output_stream_send(http_output_stream_t * stream,
                          const byte_t * bytes, int size)
 {
   herror_t status;
@@ -582,6 +816,116 @@ http_output_stream_write(http_output_stream_t * stream,
   return H_OK;
 }
 
+/**
+  Runs 'size' bytes through the compressor and sends its output.
+*/
+static herror_t
+_http_output_stream_compress(http_output_stream_t * stream,
+                             const byte_t * bytes, int size, int flush)
+{
+  herror_t status;
+  z_stream *zs = stream->zstream;
+  byte_t buffer[MAX_SOCKET_BUFFER_SIZE];
+  int ret, len;
+
+  zs->next_in = (Bytef *) bytes;
+  zs->avail_in = size;
+
+  do
+  {
+    zs->next_out = buffer;
+    zs->avail_out = sizeof(buffer);
+
+    if ((ret = deflate(zs, flush)) == Z_STREAM_ERROR)
+      return herror_new("http_output_stream_write", STREAM_ERROR_DEFLATE,
+                        "deflate failed");
+
+    /* an empty chunk would end the body */
+    len = sizeof(buffer) - zs->avail_out;
+    if (len > 0 &&
+        (status = _http_output_stream_send(stream, buffer, len)) != H_OK)
+      return status;
+  }
+  while (zs->avail_out == 0);
+
+  return H_OK;
+}
+
+/**
+  Sends the held back header and body.
+*/
+static herror_t
+_http_output_stream_unhold(http_output_stream_t * stream, int compress)
+{
+  herror_t status;
+  char buffer[64];
+
+  if (compress)
+  {
+    sprintf(buffer, "%s: %s\r\n\r\n", HEADER_CONTENT_ENCODING,
+            stream->held_encoding == HTTP_CONTENT_ENCODING_GZIP ?
+            CONTENT_ENCODING_GZIP : CONTENT_ENCODING_DEFLATE);
+  }
+  else
+    strcpy(buffer, "\r\n");
+
+  if ((status = hsocket_send(stream->sock, stream->held_header)) != H_OK)
+    return status;
+  if ((status = hsocket_send(stream->sock, buffer)) != H_OK)
+    return status;
+
+  free(stream->held_header);
+  stream->held_header = NULL;
+
+  if (compress)
+  {
+    status = http_output_stream_deflate(stream, stream->held_encoding,
+                                        stream->held_level);
+    if (status != H_OK)
+      return status;
+
+    status = _http_output_stream_compress(stream, stream->held,
+                                          stream->held_len, Z_NO_FLUSH);
+  }
+  else if (stream->held_len > 0)
+    status = _http_output_stream_send(stream, stream->held, stream->held_len);
+
+  free(stream->held);
+  stream->held = NULL;
+  stream->held_len = 0;
+
+  return status;
+}
+
+/**
+  Writes 'size' bytes of 'bytes' into stream.
+  Returns socket error flags or H_OK.
+*/
+herror_t
+http_output_stream_write(http_output_stream_t * stream,
+                         const byte_t * bytes, int size)
+{
+  herror_t status;
+
+  if (stream->held_header)
+  {
+    if (stream->held_len + size < stream->held_min)
+    {
+      memcpy(stream->held + stream->held_len, bytes, size);
+      stream->held_len += size;
+      return H_OK;
+    }
+
+    if ((status = _http_output_stream_unhold(stream, 1)) != H_OK)
+      return status;
+  }
+
+  if (stream->zstream)
+    return _http_output_stream_compress(stream, bytes, size, Z_NO_FLUSH);
+
+  return _http_output_stream_send(stream, bytes, size);
+}
+
 /**
   Writes 'strlen()' bytes of 'str' into stream.
   Returns socket error flags or H_OK.
@@ -594,11 +938,86 @@ http_output_stream_write_string(http_output_stream_t * stream,
 }
 
 
+herror_t
+http_output_stream_write_file(http_output_stream_t * stream, int fd,
+                              off_t offset, size_t size)
+{
+  byte_t buffer[MAX_FILE_BUFFER_SIZE];
+  herror_t status;
+  char chunked[24];
+  ssize_t count;
+
+  /* the compressor needs the bytes */
+  if (stream->held_header || stream->zstream)
+  {
+    while (size > 0)
+    {
+      count = pread(fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer),
+                    offset);
+      if (count == -1 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        return herror_new("http_output_stream_write_file", FILE_ERROR_READ,
+                          "pread failed (%s)",
+                          count ? strerror(errno) : "unexpected end of file");
+
+      if ((status = http_output_stream_write(stream, buffer, count)) != H_OK)
+        return status;
+
+      offset += count;
+      size -= count;
+    }
+
+    return H_OK;
+  }
+
+  if (size == 0)
+    return H_OK;
+
+  /* one chunk for the whole extent */
+  if (stream->type == HTTP_TRANSFER_CHUNKED)
+  {
+    sprintf(chunked, "%lx\r\n", (unsigned long) size);
+    if ((status = hsocket_send(stream->sock, chunked)) != H_OK)
+      return status;
+  }
+
+  if ((status = hsocket_sendfile(stream->sock, fd, offset, size)) != H_OK)
+    return status;
+
+  if (stream->type == HTTP_TRANSFER_CHUNKED)
+  {
+    if ((status = hsocket_send(stream->sock, "\r\n")) != H_OK)
+      return status;
+  }
+
+  return H_OK;
+}
+
+
 herror_t
 http_output_stream_flush(http_output_stream_t * stream)
 {
   herror_t status;
 
+  if (stream->held_header)
+  {
+    if ((status = _http_output_stream_unhold(stream, 0)) != H_OK)
+      return status;
+  }
+
+  if (stream->zstream)
+  {
+    status = _http_output_stream_compress(stream, NULL, 0, Z_FINISH);
+
+    deflateEnd(stream->zstream);
+    free(stream->zstream);
+    stream->zstream = NULL;
+
+    if (status != H_OK)
+      return status;
+  }
+
   if (stream->type == HTTP_TRANSFER_CHUNKED)
   {
     if ((status = hsocket_send(stream->sock, "0\r\n\r\n")) != H_OK)
@@ -607,3 +1026,85 @@ http_output_stream_flush(http_output_stream_t * stream)
 
   return H_OK;
 }
+
+
+herror_t
+http_output_stream_deflate(http_output_stream_t * stream,
+                           http_content_encoding_t encoding, int level)
+{
+  z_stream *zs;
+  int bits;
+
+  switch (encoding)
+  {
+  case HTTP_CONTENT_ENCODING_GZIP:
+    bits = 15 + 16;
+    break;
+  case HTTP_CONTENT_ENCODING_DEFLATE:
+    bits = 15;
+    break;
+  default:
+    return herror_new("http_output_stream_deflate", STREAM_ERROR_ENCODING,
+                      "%d is invalid content encoding", encoding);
+  }
+
+  if (!(zs = (z_stream *) calloc(1, sizeof(z_stream))))
+    return herror_new("http_output_stream_deflate", STREAM_ERROR_DEFLATE,
+                      "calloc failed (%s)", strerror(errno));
+
+  if (deflateInit2(zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    free(zs);
+    return herror_new("http_output_stream_deflate", STREAM_ERROR_DEFLATE,
+                      "deflateInit2 failed");
+  }
+
+  stream->zstream = zs;
+
+  return H_OK;
+}
+
+
+herror_t
+http_output_stream_hold(http_output_stream_t * stream, const char *header,
+                        http_content_encoding_t encoding, int level, int min)
+{
+  if (!(stream->held_header = strdup(header)))
+    return herror_new("http_output_stream_hold", STREAM_ERROR_DEFLATE,
+                      "strdup failed (%s)", strerror(errno));
+
+  if (!(stream->held = (byte_t *) malloc(min)))
+  {
+    free(stream->held_header);
+    stream->held_header = NULL;
+    return herror_new("http_output_stream_hold", STREAM_ERROR_DEFLATE,
+                      "malloc failed (%s)", strerror(errno));
+  }
+
+  stream->held_len = 0;
+  stream->held_min = min;
+  stream->held_encoding = encoding;
+  stream->held_level = level;
+
+  return H_OK;
+}
+
+
+void
+http_output_stream_release(http_output_stream_t * stream)
+{
+  if (stream->zstream)
+  {
+    deflateEnd(stream->zstream);
+    free(stream->zstream);
+    stream->zstream = NULL;
+  }
+
+  free(stream->held_header);
+  stream->held_header = NULL;
+  free(stream->held);
+  stream->held = NULL;
+  stream->held_len = 0;
+
+  return;
+}
@@ -0,0 +1,211 @@
+/******************************************************************
+*  $Id$
+*
+* CSOAP Project:  A http client/server library in C
+* Copyright (C) 2003  Ferhat Ayaz
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU Library General Public
+* License along with this library; if not, write to the
+* Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+* Boston, MA  02111-1307, USA.
+*
+* Email: ferhatayaz@yahoo.com
+******************************************************************/
+
+#include <time.h>
+
+#include <nanohttp/nanohttp-timer.h>
+
+#include <log.h>
+
+unsigned long long
+htimer_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+_htimer_list_init(htimer_t * head)
+{
+  head->next = head->prev = head;
+
+  return;
+}
+
+static void
+_htimer_link(htimer_t * head, htimer_t * timer)
+{
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+
+  return;
+}
+
+static void
+_htimer_unlink(htimer_t * timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+
+  return;
+}
+
+/*--------------------------------------------------
+FUNCTION: _htimer_add
+DESC: Links the timer into the slot its deadline
+belongs to, relative to the current tick.
+----------------------------------------------------*/
+static void
+_htimer_add(htimer_wheel_t * wheel, htimer_t * timer)
+{
+  unsigned long delta, expires;
+
+  if (timer->expires <= wheel->now)
+    timer->expires = wheel->now + 1;
+
+  expires = timer->expires;
+  delta = expires - wheel->now;
+
+  if (delta < HTIMER_L0_SIZE)
+  {
+    _htimer_link(&wheel->l0[expires & (HTIMER_L0_SIZE - 1)], timer);
+    return;
+  }
+
+  /* park far deadlines in the slot cascaded last */
+  if (delta >= HTIMER_L0_SIZE * HTIMER_L1_SIZE)
+    expires = wheel->now + HTIMER_L0_SIZE * HTIMER_L1_SIZE - 1;
+
+  _htimer_link(&wheel->l1[(expires >> HTIMER_L0_BITS) &
+                          (HTIMER_L1_SIZE - 1)], timer);
+
+  return;
+}
+
+void
+htimer_wheel_init(htimer_wheel_t * wheel)
+{
+  int i;
+
+  wheel->now = 0;
+  wheel->base = htimer_now();
+  wheel->count = 0;
+
+  for (i = 0; i < HTIMER_L0_SIZE; i++)
+    _htimer_list_init(&wheel->l0[i]);
+  for (i = 0; i < HTIMER_L1_SIZE; i++)
+    _htimer_list_init(&wheel->l1[i]);
+
+  return;
+}
+
+void
+htimer_init(htimer_t * timer, void *data)
+{
+  timer->next = timer->prev = NULL;
+  timer->expires = 0;
+  timer->data = data;
+
+  return;
+}
+
+int
+htimer_pending(htimer_t * timer)
+{
+  return timer->next != NULL;
+}
+
+void
+htimer_schedule(htimer_wheel_t * wheel, htimer_t * timer, unsigned long ms)
+{
+  unsigned long long now;
+
+  if (htimer_pending(timer))
+    _htimer_unlink(timer);
+  else
+    wheel->count++;
+
+  /* the deadline is counted from the actual time, not the last tick */
+  now = htimer_now() - wheel->base;
+  timer->expires = (now + ms + HTIMER_TICK_MS - 1) / HTIMER_TICK_MS;
+
+  _htimer_add(wheel, timer);
+
+  return;
+}
+
+void
+htimer_cancel(htimer_wheel_t * wheel, htimer_t * timer)
+{
+  if (!htimer_pending(timer))
+    return;
+
+  _htimer_unlink(timer);
+  wheel->count--;
+
+  return;
+}
+
+void
+htimer_advance(htimer_wheel_t * wheel, htimer_func func)
+{
+  unsigned long target;
+  htimer_t *head, *timer, cascade;
+
+  target = (htimer_now() - wheel->base) / HTIMER_TICK_MS;
+
+  while (wheel->now < target)
+  {
+    wheel->now++;
+
+    /* the first level wrapped, pull the next group down */
+    if ((wheel->now & (HTIMER_L0_SIZE - 1)) == 0)
+    {
+      head = &wheel->l1[(wheel->now >> HTIMER_L0_BITS) &
+                        (HTIMER_L1_SIZE - 1)];
+
+      _htimer_list_init(&cascade);
+      while (head->next != head)
+      {
+        timer = head->next;
+        _htimer_unlink(timer);
+        _htimer_link(&cascade, timer);
+      }
+
+      while (cascade.next != &cascade)
+      {
+        timer = cascade.next;
+        _htimer_unlink(timer);
+        _htimer_add(wheel, timer);
+      }
+    }
+
+    head = &wheel->l0[wheel->now & (HTIMER_L0_SIZE - 1)];
+    while (head->next != head)
+    {
+      timer = head->next;
+      _htimer_unlink(timer);
+      wheel->count--;
+      func(timer);
+    }
+  }
+
+  return;
+}
@@ -34,12 +34,18 @@
 #include <log.h>
 #include <pgcommon.h>
 #include <pgctxpool.h>
+#include <session.h>
 #include <authz.h>
 #include <util.h>
 
 #include <pcd.h>
 
 #define MAXCONNS 100
+#define WORKERS 8
+#define COMPRESSION 6
+#define COMPRESSION_MIN 1024
+#define LISTENERS 1
+#define BACKLOG 128
 
 int main(int argc, char **argv)
 {
@@ -58,10 +64,22 @@ int main(int argc, char **argv)
     const char *pguser = NULL;
     const char *pgpasswd = NULL;
     int maxconns = MAXCONNS, dbconns = 1, nport;
-    char maxconns_str[3];
+    char maxconns_str[12];
+    int workers = WORKERS;
+    char workers_str[12];
+    int compression = COMPRESSION, compression_min = COMPRESSION_MIN;
+    char compression_str[12], compression_min_str[12];
+    int listeners = LISTENERS, pinlisteners = 0;
+    char listeners_str[12], pinlisteners_str[12];
+    int backlog = BACKLOG, deferaccept = 0;
+    char backlog_str[12], deferaccept_str[12];
+    int shedlimit = -1;
+    int usercachettl = AUTHZ_CACHE_TTL;
+    char shedlimit_str[12];
     const char *port = NULL;
     const char *prefix = NULL;
     const char *ntlmhelper = NULL;
+    const char *sessionstore = NULL;
     const char *smbhost = NULL;
     const char *smbuser = NULL;
     const char *smbpasswd = NULL;
@@ -129,6 +147,10 @@ int main(int argc, char **argv)
         ntlmhelper = "";
     }
 
+    config_lookup_string(&config, "sessionstore", &sessionstore);
+    if (!sessionstore)
+        sessionstore = "local";
+
     config_lookup_string(&config, "smbhost", &smbhost);
     if (!smbhost) {
         log_warn("smbhost is not set");
@@ -147,13 +169,75 @@ int main(int argc, char **argv)
         smbpasswd = "";
     }
 
+    config_lookup_int(&config, "usercachettl", &usercachettl);
+    if (usercachettl < 0) {
+        log_warn("usercachettl must be zero or greater (was %d)", usercachettl);
+        usercachettl = AUTHZ_CACHE_TTL;
+    }
+
     snprintf(confitem, 1024, "%s.maxconns", confgroup);
     config_lookup_int(&config, confitem, &maxconns);
     if (maxconns < 1) {
         log_warn("maxconns must be at least 1 (was %d)", maxconns);
         maxconns = 1;
     }
-    snprintf(maxconns_str, 3, "%d", maxconns);
+    snprintf(maxconns_str, 12, "%d", maxconns);
+
+    snprintf(confitem, 1024, "%s.workers", confgroup);
+    config_lookup_int(&config, confitem, &workers);
+    if (workers < 1) {
+        log_warn("workers must be at least 1 (was %d)", workers);
+        workers = WORKERS;
+    }
+    snprintf(workers_str, 12, "%d", workers);
+
+    snprintf(confitem, 1024, "%s.compression", confgroup);
+    config_lookup_int(&config, confitem, &compression);
+    if (compression < 0 || compression > 9) {
+        log_warn("compression must be between 0 and 9 (was %d)", compression);
+        compression = COMPRESSION;
+    }
+    snprintf(compression_str, 12, "%d", compression);
+
+    snprintf(confitem, 1024, "%s.compression-min", confgroup);
+    config_lookup_int(&config, confitem, &compression_min);
+    if (compression_min < 1) {
+        log_warn("compression-min must be at least 1 (was %d)", compression_min);
+        compression_min = COMPRESSION_MIN;
+    }
+    snprintf(compression_min_str, 12, "%d", compression_min);
+
+    snprintf(confitem, 1024, "%s.listeners", confgroup);
+    config_lookup_int(&config, confitem, &listeners);
+    if (listeners < 1) {
+        log_warn("listeners must be at least 1 (was %d)", listeners);
+        listeners = LISTENERS;
+    }
+    snprintf(listeners_str, 12, "%d", listeners);
+
+    snprintf(confitem, 1024, "%s.pin-listeners", confgroup);
+    config_lookup_bool(&config, confitem, &pinlisteners);
+    snprintf(pinlisteners_str, 12, "%d", pinlisteners);
+
+    snprintf(confitem, 1024, "%s.backlog", confgroup);
+    config_lookup_int(&config, confitem, &backlog);
+    if (backlog < 1) {
+        log_warn("backlog must be at least 1 (was %d)", backlog);
+        backlog = BACKLOG;
+    }
+    snprintf(backlog_str, 12, "%d", backlog);
+
+    snprintf(confitem, 1024, "%s.defer-accept", confgroup);
+    config_lookup_int(&config, confitem, &deferaccept);
+    if (deferaccept < 0) {
+        log_warn("defer-accept must not be negative (was %d)", deferaccept);
+        deferaccept = 0;
+    }
+    snprintf(deferaccept_str, 12, "%d", deferaccept);
+
+    snprintf(confitem, 1024, "%s.shed-limit", confgroup);
+    config_lookup_int(&config, confitem, &shedlimit);
+    snprintf(shedlimit_str, 12, "%d", shedlimit);
 
     snprintf(confitem, 1024, "%s.dbconns", confgroup);
     config_lookup_int(&config, confitem, &dbconns);
@@ -189,7 +273,7 @@ int main(int argc, char **argv)
     }
 
     httpd_set_timeout(10);
-    soapargs = (char **)calloc(7, sizeof(char *));
+    soapargs = (char **)calloc(23, sizeof(char *));
     soapargs[0] = argv[0];
     soapargs[1] = "-NHTTPport";
     soapargs[2] = strdup(port);
@@ -197,13 +281,38 @@ int main(int argc, char **argv)
     soapargs[4] = strdup(maxconns_str);
     soapargs[5] = "-NHTTPntlmhelper";
     soapargs[6] = strdup(ntlmhelper);
-    soaperr = soap_server_init_args(7, soapargs);
+    soapargs[7] = "-NHTTPworkers";
+    soapargs[8] = strdup(workers_str);
+    soapargs[9] = "-NHTTPgziplevel";
+    soapargs[10] = strdup(compression_str);
+    soapargs[11] = "-NHTTPgzipmin";
+    soapargs[12] = strdup(compression_min_str);
+    soapargs[13] = "-NHTTPlisteners";
+    soapargs[14] = strdup(listeners_str);
+    soapargs[15] = "-NHTTPpincpus";
+    soapargs[16] = strdup(pinlisteners_str);
+    soapargs[17] = "-NHTTPbacklog";
+    soapargs[18] = strdup(backlog_str);
+    soapargs[19] = "-NHTTPdeferaccept";
+    soapargs[20] = strdup(deferaccept_str);
+    soapargs[21] = "-NHTTPshedlimit";
+    soapargs[22] = strdup(shedlimit_str);
+    soaperr = soap_server_init_args(23, soapargs);
+
+    /* requests blocked on the database count towards the load */
+    httpd_set_load_probe(pg_pool_waiters);
+
+    if (!session_store_open(sessionstore)) {
+        log_fatal("failed to open session store %s", sessionstore);
+        goto cleanup_db;
+    }
 
     if (!tpc_services_init(prefix, tpcname, pguser, pgpasswd, dbconns - 1)) {
         log_fatal("team project collection services failed to start!");
         goto cleanup_db;
     }
 
+    authz_set_cache_ttl(usercachettl);
     authz_init(smbhost, smbuser, smbpasswd);
 
     log_notice("starting SOAP server");
@@ -213,6 +322,14 @@ int main(int argc, char **argv)
     soap_server_destroy();
 
     free(soapargs[2]);
+    free(soapargs[8]);
+    free(soapargs[10]);
+    free(soapargs[12]);
+    free(soapargs[14]);
+    free(soapargs[16]);
+    free(soapargs[18]);
+    free(soapargs[20]);
+    free(soapargs[22]);
     free(soapargs);
 
     authz_free();
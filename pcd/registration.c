@@ -125,6 +125,7 @@ void registration_service_init(SoapRouter **router, const char *prefix, const ch
     (*router) = soap_router_new();
     soap_router_register_security(*router, NTLM_SPNEGO);
     soap_router_set_tag(*router, instid);
+    soap_router_set_priority(*router, HTTPD_PRIORITY_HIGH);
 
     sprintf(url, "%s%s", prefix ? prefix : "", relpath);
     soap_server_register_router(*router, url);
@@ -0,0 +1,297 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   tests the user lookup cache against a stubbed NetApi
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <netapi.h>
+
+#include <log.h>
+#include <authz.h>
+
+#define FETCH_DELAY 200000          /* microseconds the stub takes to answer */
+#define THREADS 16
+#define STUB_SID "S-1-5-21-1-2-3-1000"
+
+static int _calls = 0;
+static int _fail = 0;
+static int _dummy;
+
+/*
+ * NetApi stub. Users named "unknown*" do not exist, and every lookup
+ * fails while _fail is set.
+ */
+
+NET_API_STATUS libnetapi_init(struct libnetapi_ctx **context)
+{
+    *context = (struct libnetapi_ctx *)&_dummy;
+    return NET_API_STATUS_SUCCESS;
+}
+
+NET_API_STATUS libnetapi_free(struct libnetapi_ctx *ctx)
+{
+    return NET_API_STATUS_SUCCESS;
+}
+
+NET_API_STATUS libnetapi_set_username(struct libnetapi_ctx *ctx, const char *username)
+{
+    return NET_API_STATUS_SUCCESS;
+}
+
+NET_API_STATUS libnetapi_set_password(struct libnetapi_ctx *ctx, const char *password)
+{
+    return NET_API_STATUS_SUCCESS;
+}
+
+NET_API_STATUS NetUserGetInfo(const char *server_name, const char *user_name,
+                              uint32_t level, uint8_t **buffer)
+{
+    struct USER_INFO_23 *info;
+
+    __atomic_add_fetch(&_calls, 1, __ATOMIC_SEQ_CST);
+    usleep(FETCH_DELAY);
+
+    if (__atomic_load_n(&_fail, __ATOMIC_SEQ_CST))
+        return 53;  /* ERROR_BAD_NETPATH */
+
+    if (!strncmp(user_name, "unknown", 7))
+        return 2221;  /* NERR_UserNotFound */
+
+    info = (struct USER_INFO_23 *)calloc(1, sizeof(struct USER_INFO_23));
+    info->usri23_full_name = strdup(user_name);
+    *buffer = (uint8_t *)info;
+
+    return NET_API_STATUS_SUCCESS;
+}
+
+int ConvertSidToStringSid(const struct domsid *sid, char **sid_string)
+{
+    *sid_string = strdup(STUB_SID);
+    return 1;
+}
+
+NET_API_STATUS NetApiBufferFree(void *buffer)
+{
+    struct USER_INFO_23 *info = (struct USER_INFO_23 *)buffer;
+
+    free((char *)info->usri23_full_name);
+    free(info);
+
+    return NET_API_STATUS_SUCCESS;
+}
+
+static int calls()
+{
+    return __atomic_load_n(&_calls, __ATOMIC_SEQ_CST);
+}
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* looks up a user and checks that it was found, or not found */
+static int lookup(const char *userid, int found)
+{
+    userinfo_t *info = authz_lookup_user(userid);
+    int result = found ? info && !strcmp(info->sid, STUB_SID) : !info;
+
+    if (!result)
+        log_error("user %s was %sfound", userid, info ? "" : "not ");
+
+    authz_free_buffer(info);
+    return result;
+}
+
+static void *lookup_main(void *arg)
+{
+    *(int *)arg = lookup("alice", 1);
+    return NULL;
+}
+
+/* concurrent misses for the same user wait for a single fetch */
+static int test_single_flight()
+{
+    pthread_t threads[THREADS];
+    int results[THREADS];
+    int i, result = 1, before = calls();
+
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, lookup_main, &results[i]);
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        result &= results[i];
+    }
+
+    if (calls() - before != 1) {
+        log_error("%d concurrent misses made %d fetches", THREADS, calls() - before);
+        return 0;
+    }
+
+    return result;
+}
+
+/* a stale entry is served right away and refreshed in the background */
+static int test_stale(int ttl)
+{
+    struct timespec start;
+    int before;
+    double ms;
+
+    if (!lookup("bob", 1))
+        return 0;
+
+    /* past the TTL, but not twice the TTL */
+    sleep(ttl);
+    usleep(500000);
+
+    before = calls();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!lookup("bob", 1))
+        return 0;
+
+    if ((ms = elapsed(&start)) >= FETCH_DELAY / 1000) {
+        log_error("stale lookup waited %.1f ms for the refresh", ms);
+        return 0;
+    }
+
+    usleep(FETCH_DELAY * 2);
+
+    if (calls() - before != 1) {
+        log_error("stale entry was refreshed %d times", calls() - before);
+        return 0;
+    }
+
+    /* the refreshed entry is fresh again */
+    before = calls();
+    if (!lookup("bob", 1) || calls() != before) {
+        log_error("refreshed entry was not served from the cache");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* a refresh which fails keeps serving the entry it had */
+static int test_failed_refresh(int ttl)
+{
+    authz_stats_t before, after;
+    int result;
+
+    if (!lookup("carol", 1))
+        return 0;
+
+    sleep(ttl);
+    usleep(500000);
+
+    authz_get_stats(&before);
+    __atomic_store_n(&_fail, 1, __ATOMIC_SEQ_CST);
+
+    if (!lookup("carol", 1))
+        return 0;
+
+    usleep(FETCH_DELAY * 2);
+    authz_get_stats(&after);
+
+    if (after.failures - before.failures != 1) {
+        log_error("failed refresh was counted %lu times", after.failures - before.failures);
+        return 0;
+    }
+
+    /* a lookup which is not cached fails meanwhile */
+    result = lookup("carol", 1) && lookup("dave", 0);
+    __atomic_store_n(&_fail, 0, __ATOMIC_SEQ_CST);
+
+    return result;
+}
+
+/* unknown users are cached for AUTHZ_NEGATIVE_TTL at most */
+static int test_negative()
+{
+    int before;
+
+    if (!lookup("unknown", 0) || !lookup("erin", 1))
+        return 0;
+
+    before = calls();
+    if (!lookup("unknown", 0) || calls() != before) {
+        log_error("unknown user was not cached");
+        return 0;
+    }
+
+    sleep(AUTHZ_NEGATIVE_TTL + 1);
+
+    /* the known user outlives the unknown one */
+    before = calls();
+    if (!lookup("erin", 1) || calls() != before) {
+        log_error("known user expired with the unknown one");
+        return 0;
+    }
+
+    if (!lookup("unknown", 0) || calls() - before != 1) {
+        log_error("unknown user was cached for more than %d seconds", AUTHZ_NEGATIVE_TTL);
+        return 0;
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    int result;
+
+    if (!log_open(NULL, LOG_INFO, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    /* short enough that entries go stale during the test */
+    authz_set_cache_ttl(2);
+    if (!authz_init("localhost", "user", "password"))
+        return 1;
+
+    result = test_single_flight() && test_stale(2) && test_failed_refresh(2);
+    authz_free();
+
+    /* long enough for the negative TTL to be the shorter one */
+    authz_set_cache_ttl(AUTHZ_NEGATIVE_TTL * 2);
+    if (!authz_init("localhost", "user", "password"))
+        return 1;
+
+    result = result && test_negative();
+    authz_free();
+
+    return !result;
+}
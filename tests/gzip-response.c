@@ -0,0 +1,254 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   tests that compressed responses are complete, for bodies
+ *          written with a Content-Length over HTTP/1.0 and HTTP/1.1
+ *          and for chunked bodies
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <zlib.h>
+
+#include <log.h>
+
+#include <nanohttp/nanohttp-server.h>
+
+#define GZIP_MIN "64"
+#define LARGE_SIZE (32 * 1024)
+#define RESPONSE_SIZE (256 * 1024)
+
+static char large[LARGE_SIZE + 1];
+static const char *small = "a body just over the compression threshold, "
+    "which zlib keeps to itself until the stream is finished";
+
+static void send_body(httpd_conn_t *conn, const char *body)
+{
+    char length[16];
+
+    snprintf(length, sizeof(length), "%d", (int)strlen(body));
+    httpd_set_header(conn, HEADER_CONTENT_LENGTH, length);
+    httpd_set_header(conn, HEADER_CONTENT_TYPE, "text/plain");
+    httpd_send_header(conn, 200, "OK");
+
+    http_output_stream_write_string(conn->out, body);
+}
+
+static void large_service(httpd_conn_t *conn, hrequest_t *req)
+{
+    send_body(conn, large);
+}
+
+static void small_service(httpd_conn_t *conn, hrequest_t *req)
+{
+    send_body(conn, small);
+}
+
+/* writers of chunked bodies flush the stream themselves */
+static void chunked_service(httpd_conn_t *conn, hrequest_t *req)
+{
+    httpd_set_header(conn, HEADER_TRANSFER_ENCODING, TRANSFER_ENCODING_CHUNKED);
+    httpd_set_header(conn, HEADER_CONTENT_TYPE, "text/plain");
+    httpd_send_header(conn, 200, "OK");
+
+    http_output_stream_write_string(conn->out, large);
+    http_output_stream_flush(conn->out);
+}
+
+static void *server_main(void *arg)
+{
+    httpd_run();
+    return NULL;
+}
+
+/* sends a request and reads the response up to the close */
+static int fetch(int port, const char *request, char *response, int size)
+{
+    struct sockaddr_in addr;
+    struct timeval tv = { 5, 0 };
+    int sock, n, len = 0;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            send(sock, request, strlen(request), 0) != (ssize_t)strlen(request)) {
+        close(sock);
+        return -1;
+    }
+
+    while (len < size && (n = recv(sock, response + len, size - len, 0)) > 0)
+        len += n;
+
+    close(sock);
+    return len;
+}
+
+/* removes the chunk framing in place, the last chunk must be there */
+static int dechunk(char *body, int len)
+{
+    char *in = body, *end = body + len, *next;
+    int out = 0;
+    long size;
+
+    while (in < end) {
+        size = strtol(in, &next, 16);
+        if (next == in || !(next = strstr(next, "\r\n")) || next + 2 + size + 2 > end)
+            return -1;
+
+        next += 2;
+        if (size == 0)
+            return next + 2 == end && !memcmp(next, "\r\n", 2) ? out : -1;
+
+        memmove(body + out, next, size);
+        out += size;
+        in = next + size + 2;
+    }
+
+    return -1;
+}
+
+/* checks that the response is gzip compressed and inflates to 'expected' */
+static int check(int port, const char *version, const char *path, int code,
+                 const char *expected)
+{
+    static char response[RESPONSE_SIZE], inflated[RESPONSE_SIZE];
+    char request[256], status[32];
+    char *body;
+    z_stream zs;
+    int len, rc;
+
+    snprintf(request, sizeof(request),
+             "GET %s HTTP/%s\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n"
+             "Connection: close\r\n\r\n", path, version);
+
+    if ((len = fetch(port, request, response, sizeof(response) - 1)) <= 0) {
+        log_error("%s over HTTP/%s: no response", path, version);
+        return 0;
+    }
+
+    response[len] = '\0';
+    snprintf(status, sizeof(status), "HTTP/1.1 %d ", code);
+
+    if (strncmp(response, status, strlen(status)) ||
+            !(body = strstr(response, "\r\n\r\n")) ||
+            !strstr(response, HEADER_CONTENT_ENCODING ": " CONTENT_ENCODING_GZIP "\r\n")) {
+        log_error("%s over HTTP/%s: not a compressed %d response", path, version, code);
+        return 0;
+    }
+
+    body += 4;
+    len -= body - response;
+
+    if (strstr(response, HEADER_TRANSFER_ENCODING ": " TRANSFER_ENCODING_CHUNKED "\r\n") &&
+            (len = dechunk(body, len)) == -1) {
+        log_error("%s over HTTP/%s: chunked body is incomplete", path, version);
+        return 0;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, 15 + 16);
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)inflated;
+    zs.avail_out = sizeof(inflated);
+
+    rc = inflate(&zs, Z_FINISH);
+    len = sizeof(inflated) - zs.avail_out;
+    inflateEnd(&zs);
+
+    if (rc != Z_STREAM_END || zs.avail_in != 0) {
+        log_error("%s over HTTP/%s: compressed body is incomplete (%d)", path, version, rc);
+        return 0;
+    }
+
+    if (expected && (len != (int)strlen(expected) || memcmp(inflated, expected, len))) {
+        log_error("%s over HTTP/%s: body differs", path, version);
+        return 0;
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (!log_open(NULL, LOG_WARN, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    char port[16];
+    int i;
+
+    snprintf(port, sizeof(port), "%d", 20000 + getpid() % 20000);
+    char *args[] = { argv[0], NHTTPD_ARG_PORT, port, NHTTPD_ARG_GZIPLEVEL, "6",
+                     NHTTPD_ARG_GZIPMIN, GZIP_MIN };
+
+    for (i = 0; i < LARGE_SIZE; i++)
+        large[i] = "lorem ipsum dolor sit amet\n"[i % 27];
+
+    if (httpd_init(7, args) != H_OK)
+        return 1;
+
+    httpd_register("/large", large_service);
+    httpd_register("/small", small_service);
+    httpd_register("/chunked", chunked_service);
+
+    pthread_t server;
+    pthread_create(&server, NULL, server_main, NULL);
+    sleep(1);
+
+    const char *versions[] = { "1.0", "1.1" };
+    int result = 1;
+
+    for (i = 0; i < 2; i++) {
+        result &= check(atoi(port), versions[i], "/large", 200, large);
+        result &= check(atoi(port), versions[i], "/small", 200, small);
+
+        /* the error page is written with a Content-Length too */
+        result &= check(atoi(port), versions[i], "/missing", 404, NULL);
+    }
+
+    result &= check(atoi(port), "1.1", "/chunked", 200, large);
+
+    kill(getpid(), SIGINT);
+    pthread_join(server, NULL);
+    httpd_destroy();
+
+    return !result;
+}
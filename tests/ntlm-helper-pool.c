@@ -0,0 +1,182 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   runs concurrent NTLM handshakes over the helper pool with a
+ *          stand-in helper, including helpers that fail, die or hang
+ *          and tokens larger than a pipe read
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <log.h>
+#include <ntlmauth.h>
+
+#define POOL_SIZE 4
+#define THREADS 32
+#define HANDSHAKES 50
+#define TIMEOUT 250
+#define LARGE_TOKEN 20000
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/*
+ * runs one logon, the client answers with 'blob' or echoes the challenge,
+ * followed by 'padding' bytes of padding
+ */
+static int handshake(const char *blob, int padding)
+{
+    ntlmctx_t *ctx = ntlm_auth_init("/test", NTLM_HELPER_STUB);
+    char *response = NULL;
+    char *challenge = NULL;
+    char *answer;
+    int result = 0;
+
+    if (!ctx)
+        return 0;
+
+    ntlm_auth_challenge(ctx, NULL, &response);
+    free(response);
+    response = NULL;
+
+    ntlm_auth_challenge(ctx, "NTLM TlRMTVNTUAABAAAA", &challenge);
+
+    if (challenge && !strncmp(challenge, "NTLM ", 5)) {
+        answer = (char *)malloc(strlen(challenge) + 16 + padding);
+        sprintf(answer, "NTLM %s.", blob ? blob : challenge + 5);
+        memset(answer + strlen(answer), 'A', padding);
+        answer[strlen(challenge) + 16 + padding - 1] = '\0';
+
+        result = ntlm_auth_challenge(ctx, answer, &response);
+        free(answer);
+    }
+
+    free(challenge);
+    free(response);
+    ntlm_auth_free(ctx);
+
+    return result;
+}
+
+static void *client_main(void *arg)
+{
+    int i;
+
+    for (i = 0; i < HANDSHAKES; i++)
+        *(int *)arg += handshake(NULL, 0);
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (!log_open(NULL, LOG_INFO, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    if (!ntlm_auth_pool_init(NTLM_HELPER_STUB, POOL_SIZE))
+        return 1;
+
+    pthread_t threads[THREADS];
+    int results[THREADS];
+    struct timespec start;
+    int i, total = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < THREADS; i++) {
+        results[i] = 0;
+        pthread_create(&threads[i], NULL, client_main, &results[i]);
+    }
+
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        total += results[i];
+    }
+
+    double ms = elapsed(&start);
+    log_info("%d handshakes on %d helpers in %.1f ms, %.0f per second",
+             THREADS * HANDSHAKES, POOL_SIZE, ms, THREADS * HANDSHAKES * 1000.0 / ms);
+
+    if (total != THREADS * HANDSHAKES) {
+        log_error("%d of %d handshakes failed", THREADS * HANDSHAKES - total,
+                  THREADS * HANDSHAKES);
+        return 1;
+    }
+
+    ntlm_auth_set_timeout(TIMEOUT);
+
+    if (handshake("fail", 0) || handshake("bh", 0) || handshake("crash", 0)) {
+        log_error("a failed logon was accepted");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (handshake("hang", 0) || (ms = elapsed(&start)) > TIMEOUT * 4) {
+        log_error("hung helper was not given up on (%.1f ms)", ms);
+        return 1;
+    }
+
+    /* the helpers which errored out were replaced */
+    for (i = 0; i < POOL_SIZE * 2; i++) {
+        if (!handshake(NULL, 0)) {
+            log_error("logon failed after a helper restart");
+            return 1;
+        }
+    }
+
+    ntlmstats_t stats;
+    ntlm_auth_get_stats(&stats);
+
+    if (!handshake(NULL, LARGE_TOKEN) || handshake("echo", LARGE_TOKEN)) {
+        log_error("a %d byte token was not passed through", LARGE_TOKEN);
+        return 1;
+    }
+
+    /* the long reply to "echo" was read as a whole */
+    unsigned long restarts = stats.restarts;
+    ntlm_auth_get_stats(&stats);
+
+    if (stats.timeouts != 1 || stats.restarts != restarts) {
+        log_error("%lu timeouts and %lu restarts after the large tokens",
+                  stats.timeouts, stats.restarts - restarts);
+        return 1;
+    }
+
+    log_info("negotiate: avg %llu us, max %llu us; response: avg %llu us, max %llu us",
+             stats.negotiate.time / stats.negotiate.count, stats.negotiate.maxtime,
+             stats.response.time / stats.response.count, stats.response.maxtime);
+
+    ntlm_auth_pool_destroy();
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Stand-in for "ntlm_auth --helper-protocol=squid-2.5-ntlmssp" to
+# exercise the NTLM helper pool without a domain controller.
+#
+# Every YR request gets a unique challenge. A KK request succeeds
+# when its blob is the challenge this helper issued last, so a
+# handshake moved to another helper fails. Anything after a dot in
+# the blob is padding. The blobs "fail", "bh", "crash" and "hang" give
+# a logon failure, a helper error, a dead helper and a hung one, and
+# "echo" fails the logon with the padding as the message.
+# NTLM_STUB_DELAY delays every reply by that many seconds.
+#
+
+count=0
+challenge=
+
+reply() {
+    [ -n "$NTLM_STUB_DELAY" ] && sleep "$NTLM_STUB_DELAY"
+    printf '%s\n' "$1"
+}
+
+while read -r cmd blob; do
+    case "$cmd" in
+    YR)
+        count=$((count + 1))
+        challenge="stub-$$-$count"
+        reply "TT $challenge"
+        ;;
+    KK)
+        padding=${blob#*.}
+        blob=${blob%%.*}
+
+        if [ "$blob" = "crash" ]; then
+            exit 1
+        elif [ "$blob" = "hang" ]; then
+            exec sleep 3600
+        elif [ "$blob" = "echo" ]; then
+            reply "NA $padding"
+        elif [ "$blob" = "bh" ]; then
+            reply "BH simulated helper error"
+        elif [ -z "$challenge" ]; then
+            reply "BH no negotiation in progress"
+        elif [ "$blob" = "$challenge" ]; then
+            reply "AF STUB\\user$count"
+        else
+            reply "NA Logon failure"
+        fi
+        challenge=
+        ;;
+    *)
+        reply "BH unknown request $cmd"
+        ;;
+    esac
+done
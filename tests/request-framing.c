@@ -0,0 +1,85 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   tests that requests with ambiguous framing headers are
+ *          refused instead of being framed one way or the other
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <log.h>
+
+#include <nanohttp/nanohttp-stream.h>
+
+#define REQUEST_LINE "POST /tfs HTTP/1.1\r\nHost: example\r\n"
+
+static const struct {
+    const char *header;
+    int framing;
+    long content_length;
+} cases[] = {
+    { REQUEST_LINE "\r\n", HTTP_TRANSFER_CONTENT_LENGTH, 0 },
+    { REQUEST_LINE "Content-Length: 42\r\n\r\n", HTTP_TRANSFER_CONTENT_LENGTH, 42 },
+    { REQUEST_LINE "content-length:7 \r\n\r\n", HTTP_TRANSFER_CONTENT_LENGTH, 7 },
+    { REQUEST_LINE "Content-Length: 5\r\nContent-Length: 5\r\n\r\n", HTTP_TRANSFER_CONTENT_LENGTH, 5 },
+    { REQUEST_LINE "Transfer-Encoding: chunked\r\n\r\n", HTTP_TRANSFER_CHUNKED, 0 },
+    { REQUEST_LINE "Transfer-Encoding: Chunked\r\n\r\n", HTTP_TRANSFER_CHUNKED, 0 },
+    { REQUEST_LINE "Content-Length: 5\r\nContent-Length: 6\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Content-Length: +5\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Content-Length: 5, 5\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Content-Length: \r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Content-Length: 99999999999\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Content-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Transfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Transfer-Encoding: chunked, gzip\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Transfer-Encoding: xchunked\r\n\r\n", -1, 0 },
+    { REQUEST_LINE "Transfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n", -1, 0 },
+    { NULL, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+    if (!log_open(NULL, LOG_INFO, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    int i, result = 0;
+
+    for (i = 0; cases[i].header; i++) {
+        long content_length = -1;
+        int framing = http_input_stream_framing(cases[i].header,
+                                                strlen(cases[i].header),
+                                                &content_length);
+
+        if (framing != cases[i].framing ||
+                (framing == HTTP_TRANSFER_CONTENT_LENGTH &&
+                 content_length != cases[i].content_length)) {
+            log_error("case %d was framed as %d with length %ld", i, framing,
+                      content_length);
+            result = 1;
+        }
+    }
+
+    return result;
+}
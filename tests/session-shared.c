@@ -0,0 +1,126 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   tests that a session authenticated by one process is
+ *          accepted by another sharing the session store
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <log.h>
+#include <session.h>
+
+#define CAPACITY 256
+#define TTL 60
+#define SESSIONS 64
+
+/* binds sessions in one process, as the replica that ran the handshake */
+static int bind_main(const char *spec, int ready)
+{
+    char id[64], userid[64];
+    int i;
+
+    if (!session_store_init(CAPACITY, TTL) || !session_store_open(spec))
+        return 1;
+
+    for (i = 0; i < SESSIONS; i++) {
+        snprintf(id, sizeof(id), "session-%d", i);
+        snprintf(userid, sizeof(userid), "EXAMPLE\\user%d", i);
+
+        session_t *session = session_init(id);
+        session_bind_user(session, userid);
+        session_close(session);
+    }
+
+    session_store_free();
+    write(ready, "", 1);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (!log_open(NULL, LOG_INFO, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    char spec[64], name[64];
+    snprintf(name, sizeof(name), "/bonsai-test-%d", getpid());
+    snprintf(spec, sizeof(spec), "shm:%s", name);
+
+    int fds[2], status;
+    char c;
+
+    if (pipe(fds) == -1)
+        return 1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(bind_main(spec, fds[1]));
+
+    if (!session_store_init(CAPACITY, TTL) || !session_store_open(spec)) {
+        shm_unlink(name);
+        return 1;
+    }
+
+    int result = (read(fds[0], &c, 1) == 1);
+    waitpid(pid, &status, 0);
+    result = result && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    if (!result)
+        log_error("the binding process failed");
+
+    char id[64], userid[64];
+    int i;
+
+    for (i = 0; result && i < SESSIONS; i++) {
+        snprintf(id, sizeof(id), "session-%d", i);
+        snprintf(userid, sizeof(userid), "EXAMPLE\\user%d", i);
+
+        session_t *session = session_init(id);
+
+        if (!session_auth_check(session) || strcmp(session->userid, userid)) {
+            log_error("session %s was not authenticated as %s", id, userid);
+            result = 0;
+        }
+
+        session_close(session);
+    }
+
+    session_t *session = session_init("session-unknown");
+    if (result && session_auth_check(session)) {
+        log_error("an unknown session was authenticated");
+        result = 0;
+    }
+
+    session_close(session);
+    session_store_free();
+    shm_unlink(name);
+
+    return !result;
+}
@@ -0,0 +1,189 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   tests eviction from the session store and measures
+ *          concurrent session lookups
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <log.h>
+#include <session.h>
+
+#define CAPACITY 1024
+#define TTL 1
+#define HELD 16
+#define CHURN 50000
+#define THREADS 16
+#define LOOKUPS 200000
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* opens and closes one session */
+static int touch(const char *prefix, int n)
+{
+    char id[64];
+    snprintf(id, sizeof(id), "%s-%d", prefix, n);
+
+    session_t *session = session_init(id);
+    session_close(session);
+
+    return (session != NULL);
+}
+
+static void *lookup_main(void *arg)
+{
+    unsigned int seed = (unsigned long)arg;
+    int i;
+
+    for (i = 0; i < LOOKUPS; i++)
+        touch("hot", rand_r(&seed) % (CAPACITY / 2));
+
+    return NULL;
+}
+
+/* starts a handshake on the session, which pins the only helper */
+static int start_handshake(session_t *session)
+{
+    ntlmctx_t *ctx = ntlm_auth_init("/test", NTLM_HELPER_STUB);
+    char *response = NULL;
+
+    ntlm_auth_challenge(ctx, NULL, &response);
+    free(response);
+    response = NULL;
+
+    ntlm_auth_challenge(ctx, "NTLM TlRMTVNTUAABAAAA", &response);
+    session_auth_init(session, "/test", &ctx);
+
+    int result = (response && ctx->helper);
+    free(response);
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    if (!log_open(NULL, LOG_INFO, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    if (!session_store_init(CAPACITY, TTL) || !ntlm_auth_pool_init(NTLM_HELPER_STUB, 1))
+        return 1;
+
+    session_t *held[HELD];
+    session_stats_t stats;
+    char id[64];
+    int i;
+
+    for (i = 0; i < HELD; i++) {
+        snprintf(id, sizeof(id), "held-%d", i);
+        held[i] = session_init(id);
+    }
+
+    if (!start_handshake(held[0]))
+        return 1;
+
+    /* more distinct sessions than the store holds */
+    for (i = 0; i < CHURN; i++) {
+        if (!touch("churn", i)) {
+            log_error("session %d was not created", i);
+            return 1;
+        }
+    }
+
+    session_get_stats(&stats);
+    log_info("%lu live, %lu evicted after %d sessions", stats.live, stats.evicted, CHURN);
+
+    if (stats.live > CAPACITY || stats.evicted < CHURN - CAPACITY) {
+        log_error("store holds %lu sessions, capacity is %d", stats.live, CAPACITY);
+        return 1;
+    }
+
+    /* sessions with open handles are never evicted */
+    for (i = 0; i < HELD; i++) {
+        snprintf(id, sizeof(id), "held-%d", i);
+
+        session_t *session = session_init(id);
+        session_close(session);
+
+        if (session != held[i]) {
+            log_error("held session %d was evicted", i);
+            return 1;
+        }
+
+        session_close(held[i]);
+    }
+
+    struct timespec start;
+    pthread_t threads[THREADS];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, lookup_main, (void *)(unsigned long)i);
+
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    double ms = elapsed(&start);
+    log_info("%d lookups from %d threads in %.1f ms, %.0f per second",
+             THREADS * LOOKUPS, THREADS, ms, THREADS * LOOKUPS * 1000.0 / ms);
+
+    /* idle sessions expire, freeing the helper the handshake held */
+    sleep(TTL + 1);
+
+    for (i = 0; i < CAPACITY; i++)
+        touch("late", i);
+
+    session_get_stats(&stats);
+    log_info("%lu live, %lu expired after the TTL", stats.live, stats.expired);
+
+    if (stats.expired == 0) {
+        log_error("no session expired");
+        return 1;
+    }
+
+    session_t *session = session_init("late-handshake");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!start_handshake(session) || elapsed(&start) > 1000) {
+        log_error("the helper of an evicted session was not released");
+        return 1;
+    }
+
+    session_close(session);
+    session_store_free();
+    ntlm_auth_pool_destroy();
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   tests fault detection on SOAP responses and compares the
+ *          fault flag against the XPath walk it replaced
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include <libxml/xpath.h>
+
+#include <log.h>
+
+#include <libcsoap/soap-env.h>
+
+#define RESPONSE_NODES 10000
+#define ROUNDS 100
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int xpath_fault(SoapEnv *env)
+{
+    xmlXPathContextPtr xpathctx = xmlXPathNewContext(env->root->doc);
+    xmlXPathObjectPtr xpathobj = xmlXPathEvalExpression(BAD_CAST "//Fault", xpathctx);
+    int result = xpathobj->nodesetval ? xpathobj->nodesetval->nodeNr : 0;
+
+    xmlXPathFreeObject(xpathobj);
+    xmlXPathFreeContext(xpathctx);
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    if (!log_open(NULL, LOG_INFO, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    SoapEnv *env = NULL;
+    if (soap_env_new_with_method("urn:test", "QueryNodesResponse", &env) != H_OK)
+        return 1;
+
+    int i;
+    for (i = 0; i < RESPONSE_NODES; i++)
+        xmlNewChild(env->cur, NULL, BAD_CAST "Node", BAD_CAST "value");
+
+    SoapEnv *faultenv = NULL;
+    if (soap_env_new_with_fault(Fault_Server, "test", "", "", &faultenv) != H_OK)
+        return 1;
+
+    if (env->fault || !faultenv->fault) {
+        log_error("fault flag is %d on the response and %d on the fault",
+                  env->fault, faultenv->fault);
+        return 1;
+    }
+
+    struct timespec start;
+    int hits = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < ROUNDS; i++)
+        hits += xpath_fault(env);
+    log_info("XPath //Fault on %d nodes: %.3f ms per response",
+             RESPONSE_NODES, elapsed(&start) / ROUNDS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < ROUNDS; i++)
+        hits += *(volatile int *)&env->fault;
+    log_info("fault flag on %d nodes: %.6f ms per response",
+             RESPONSE_NODES, elapsed(&start) / ROUNDS);
+
+    if (hits != 0) {
+        log_error("response without fault reported %d faults", hits);
+        return 1;
+    }
+
+    soap_env_free(env);
+    soap_env_free(faultenv);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+/**
+ * Bonsai - open source group collaboration and application lifecycle management
+ * Copyright (c) 2011 Bob Carroll
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/**
+ * @brief   measures TLS send throughput of the socket layer with the
+ *          OpenSSL record layer and with kernel TLS, when available
+ *
+ * @author  Bob Carroll (bob.carroll@alum.rit.edu)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <log.h>
+
+#include <nanohttp/nanohttp-common.h>
+#include <nanohttp/nanohttp-socket.h>
+#include <nanohttp/nanohttp-ssl.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define TOTAL_SIZE (256 * 1024 * 1024)
+
+static double elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* writes a self-signed certificate and its key to a temporary file */
+static int make_certificate(char *path)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    int fd = mkstemp(path);
+    FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
+    int result = 0;
+
+    if (key && cert && fp) {
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                                   (unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(cert, X509_get_subject_name(cert));
+
+        result = X509_sign(cert, key, EVP_sha256()) &&
+            PEM_write_X509(fp, cert) &&
+            PEM_write_PrivateKey(fp, key, NULL, NULL, 0, NULL, NULL);
+    }
+
+    if (fp)
+        fclose(fp);
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+
+    return result;
+}
+
+/* reads and drops everything the server sends */
+static void *client_main(void *arg)
+{
+    int port = *(int *)arg;
+    struct sockaddr_in addr;
+    char buf[CHUNK_SIZE];
+    long total = 0;
+    int n;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL *ssl = SSL_new(ctx);
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        SSL_set_fd(ssl, sock);
+
+        if (SSL_connect(ssl) == 1) {
+            while (total < TOTAL_SIZE && (n = SSL_read(ssl, buf, sizeof(buf))) > 0)
+                total += n;
+        }
+    }
+
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    close(sock);
+
+    *(int *)arg = total == TOTAL_SIZE;
+    return NULL;
+}
+
+static int run(const char *cert, const char *ktls)
+{
+    char *argv[] = { "ssl-throughput", NHTTP_ARG_HTTPS, NHTTP_ARG_CERT, (char *)cert,
+                     NHTTP_ARG_KTLS, (char *)ktls };
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    hsocket_t listener, conn;
+    pthread_t client;
+    struct timespec start;
+    static char chunk[CHUNK_SIZE];
+    long sent;
+    int arg;
+    double ms;
+
+    if (hssl_module_init(6, argv) != H_OK)
+        return 0;
+
+    hsocket_init(&listener);
+    hsocket_init(&conn);
+
+    if (hsocket_bind(&listener, 0) != H_OK || hsocket_listen(&listener) != H_OK)
+        return 0;
+
+    getsockname(listener.sock, (struct sockaddr *)&addr, &len);
+    arg = ntohs(addr.sin_port);
+    pthread_create(&client, NULL, client_main, &arg);
+
+    if (hsocket_accept(&listener, &conn) != H_OK)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (sent = 0; sent < TOTAL_SIZE; sent += CHUNK_SIZE) {
+        if (hsocket_nsend(&conn, chunk, CHUNK_SIZE) != H_OK)
+            break;
+    }
+
+    pthread_join(client, NULL);
+    ms = elapsed(&start);
+
+    log_info("ktls=%s (in kernel: %s): %d MB in %.1f ms, %.1f MB/s", ktls,
+             conn.ktls ? "yes" : "no", TOTAL_SIZE >> 20, ms,
+             (TOTAL_SIZE >> 20) * 1000.0 / ms);
+
+    hsocket_close(&conn);
+    hsocket_close(&listener);
+    hssl_module_destroy();
+
+    return arg;
+}
+
+int main(int argc, char **argv)
+{
+    if (!log_open(NULL, LOG_INFO, 1)) {
+        fprintf(stderr, "%s: failed to open log file!\n", argv[0]);
+        return 1;
+    }
+
+    char cert[] = "/tmp/ssl-throughput-XXXXXX";
+    if (!make_certificate(cert)) {
+        log_error("failed to create a certificate");
+        return 1;
+    }
+
+    /* the second run falls back to user space without kernel support */
+    int result = run(cert, "0") && run(cert, "1");
+    unlink(cert);
+
+    if (!result) {
+        log_error("client did not receive all data");
+        return 1;
+    }
+
+    return 0;
+}